@@ -0,0 +1,77 @@
+#!/bin/bash
+
+# Runs a small sweep on localhost: one coordinator and several worker
+# processes, with one worker killed part way to check that its run is
+# handed out again. Every run must end with a final state on disk.
+# Usage: ./distlocal.sh BINARY [WORKERS] [RUNS] [PORT]
+#   BINARY   main.c built with DISTRIBUTE set to 1
+#   WORKERS  worker processes to start (default 3)
+#   RUNS     runs in the sweep (default 6)
+#   PORT     coordinator port (default 47000 + pid % 1000)
+
+set -e
+
+if [ -z "$1" ] || [ ! -x "$1" ]; then
+    echo "Error: no DISTRIBUTE build given"
+    echo "Usage: $0 BINARY [WORKERS] [RUNS] [PORT]"
+    exit 1
+fi
+
+BINARY=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+WORKERS=${2:-3}
+RUNS=${3:-6}
+PORT=${4:-$((47000 + $$ % 1000))}
+SIZE=16
+
+WORKDIR=$(mktemp -d)
+trap 'kill $(jobs -p) 2>/dev/null || true' EXIT
+cd "$WORKDIR"
+
+# the highest state of a SIZExSIZE lattice with the fixed boundary:
+# row i is SIZE-1-i b1 vertices, one c2, then i b2 vertices
+awk -v n=$SIZE 'BEGIN {
+    for(i=0;i<n;i++) {
+        for(j=0;j<n-1-i;j++) printf "2"
+        printf "5"
+        for(j=0;j<i;j++) printf "3"
+    }
+}' > start.matrix
+
+# one line per run: matrix, rows, cols, six weights, seed, flips to
+# do and a time limit in seconds
+for k in $(seq 1 "$RUNS"); do
+    echo "start.matrix $SIZE $SIZE 1 1 1 1 1 1 $k 5000000 0"
+done > sweep.txt
+
+echo "Sweep of $RUNS runs on $WORKERS workers, port $PORT, in $WORKDIR"
+"$BINARY" -c "$PORT" sweep.txt > coordinator.log 2>&1 &
+COORDINATOR=$!
+sleep 1
+
+for i in $(seq 1 "$WORKERS"); do
+    "$BINARY" -w 127.0.0.1 "$PORT" > worker$i.log 2>&1 &
+    eval "WORKER$i=$!"
+done
+
+# a worker that dies mid-run must not lose its run
+if [ "$WORKERS" -gt 1 ]; then
+    sleep 1
+    kill -9 "$WORKER1" 2>/dev/null || true
+    echo "Killed worker 1"
+fi
+
+wait "$COORDINATOR" || true
+cat coordinator.log
+
+if ! grep -q "Sweep finished: $RUNS runs" coordinator.log; then
+    echo "Error: the sweep did not finish"
+    exit 1
+fi
+for k in $(seq 1 "$RUNS"); do
+    if [ ! -s output/*/text/seed$k.matrix ]; then
+        echo "Error: no final state for seed $k"
+        exit 1
+    fi
+done
+
+echo "All $RUNS runs written to $WORKDIR/output"
@@ -15,10 +15,24 @@
 //  Includes / Defines           // = // = // = // = // = // = // = // = // = //
 //==============================================================================
 
+#define _GNU_SOURCE                             // cpu affinity calls for pinning
 #include <stdio.h>                              // standard input/output
 #include <string.h>                             // string handling
 #include <stdlib.h>                             // standard libraries
 #include <time.h>                               // time lib for srand()
+#include <math.h>                               // log/pow for weights
+#include <pthread.h>                            // threads for parallel runs
+#include <unistd.h>                             // fork for output snapshots
+#include <sys/wait.h>                           // reaping snapshot children
+#include <sys/stat.h>                           // mkdir for output directories
+#include <fcntl.h>                              // open for snapshot files
+#include <sched.h>                              // cpu sets for pinning
+#include <poll.h>                               // coordinator waits on workers
+#include <netdb.h>                              // worker looks up the coordinator
+#include <sys/socket.h>                         // sweep coordinator and workers
+#include <netinet/in.h>                         //   talk over TCP
+#include <netinet/tcp.h>                        // keepalive timing for workers
+#include <signal.h>                             // flight recorder dumps on SIGUSR1
 #include <cpdflib.h>                            // pdf lib
 
 
@@ -31,6 +45,16 @@
 #define PRINT_PDF       "pdf"                   // pdf output directory
 #define PRINT_CDENSITY  "c-density"             // c-density output directory
 #define PRINT_CDENSITYPDF  "c-density-pdf"      // c-density output directory
+#define PRINT_CDENSITYPNG  "c-density-png"      // c-density output directory
+#define PRINT_ANNEAL    "anneal"                // annealing output directory
+#define PRINT_VITERBI   "viterbi"               // exact solver output directory
+#define PRINT_BATCH     "batch"                 // batched lattices output directory
+#define PRINT_POOL      "pool"                  // pooled chains output directory
+#define PRINT_COMPONENTS "components"           // domain statistics directory
+#define PRINT_PATTERNS  "patterns"              // pattern histogram directory
+#define PRINT_CORRELATE "correlations"          // correlation curve directory
+#define PRINT_RECORDER  "recorder"              // flight recorder dump directory
+#define PRINT_DIFFERENCE "difference"           // chain difference directory
 
 #define VERTICES    "./v1/"                     // vertex pictures directory
 
@@ -38,6 +62,10 @@
 #define VOLUME       1                          // enable volume determination
 #define CDENSITY     1                          // enable C vertex density plots
 #define CDENSITYPDF  1                          // enable C vertex density plots
+#define CDENSITYPNG  1                          // enable C vertex density PNGs
+#define CDENSITYDEPTH 8                         // bits per density sample, 8 or 16
+#define CDENSITYCOLOR 0                         // colormap the density (set to 1)
+                                                //   instead of gray
 #define TEXT         1                          // enable text output
 #define MATHEMATICA  0                          // enable Mathematica output
                                                 //   (don't enable at same time
@@ -49,6 +77,228 @@
 #define STICKY       0                          // make the vertices "stick" together
                                                 // and not violate heights
 
+#define FIXED        0                          // boundary as loaded by parse
+#define CYLINDER     1                          // columns wrap, rows fixed
+#define PERIODIC     2                          // rows and columns wrap (torus)
+#define BOUNDARY     FIXED                      // boundary the flips use
+
+#define DOMAIN       0                          // flip only inside the region
+                                                //   given by a mask file (set to 1)
+#define TILESHIFT    3                          // 8x8 tiles, one 64-bit
+                                                //   occupancy word each
+
+#define INHOMOGENEOUS 0                         // weights per row and column
+                                                //   class from a table file
+                                                //   (set to 1)
+#define MAXCLASSES   16                         // max row classes x col classes
+
+#define SCHEDULE     0                          // change the weights during the
+                                                //   run from a schedule file
+                                                //   (set to 1)
+#define MAXSCHEDULE  4096                       // max change points
+
+#define ANNEAL       0                          // search for the most probable
+                                                //   state instead of sampling
+                                                //   (set to 1)
+#define ANNEALCHAINS 8                          // parallel annealing restarts
+#define ANNEALSWEEPS 2000                       // sweeps from beta=1 to the end
+#define ANNEALBETA   40.0                       // final inverse temperature
+#define ANNEALPLACE  SCATTER                    // restarts share nothing
+
+#define VITERBI      0                          // find the exact most probable
+                                                //   state by transfer matrix
+                                                //   (set to 1, ncols <= 16)
+#define VITERBIMAXCOLS 16                       // widest row the solver takes
+#define VITERBITHREADS 4                        // threads expanding row states
+#define VITERBIPLACE COMPACT                    // threads share the score rows
+
+#define BATCH        0                          // run many copies of a small
+                                                //   first matrix instead (set to 1)
+#define BATCHLATTICES 4096                      // copies, each its own stream
+#define BATCHSWEEPS  10000                      // sweeps of every copy
+#define BATCHTHERMAL 1000                       // sweeps before measuring
+#define BATCHMEASURE 10                         // sweeps between measurements
+#define BATCHBLOCK   32                         // copies stepped side by side
+#define BATCHTHREADS 4                          // threads over the copies
+#define BATCHPLACE   SCATTER                    // ranges share nothing
+
+#define POOL         0                          // run the chains listed in a job
+                                                //   file on shared threads instead
+                                                //   (set to 1)
+#define POOLTHREADS  4                          // threads the chains share
+#define POOLPLACE    COMPACT                    // chains move between threads,
+                                                //   so keep them on one cache
+#define POOLCHUNK    4096                       // attempts between slice checks
+#define POOLSLICE    2000                       // microseconds a chain runs
+                                                //   before it yields its thread
+#define MAXPOOLJOBS  4096                       // max chains in a job file
+
+#define DISTRIBUTE   0                          // "main -c port sweepfile" hands
+                                                //   runs to "main -w host port"
+                                                //   workers over TCP (set to 1)
+#define MAXDISTJOBS  4096                       // max runs in a sweep file
+#define MAXDISTWORKERS 64                       // max workers connected at once
+#define DISTGRACE    30                         // seconds past a run's limit
+                                                //   before its worker counts as lost
+#define DISTTIMEOUT  10                         // seconds a message may stall
+#define DISTKEEPIDLE 30                         // seconds a quiet worker goes
+                                                //   before its host is probed
+#define DISTKEEPINTVL 5                         // seconds between probes,
+#define DISTKEEPCNT  4                          //   and probes unanswered before
+                                                //   the worker counts as lost
+
+#define DISTWAITING  0                          // states of a run in a sweep
+#define DISTRUNNING  1
+#define DISTDONE     2
+
+#define PARALLEL     0                          // sweep tiles of both matrices
+                                                //   on threads (set to 1)
+#define PARALLELTHREADS 4                       // sweep threads
+#define PARALLELTILE 32                         // tile side; results depend on
+                                                //   this but not on the threads
+#define PARALLELPLACE SCATTER                   // neighbouring tiles off the
+                                                //   two threads of one core
+#define PARALLELREBALANCE 16                    // sweeps between moving tiles
+                                                //   to even out the work (0 = never)
+#define SEED         0                          // run seed, 0 = from the clock
+
+#define PIN          0                          // pin worker threads to cpus by
+                                                //   the sysfs topology (set to 1)
+#define COMPACT      0                          // fill both threads of a core
+#define SCATTER      1                          //   first, or one per core first
+#define MAXCPUS      1024                       // max cpus read from sysfs
+
+#define FORK         0                          // write outputs from a forked
+                                                //   copy-on-write child (set to 1)
+#define FORKCHILDREN 2                          // most children writing at once
+
+#define COMPRESS     0                          // write text snapshots entropy
+                                                //   coded as .vtc (set to 1)
+#define CODERBITS    12                         // coder probability precision
+#define CODERSHIFT   5                          // coder adaptation rate
+#define CODERLIMIT   31                         // keeps probabilities off 0 and 1
+#define RCADAPT(p,bit)  ((p) += ((int) ((bit) ? CODERLIMIT : (1 << CODERBITS) - CODERLIMIT) \
+                                 - (int) (p)) >> CODERSHIFT)
+
+#define SINKFILES    0                          // outputs as files in the run
+#define SINKNULL     1                          //   directory, discarded, in one
+#define SINKARCHIVE  2                          //   tar archive beside it, or as
+#define SINKPIPE     3                          //   a tar stream into a command
+#define SINK         SINKFILES                  // where the outputs go
+#define SINKPIPECMD  ""                         // command for SINKPIPE
+#define SINKHANDLES  16                         // append logs kept open
+#define SINKBUFFER   (1 << 16)                  // append log buffer size
+
+#define MEMBUDGET    0                          // megabytes the plan may reach,
+                                                //   0 = report it, never enforce
+#define MEMDEGRADE   1                          // over budget, give up optional
+                                                //   outputs first (0 = refuse)
+#define PDFBYTES     400                        // heap a pdf takes per position
+                                                //   while it is built
+
+#define ALLOCCHECK   0                          // count heap allocations and
+                                                //   report them with the success
+                                                //   rate (glibc only, set to 1)
+
+#define VIDEO        0                          // stream frames as Y4M (set to 1)
+#define VIDEOTYPES   0                          // frames of the vertex types,
+#define VIDEODENSITY 1                          //   the c-density, or where
+#define VIDEODIFFERENCE 2                       //   the two matrices differ
+#define VIDEOMODE    VIDEOTYPES                 // what the frames show
+#define VIDEOSCALE   4                          // positions per pixel side
+#define VIDEOPIPE    ""                         // command to pipe frames to,
+                                                //   "" = lattice.y4m in the run
+
+#define COMPONENTS   0                          // label frozen domains and the
+                                                //   disordered region (set to 1)
+#define COMPONENTTHREADS 4                      // threads labelling bands of rows
+#define COMPONENTMIN 16                         // smallest component listed
+#define COMPONENTMAP 0                          // also write the label map
+                                                //   (set to 1)
+
+#define PATTERNS     0                          // count every 2x2 and 1x3 pattern
+                                                //   of vertex types (set to 1)
+#define PATTERNREGION 0                         // side of the square regions
+                                                //   counted apart, 0 = one region
+#define PATTERNSQUARES 1296                     // 2x2 patterns, 6^4
+#define PATTERNTRIPLES 216                      // 1x3 patterns each way, 6^3
+#define PATTERNSLOTS (PATTERNSQUARES + 2*PATTERNTRIPLES)  // counters per region
+
+#define CORRELATE    0                          // follow the height and c-density
+                                                //   fields over time (set to 1)
+#define CORRELATEORIGINS 8                      // origins followed at once
+#define CORRELATESPACING 1000000                // flips between new origins
+#define CORRELATEFIRST 1000                     // shortest lag in flips
+#define CORRELATEOCTAVE 4                       // lags per doubling
+#define CORRELATELAGS 64                        // lags recorded per origin
+
+#define RECORDER     0                          // keep the last frames and every
+                                                //   flip between them in memory,
+                                                //   dumped on SIGUSR1 or when the
+                                                //   watchdog trips (set to 1)
+#define RECORDERFRAMES 4                        // frames kept
+#define RECORDERSWEEPS 1                        // main loop passes between frames,
+                                                //   in positions of the matrix
+#define RECORDERSTALL 8                         // dump when neither volume moves
+                                                //   for this many frames, 0 = never
+#define RECORDERDROP 0.5                        // dump when a frame's acceptance
+                                                //   falls below this share of the
+                                                //   one before, 0 = never
+
+#define DIFFERENCE   0                          // render where the heights of
+                                                //   the two matrices disagree
+                                                //   (set to 1)
+#define DIFFERENCEGREY 160                      // grey of positions that agree
+
+#define SNAPTEXT        1                       // outputs a snapshot writes
+#define SNAPPDF         2
+#define SNAPCDENSITY    8
+#define SNAPVIDEO       16
+#define SNAPCOMPONENTS  32
+#define SNAPPATTERNS    64
+#define SNAPCORRELATE   128
+#define SNAPDIFFERENCE  256
+
+
+// neighbour indices for the boundary; with FIXED they are plain
+// arithmetic, so the DWBC flips pay nothing for the other geometries
+#if BOUNDARY == FIXED
+#define ROWUP(r)        ((r)-1)
+#define ROWDOWN(r)      ((r)+1)
+#define HIGHINBOUNDS(r,c)   ((r)>0 && (c)<(ncols-1))
+#define LOWINBOUNDS(r,c)    ((r)<(nrows-1) && (c)>0)
+#else
+#define ROWUP(r)        (BOUNDARY == PERIODIC && (r)==0 ? nrows-1 : (r)-1)
+#define ROWDOWN(r)      (BOUNDARY == PERIODIC && (r)==nrows-1 ? 0 : (r)+1)
+#define HIGHINBOUNDS(r,c)   (BOUNDARY == PERIODIC || (r)>0)
+#define LOWINBOUNDS(r,c)    (BOUNDARY == PERIODIC || (r)<(nrows-1))
+#endif
+#if BOUNDARY == FIXED
+#define COLLEFT(c)      ((c)-1)
+#define COLRIGHT(c)     ((c)+1)
+#else
+#define COLLEFT(c)      ((c)==0 ? ncols-1 : (c)-1)
+#define COLRIGHT(c)     ((c)==ncols-1 ? 0 : (c)+1)
+#endif
+// position of [r][c] in a chain's type plane; with DOMAIN the plane
+// only holds the tiles that have active cells in them
+#if DOMAIN
+#define CELL(r,c)       (domaintile[((r)>>TILESHIFT)*domaintilecols+((c)>>TILESHIFT)] \
+                         + (((r)&((1<<TILESHIFT)-1))<<TILESHIFT) + ((c)&((1<<TILESHIFT)-1)))
+#else
+#define CELL(r,c)       ((r)*ncols+(c))
+#endif
+#define FLIPROW(r,t)    ((t) ? ROWUP(r) : ROWDOWN(r))   // row of yshift/dshift
+#define FLIPCOL(c,t)    ((t) ? COLRIGHT(c) : COLLEFT(c))  // col of xshift/dshift
+#define SEAMFLIP(c,t)   (BOUNDARY != FIXED && ((t) ? (c)==ncols-1 : (c)==0))
+                                                // flip across the wrapped column
+                                                //   edge, which moves the top
+                                                //   edge of column 0 and so
+                                                //   every height of its row
+#define PATTERNAT(r,c)  (((r)/patternside*patternregioncols + (c)/patternside) * PATTERNSLOTS)
+                                                // counters of the region of a
+                                                //   window's top left position
+#define MEGABYTES(b)    (((b) + (1 << 20) - 1) >> 20)   // bytes to MB, rounded up
 
 //==============================================================================
 //  Structures                   // = // = // = // = // = // = // = // = // = //
@@ -60,6 +310,122 @@ struct mstruct {
     int     height;                             // holds each position's height
 };
 
+typedef struct cstruct cstruct;                 // chain structure:
+struct cstruct {
+    unsigned char *type;                        // row-major position types
+    double  logweight;                          // running log-weight
+    unsigned long long rng;                     // private random stream
+    long long   flipcompleted, flipfailed;      // counters for success/failure
+};
+
+typedef struct rstruct rstruct;                 // range coder structure:
+struct rstruct {
+    unsigned long long low;                     // encoder: bottom of the range
+    unsigned int    range;                      // width of the range
+    unsigned int    code;                       // decoder: value read so far
+    unsigned char   cache;                      // encoder: byte held for carry
+    long long   cachesize;                      // encoder: bytes held
+    unsigned char   *buf;                       // coded bytes
+    long long   pos, cap;                       // position in and size of buf
+};
+
+#if SCHEDULE
+typedef struct sstruct sstruct;                 // schedule change point:
+struct sstruct {
+    long long   at;                             // flips completed to apply at
+    double      w[6];                           // weights from then on
+};
+#endif
+
+#if VITERBI
+typedef struct vstruct vstruct;                 // transfer matrix thread structure:
+struct vstruct {
+    int     id;                                 // thread number
+    int     lo, hi;                             // profile states it expands
+};
+#endif
+
+#if BATCH
+typedef struct bstruct bstruct;                 // batch thread structure:
+struct bstruct {
+    int     id, lo, hi;                         // copies it steps
+    long long   flipcompleted, attempts;        // counters for success/attempts
+    long long   samples;                        // measurements taken
+    long long   sumc, sumc2, sumv, sumv2;       // c-vertex and volume moments
+    long long   *histogram;                     // samples per c-vertex count
+};
+#endif
+
+#if POOL || DISTRIBUTE
+typedef struct pstruct pstruct;                 // pooled chain structure:
+struct pstruct {
+    cstruct chain;                              // plane, stream and counters
+    int     rows, cols;                         // its own size
+    double  w[6], rho;                          // its own weights
+    long long   flipstodo;                      // flips before it stops
+    long long   interval, nextat;               // flips between snapshots
+    double  used;                               // microseconds run so far
+    int     slices, outputs, done;              // yields, snapshots, stopped
+};
+#endif
+
+#if DISTRIBUTE
+typedef struct jstruct jstruct;                 // distributed run structure:
+struct jstruct {
+    int     rows, cols;                         // its size
+    double  w[6];                               // its weights
+    unsigned long long seed;                    // its stream
+    long long   flipstodo;                      // flips before it stops
+    int     seconds;                            //   or seconds (0 = no limit)
+    char    *plane;                             // types as text, the start
+                                                //   then the final state
+    int     state;                              // DISTWAITING, DISTRUNNING or
+                                                //   DISTDONE
+    int     worker;                             // connection running it
+    int     handouts;                           // times it was handed out
+    time_t  started;                            // when it was last handed out
+    long long   flipcompleted, flipfailed;      // results: counters,
+    double  elapsed, cdensity, volume, logweight;   //   time and observables
+};
+#endif
+
+#if CORRELATE
+typedef struct tstruct tstruct;                 // correlation origin structure:
+struct tstruct {
+    short   *height[2];                         // each matrix's heights and
+    unsigned char *c[2];                        //   c vertices at the origin
+    long long   hh[2], cc[2];                   // products of then and now,
+                                                //   summed over positions
+    double  h0[2], c0[2];                       // means at the origin
+    double  hvar[2], cvar[2];                   // variances at the origin
+    long long   at;                             // flips completed at the origin
+    int     lag;                                // next lag to record, -1 = free
+};
+#endif
+
+#if RECORDER
+typedef struct fstruct fstruct;                 // flight recorder frame:
+struct fstruct {
+    unsigned char *type[2];                     // both matrices, two positions
+                                                //   to a byte
+    long long   pass;                           // main loop passes at the frame
+    long long   flipcompleted, flipfailed;      // counters at the frame
+    long long   journal;                        // flips journalled before it
+    double  acceptance;                         // acceptance since the last one
+    int     volume[2];                          // volumes at the frame
+};
+#endif
+
+#if ANNEAL
+typedef struct astruct astruct;                 // annealing restart structure:
+struct astruct {
+    cstruct chain;                              // the annealed chain
+    unsigned char *best;                        // best type plane seen
+    double  bestlogweight;                      // log-weight of best
+    int     id;                                 // restart number
+};
+#endif
+
 //==============================================================================
 //  Globals                      // = // = // = // = // = // = // = // = // = //
 //==============================================================================
@@ -96,12 +462,259 @@ time_t  firsttime, secondtime;                  // timers for success rates
 int     cdensitystep = 0;                       // density printout step size
 #endif
 
+// new type of each flipped position, indexed [type][position][old type]
+// with positions ordered base, xshift, yshift, dshift as in getweightratio
+const unsigned char flipmap[2][4][6] = {
+    { {5,1,2,3,1,5}, {0,1,2,4,4,2}, {0,1,4,3,4,3}, {0,5,2,3,0,5} },  // LOW
+    { {4,1,2,3,4,1}, {0,1,2,5,2,5}, {0,1,5,3,3,5}, {0,4,2,3,4,0} }   // HIGH
+};
+
+char    outputdir[256];                         // output directory for this run
+int     chainsize = 0;                          // positions in a chain's plane
+int     chainsites = 0;                         // positions a flip can pick
+
+#if DOMAIN
+int     *domaintile;                            // tile -> first position in
+                                                //   the plane, or -1 if empty
+unsigned long long *domainoccupancy;            // active cells of each tile
+int     *domainactive;                          // active cells as row<<16|col
+int     domaintilerows, domaintilecols;         // tiles covering the matrix
+int     domaintiles = 0, domaincells = 0;       // stored tiles, active cells
+#endif
+
+#if INHOMOGENEOUS
+double  classwts[MAXCLASSES][6];                // weights of each class pair
+double  classbase[MAXCLASSES][6];               //   and the same over rho, for
+                                                //   the flipped position itself
+unsigned char siteclass[MAXROWS][MAXCOLS];      // class pair of each position
+int     rowclasses, colclasses;                 // number of classes
+#endif
+
+#if SCHEDULE
+sstruct schedule[MAXSCHEDULE];                  // change points in flip order
+int     schedulelength = 0;                     // change points loaded
+int     schedulestage = 0;                      // change points applied
+long long   schedulenextat = 0;                 // flips of the next change
+#endif
+
+unsigned long long runseed;                     // seed every stream derives from
+
+#if PIN
+int     topologycpus = 0;                       // cpus this process may run on
+int     topologycpu[MAXCPUS];                   // their numbers
+int     topologycore[MAXCPUS];                  // core of each
+int     topologypackage[MAXCPUS];               // package of each
+int     topologysmt[MAXCPUS];                   // thread of each within its core
+int     pincpu[MAXCPUS];                        // cpu of each worker
+#endif
+
+#if PARALLEL
+cstruct parallelchain[2];                       // both matrices as type planes
+long long   *paralleltileflips;                 // flips of each tile, summed
+long long   *paralleltilefails;                 //   in tile order after a sweep
+int     paralleltilerows, paralleltilecols;     // tiles covering the matrix
+int     paralleloffrow, paralleloffcol;         // tile grid shift this sweep
+long long   parallelepoch = 0;                  // sweeps completed
+double  *paralleltileload;                      // recent time of each tile, ns
+int     parallelbound[PARALLELTHREADS+1];       // thread i sweeps tiles from
+                                                //   bound[i] to bound[i+1]
+long long   parallelrebalances = 0;             // times the bounds were moved
+long long   parallelmoved = 0;                  // tiles that changed thread
+pthread_barrier_t parallelbarrier;              // sweep start/end barrier
+#endif
+
+long long   memoryplanned = 0;                  // peak bytes the plan expects
+int     pdfactive = 1;                          // vertex pdfs still written
+
+#if FORK
+int     forklimit = FORKCHILDREN;               // children allowed, 0 = write
+                                                //   snapshots in place
+int     forkchildren = 0;                       // snapshot children running
+pid_t   forkpid[FORKCHILDREN];                  // their pids, oldest first; a
+                                                //   popen'd encoder is never
+                                                //   among them
+pid_t   streamchild = 0;                        // child writing a shared stream
+#endif
+
+FILE    *sinkstream;                            // archive, pipe or null stream
+FILE    *sinkentry;                             // snapshot being built, kept
+char    *sinkentrybuf;                          //   open over one buffer sized
+size_t  sinkentrysize;                          //   for the largest snapshot
+char    sinkentryname[512];                     //   and the snapshot's path
+unsigned char *codedplane, *codedout;           // writecoded work buffers
+#if CDENSITY
+int     *cdensitysat;                           // summed-area table of c vertices
+unsigned char *cdensityraster;                  // density image, as PNG scanlines
+#endif
+FILE    *sinkhandle[SINKHANDLES];               // append logs kept open
+char    sinkhandlename[SINKHANDLES][512];       //   and their paths
+int     sinkhandles = 0;
+int     sinkpending = 0;                        // lines appended since the
+                                                //   last sinkflush
+
+#if ALLOCCHECK
+long long   allocations = 0;                    // heap allocations so far
+long long   allocationsreported = 0;            //   at the last report
+#endif
+
+#if COMPONENTS
+typedef struct kstruct kstruct;                 // component structure:
+struct kstruct {
+    int     size;                               // positions in it
+    int     minr, maxr, minc, maxc;             // bounding box
+    int     class;                              // type of a frozen domain,
+                                                //   or 6 if disordered
+};
+
+int     *componentparent;                       // union-find forest, then
+                                                //   the ids of its roots
+int     *componentlabel;                        // component of each position
+unsigned char *componentclass;                  // class of each position
+kstruct *component;                             // every component found
+int     componentcount;                         // components found
+int     componentroots[COMPONENTTHREADS+1];     // first id of each band
+unsigned char *componenttypes;                  // plane being labelled
+int     componentrows, componentcols;           //   and its size
+pthread_barrier_t componentbarrier;             // phase barrier
+int     lprint = 0;                             // counter for printing
+#endif
+
+#if PATTERNS
+int     *patternlive[2];                        // counts of each matrix now
+long long   *patternsum[2];                     // counts summed over samples
+long long   patternsamples = 0;                 // samples summed
+int     patternside;                            // region side in positions
+int     patternregionrows, patternregioncols;   // regions covering the matrix
+unsigned short *patterncode;                    // codes of a row of windows
+int     qprint = 0;                             // counter for printing
+#endif
+
+#if CORRELATE
+tstruct correlateorigin[CORRELATEORIGINS];      // origins being followed
+int     correlateorigins = CORRELATEORIGINS;    // origins the budget allows
+long long   correlatelag[CORRELATELAGS];        // lags in flips, increasing
+long long   correlatenextat;                    // flips completed at the next
+                                                //   record or origin
+long long   correlatenextorigin;                // flips completed at the next
+                                                //   origin
+long long   correlatehnow[2], correlatecnow[2]; // height and c sums now
+long long   correlatecount[CORRELATELAGS];      // records at each lag
+double  correlatesum[2][CORRELATELAGS][6];      // per matrix and lag, sums of
+                                                //   <h0 ht>, <h0><ht>, var h0,
+                                                //   then the same for c
+#endif
+
+#if RECORDER
+fstruct recorderring[RECORDERFRAMES];           // the frames kept
+int     recorderframes = 0;                     // frames taken so far
+unsigned int *recorderjournal;                  // ring of accepted flips, each
+                                                //   matrix<<31|type<<30|row<<15|col
+long long   recordercap;                        // its length
+long long   recorderhead = 0;                   // where the next flip goes
+long long   recorderflips = 0;                  // flips journalled so far
+long long   recorderpass = 0;                   // main loop passes so far
+long long   recorderinterval;                   // passes between frames
+long long   recordernextat = 0;                 // pass of the next frame
+int     recorderstall = 0;                      // frames with neither volume moving
+int     recordertripped = 0;                    // watchdog fired, not yet cleared
+int     recorderdumps = 0;                      // dumps written
+volatile sig_atomic_t recorderwanted = 0;       // SIGUSR1 asked for a dump
+#endif
+
+#if DIFFERENCE
+int     *differencerow;                         // positions of each row whose
+                                                //   heights differ
+long long   differencecount = 0;                // positions whose heights differ
+unsigned char *differenceraster;                // overlay, as PNG scanlines
+int     dprint = 0;                             // counter for printing
+#endif
+
+#if VIDEO
+FILE    *videostream;                           // Y4M file or pipe
+unsigned char *videoframe;                      // Y, U and V planes of a frame
+int     videowidth, videoheight;                // frame size in pixels
+#endif
+
+// path edges of each type: left = 1, top = 2, right = 4, bottom = 8
+const unsigned char vertexedges[6] = { 15, 0, 10, 5, 9, 6 };
+
+#if BATCH
+unsigned char *batcharena;                      // every copy's plane, one after
+                                                //   the other
+unsigned long long *batchrng;                   // each copy's random stream
+double  batchchance[2][6*6*6*6];                // flip chance by the old types
+                                                //   of base, x, y, d (0 if
+                                                //   the flip is not possible)
+#endif
+
+#if POOL
+pstruct *pooljobs;                              // every chain in the job file
+int     pooljobcount;                           // chains in the job file
+int     poolqueue[MAXPOOLJOBS];                 // chains waiting for a thread,
+int     poolhead, poolwaiting;                  //   oldest first
+int     poolactive;                             // chains not yet stopped
+pthread_mutex_t poollock = PTHREAD_MUTEX_INITIALIZER;   // guards the queue
+pthread_cond_t  poolwake = PTHREAD_COND_INITIALIZER;    // a chain was queued
+pthread_mutex_t poolsink = PTHREAD_MUTEX_INITIALIZER;   // one hook writes at
+                                                        //   a time
+#endif
+
+#if ANNEAL
+double  annealwts[ANNEALSWEEPS][6];             // effective weights per sweep
+double  annealrho[ANNEALSWEEPS];                // rho for each sweep
+int     annealstages = 0;                       // usable sweeps (no underflow)
+#endif
+
+#if VITERBI
+// a profile state is (vertical edge bits << 1 | horizontal carry bit);
+// bit j of the edges is the bottom of row r for j < c, else its top
+double  *viterbiscore[2];                       // best log-weight per state
+unsigned char *viterbichoice;                   // type chosen per step and state
+int     viterbitop, viterbibottom;              // boundary edge rows
+int     viterbileft[MAXROWS], viterbiright[MAXROWS];  // boundary edge cols
+double  viterbilogw[6];                         // log-weights
+pthread_barrier_t viterbibarrier;               // step barrier
+#endif
+
+#if ALLOCCHECK
+// glibc's own entry points, so every allocation (stdio's included)
+// passes through the counters below
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size) {
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+#endif
+
 //==============================================================================
 //  Function Prototypes          // = // = // = // = // = // = // = // = // = //
 //==============================================================================
 
 int nltrim(char s[]);
     // trims a newline character of a string if it exists
+long long memoryplan(int report);
+    // returns the peak bytes the run is expected to reach with the
+    // outputs still enabled, listing each part if report is set
+long long memoryitem(char *what, long long bytes, int report);
+    // lists one part of the plan if report is set; returns bytes
+int memorybudget(void);
+    // gives up optional outputs until the plan fits MEMBUDGET;
+    // returns 1 if it still does not
+int memoryresident(long long *rss, long long *peak);
+    // reads the resident and peak resident bytes; returns 0 on success
 #if TEXT
 void print_text(void);
 void print_text2(void);
@@ -121,21 +734,178 @@ void print_volume2(void);
 void print_cdensity(void);
 void print_cdensity2(void);
     // prints a C vertex density plot
+void cdensitytable(mstruct m[MAXROWS][MAXCOLS]);
+    // builds the summed-area table of the c vertices of m
+int cdensitycount(int i, int j);
+    // number of c vertices in the window centered on (i,j)
+long long cdensityimage(int *w, int *h);
+    // renders the window densities as PNG scanlines into cdensityraster,
+    // returns their length
+void print_cdensityimage(mstruct m[MAXROWS][MAXCOLS], char *sub, int pdf);
+    // writes the density of m as a one-image pdf page or as a PNG
 #endif
 #if CDENSITYPDF
 void print_cdensitypdf(void);
 void print_cdensitypdf2(void);
     // prints a C vertex density plot in pdf
 #endif
+#if CDENSITYPNG
+void print_cdensitypng(void);
+void print_cdensitypng2(void);
+    // prints a C vertex density plot as PNG
+#endif
 #if TOTALWEIGHT
 void print_totalweight(void);
 void print_totalweight2(void);
     // prints a total weight determination function
 #endif
+#if COMPONENTS
+void print_components(mstruct m[MAXROWS][MAXCOLS], char *sub);
+    // writes the component statistics (and label map) of m
+int components(unsigned char *t, int rows, int cols);
+    // labels the connected frozen domains and disordered regions of a
+    // type plane; returns the number of components
+void *componentband(void *arg);
+    // thread body labelling one band of rows
+static inline int componentfind(int i);
+    // root of i in the union-find forest
+static inline void componentunion(int i, int j);
+    // joins the trees of i and j, the smaller root winning
+#endif
+#if PATTERNS
+void patternscan(mstruct m[MAXROWS][MAXCOLS], int *counts);
+    // counts every window of m from scratch
+void patternflip(mstruct m[MAXROWS][MAXCOLS], int *counts, int rpos, int cpos, int type, int sign);
+    // adds (sign 1) or takes out (sign -1) every window a flip at
+    // rpos, cpos can change, as m stands now
+int patternspan(int *x, int below, int limit, int *out);
+    // the distinct window starts x[k]-below to x[k] within 0..limit
+void patternsample(void);
+    // adds the current counts of both matrices to the sums
+void print_patterns(int k, char *sub);
+    // writes the counts of matrix k and their average over the samples
+int patternname(int slot, char *out);
+    // writes the types of a counter's pattern; returns its shape
+#endif
+#if CORRELATE
+void correlatestart(void);
+    // works out the lags and the height and c sums to begin with
+void correlateflip(int k, mstruct m[MAXROWS][MAXCOLS], int rpos, int cpos, int type, int sign);
+    // adds (sign 1) or takes out (sign -1) the four positions of a
+    // flip of matrix k from the sums and every origin's products
+static inline void correlateat(int k, mstruct m[MAXROWS][MAXCOLS], int r, int c, int sign);
+    // the same for one position
+void correlaterow(int k, mstruct m[MAXROWS][MAXCOLS], int r, int sign);
+    // the same for a whole row, whose heights a seam flip moves
+void correlatestep(void);
+    // records the lags that have come and starts a new origin if due
+void print_correlations(int k, char *stem);
+    // writes the correlation curves of matrix k
+#endif
+#if RECORDER
+void recorderstart(void);
+    // makes the ring and the journal and takes the first frame
+void recordersignal(int sig);
+    // SIGUSR1 handler asking for a dump
+void recordercheck(void);
+    // takes a frame if one is due and dumps if asked or tripped
+void recordertake(void);
+    // packs both matrices into the oldest slot and runs the watchdog
+static inline void recordernote(int k, int rpos, int cpos, int type);
+    // journals one accepted flip of matrix k
+void recorderdump(char *reason);
+    // writes every frame kept and the flips since the oldest
+#endif
+int recorderreplay(char *dir, long long upto);
+    // replays a dump from its oldest frame, checking every later
+    // frame on the way; stops after upto flips if upto >= 0
+#if DIFFERENCE
+void differencestart(void);
+    // counts the positions whose heights differ from scratch
+void differencerecount(int r);
+    // counts row r again, after a seam flip moved its heights
+static inline void differenceflip(int rpos, int cpos, int type, int sign);
+    // takes out (sign -1) or adds back (sign 1) the one position whose
+    // height a flip at rpos, cpos changes
+void print_difference(void);
+    // writes matrix over matrix2: agreement grey, disagreement
+    // coloured by the height difference
+#endif
+#if VIDEO
+int videoopen(void);
+    // opens the Y4M stream and writes its header; returns 0 on success
+void print_video(void);
+    // renders the matrices as one downsampled frame of the stream
+#endif
+int sinkstart(void);
+    // opens the archive, pipe or null stream; returns 0 on success
+void sinkmkdir(char *sub);
+    // creates a directory of the run, if the sink writes files
+FILE *sinkopen(char *name, char *mode);
+    // opens an output: "a" gives an append log that stays open,
+    // anything else a snapshot file routed by SINK
+void sinkclose(FILE *data);
+    // finishes an output opened by sinkopen
+void sinkflush(void);
+    // flushes the append logs
+void sinkfinish(void);
+    // closes the append logs, ends the archive and closes the archive,
+    // pipe or null stream; registered with atexit by sinkstart
+void sinkwrite(char *name, char *buf, long long len);
+    // writes one tar entry to the sink stream
+#if PDF
+void sinkpdf(CPDFdoc *pdf, char *name);
+    // writes a finished pdf to the sink
+#endif
+void sinkimage(char *name, unsigned char *raster, long long len, int w, int h, 
+               int colors, int depth, int pdf, int bottom);
+    // writes PNG scanlines (gray or rgb, 8 or 16 bit) as a PNG, or as
+    // a pdf page drawing them at 2 points a pixel, bottom points up
+long long zlibstored(FILE *data, unsigned char *raw, long long len, unsigned int *crc);
+    // writes raw as a zlib stream of stored blocks, adding it to a PNG
+    // chunk crc if one is given; returns the stream length, and with
+    // data NULL writes nothing
+unsigned int pngcrc(unsigned int crc, unsigned char *buf, long long len);
+    // crc32 of a PNG chunk, continued over buf
+void pngchunk(FILE *data, char *type, unsigned char *buf, int len);
+    // writes a whole PNG chunk
+void snapshotstep(int due);
+    // steps the print counters the way the print functions do
+void snapshot(int due);
+    // writes the outputs flagged in due, from a forked child if
+    // FORK is set
+void snapshotwrite(int due);
+    // calls the print functions flagged in due
+#if FORK
+void snapshotwait(int limit);
+    // reaps finished children, blocking until fewer than limit run
+void snapshotforget(int k);
+    // drops the k-th child from forkpid once it has been reaped
+#endif
 void parse(FILE *data);
     // fills the global matrix with info from file *data
 void parse2(FILE *data);
     // fills the global matrix 2 with info from file *data
+#if DOMAIN
+int parsedomain(FILE *data);
+    // builds the tiled domain from a mask file of 0/1 characters,
+    // returns the number of active cells
+int domainisactive(int rpos, int cpos);
+    // checks if position [rpos][cpos] is inside the domain
+int domainplaquette(int rpos, int cpos, int type);
+    // checks if all 4 positions of a flip are inside the domain
+int getdomainposition(void);
+    // picks flipchoicerow/col from the active cells only
+#endif
+void loadplane(unsigned char *t, mstruct m[MAXROWS][MAXCOLS]);
+    // copies the types of m into a chain's type plane
+void writeplane(FILE *data, unsigned char *t);
+    // writes a chain's type plane in the print_text format
+void storeplane(unsigned char *t, mstruct m[MAXROWS][MAXCOLS]);
+    // copies a chain's type plane back into the types of m
+int checkboundary(mstruct m[MAXROWS][MAXCOLS]);
+    // checks that the path edges of m join up across the wrapped
+    // sides of the BOUNDARY; returns the number of mismatches
 int setheights(void);
     // sets the height of each vertex in the first matrix
     // returns the total height (volume) of the first matrix
@@ -147,8 +917,32 @@ double getweightratio(int *rpos, int *cpos, int *type);
     // corresponding points in the matrix
 double getweightratio2(int *rpos, int *cpos, int *type);
     // same thing for the second matrix
+#if SCHEDULE
+int parseschedule(FILE *data);
+    // expands the quenches and ramps of a schedule file into
+    // change points; returns 0 on success
+int parsescheduleentries(FILE *data);
+    // reads the entries, leaving the file open; returns 0 on success
+void applyschedule(void);
+    // applies every change point due and rebuilds rho
+void print_schedule(char *output, int index);
+    // records the schedule position of an output
+void snapshotschedule(int due);
+    // records the schedule position of the outputs flagged in due,
+    // with the counters their print functions will use
+#endif
 double definerho(void);
     //defines rho using various tests.
+double computerho(double *w);
+    // returns the rho definerho would give for the weights w
+#if INHOMOGENEOUS
+int parseclasses(FILE *data);
+    // reads the row/column classes and their weights; returns
+    // 0 on success
+double siterho(int rpos, int cpos);
+    // returns the largest high, low or biflip weight sum that
+    // the classes around [rpos][cpos] allow
+#endif
 int getflippablepositionrow(void);
     // returns a random int between 0 and nrows
 int getflippablepositioncol(void);
@@ -163,10 +957,146 @@ int executeflip(int *rpos, int *cpos, int *type);
     // with a type of flip corresponding to type
 int executeflip2(int *rpos, int *cpos, int *type);
     // same thing for the second matrix
+#if BOUNDARY != FIXED
+void heightseam(int k, mstruct m[MAXROWS][MAXCOLS], int row, int delta);
+    // adds delta to every height of a row of matrix k after a seam
+    // flip, keeping the volume and the trackers of heights in step
+#endif
 void updatepositions(int *rpos, int *cpos, int *type);
     // update the 4 positions on the matrix for a flip
 void updatepositions2(int *rpos, int *cpos, int *type);
     // same thing for the second matrix
+unsigned long long rngnext(unsigned long long *state);
+    // advances a splitmix64 stream and returns its next 64 bits
+double rnguniform(unsigned long long *state);
+    // returns a random real in [0,1) from the stream
+int chainisflippable(unsigned char *t, int rpos, int cpos, int type);
+    // getisflippable for a chain's type plane
+void chainupdate(unsigned char *t, int rpos, int cpos, int type);
+    // updatepositions for a chain's type plane
+double chainflipweight(unsigned char *t, int rpos, int cpos, int type, double *w);
+    // returns the product of the 4 new weights a flip would give
+double chainflipdelta(unsigned char *t, int rpos, int cpos, int type, double *logw);
+    // returns the change in log-weight a flip would give
+double chainlogweight(unsigned char *t, double *logw);
+    // returns the total log-weight of a type plane
+void getlogweights(double *logw);
+    // fills logw with the log of each weight
+int chainattempt(cstruct *ch, double *w, double rhow, double *logw);
+    // one flip attempt at a random position, using the same
+    // high/low/biflip choice as the main loop; returns 1 on a flip
+int chaintry(cstruct *ch, int rpos, int cpos, int high, int low,
+             double *w, double rhow, double *logw);
+    // the flip attempt of chainattempt at [rpos][cpos], with high
+    // and low saying which flips may be made; logw may be NULL
+#if ANNEAL
+void anneal(void);
+    // anneals ANNEALCHAINS restarts towards zero temperature and
+    // writes out the most probable state found
+void *annealchain(void *arg);
+    // thread body for one annealing restart
+int annealdescent(cstruct *ch, double *logw);
+    // greedy zero-temperature quench; returns the flips made
+#endif
+long long encodeplane(unsigned char *t, int rows, int cols, unsigned char *out, long long cap);
+    // entropy codes a row-major type plane into out; returns the
+    // bytes written (at most rows*cols + 16)
+int decodeplane(unsigned char *in, long long len, unsigned char *t, int rows, int cols);
+    // decodes a plane written by encodeplane; returns 0 on success
+long long encodesparse(unsigned char *t, int rows, int cols, unsigned char *out, long long cap);
+    // writes only the boundary and the c-vertex positions after the
+    // header, or just counts the bytes if out is NULL; returns 0 if
+    // the plane breaks the ice rule or takes cap bytes or more
+int decodesparse(unsigned char *in, long long len, unsigned char *t, int rows, int cols);
+    // rebuilds a plane from encodesparse output; returns 0 on success
+int readvarint(unsigned char *in, long long len, long long *pos, int *v);
+    // reads a 7-bit varint at *pos into v; returns 0 on success
+int writevarint(unsigned char *out, long long cap, long long *pos, int v);
+    // writes v as a 7-bit varint at *pos (counting only if out is NULL);
+    // returns 1 if it would reach cap
+static inline void rcput(rstruct *rc, unsigned char byte);
+    // appends a coded byte, dropping it if the buffer is full
+static inline void rcshift(rstruct *rc);
+    // moves the top byte of low out, holding 0xFF runs for carries
+static inline void rcencode(rstruct *rc, unsigned short *p, int bit);
+    // codes one bit with probability *p/2^CODERBITS of a 0
+static inline int rcdecode(rstruct *rc, unsigned short *p);
+    // decodes one bit coded by rcencode
+int decodefile(char *inname, char *outname);
+    // turns a .vtc file back into a .matrix file
+void writecoded(FILE *data, mstruct m[MAXROWS][MAXCOLS]);
+    // writes the types of m entropy coded
+#if PIN
+int readtopology(void);
+    // reads the cpus this process may use and their cores from sysfs
+void pinplan(char *engine, int place, int workers);
+    // chooses a cpu for each worker and reports the mapping
+void pinthread(int worker);
+    // pins the calling thread to its worker's cpu
+#endif
+#if PARALLEL
+void parallelstart(void);
+    // loads both matrices into type planes and starts the threads
+void parallelsweep(void);
+    // runs one sweep of every tile and brings the matrices, heights
+    // and counters up to date
+void *parallelthread(void *arg);
+    // thread body sweeping its share of the tiles
+void paralleltile(int tile);
+    // sweeps one tile of both matrices from its own random stream
+void parallelrebalance(void);
+    // moves the band bounds so each thread has the same recent work
+#endif
+#if BATCH
+void batch(void);
+    // samples BATCHLATTICES copies of the first matrix and writes
+    // out their aggregated observables
+void *batchrange(void *arg);
+    // thread body stepping one range of copies
+void batchmeasure(bstruct *job, unsigned char *t);
+    // adds one copy's c-vertex count and volume to job
+#endif
+#if POOL
+int parsepool(FILE *data);
+    // reads the job file, one chain per line
+void pool(void);
+    // runs every chain of the job file on POOLTHREADS threads
+void *poolthread(void *arg);
+    // thread body taking chains from the queue a slice at a time
+void poolyield(pstruct *job, int k);
+    // output and stop hooks run between slices
+#endif
+#if POOL || DISTRIBUTE
+void poolchunk(pstruct *job, int attempts);
+    // makes up to attempts flip attempts on one chain
+#endif
+#if DISTRIBUTE
+int distcoordinator(int port, char *sweepname);
+    // hands the runs of a sweep file to workers and writes their results
+int distworker(char *host, int port);
+    // runs whatever the coordinator hands out until it says QUIT
+int disthandout(int fd, jstruct *job, int k);
+    // sends one run to a worker
+int distcollect(int fd, jstruct *job, int k);
+    // reads one finished run back from a worker
+void distwrite(jstruct *job, int k);
+    // writes a finished run in the usual output layout
+int netread(int fd, char *buf, long long len);
+    // reads exactly len bytes
+int netwrite(int fd, char *buf, long long len);
+    // writes exactly len bytes
+int netline(int fd, char *buf, int cap);
+    // reads one line, without its newline
+#endif
+#if VITERBI
+void viterbi(void);
+    // finds the exact most probable state with the boundary of
+    // the first matrix and writes it out
+void viterbifree(void);
+    // frees the score and choice tables, whichever were allocated
+void *viterbirange(void *arg);
+    // thread body expanding one range of profile states
+#endif
 
 
 //==============================================================================
@@ -193,6 +1123,21 @@ int main(int argc, char **argv) {
     #if CDENSITY
     long long   printatcdensity = 50000;        // first printout (density)
     #endif
+    #if VIDEO
+    long long   printatvideo = 50000;           // first printout (video)
+    #endif
+    #if COMPONENTS
+    long long   printatcomponents = 50000;      // first printout (components)
+    #endif
+    #if PATTERNS
+    long long   printatpatterns = 50000;        // first printout (patterns)
+    #endif
+    #if CORRELATE
+    long long   printatcorrelate = 50000;       // first printout (correlations)
+    #endif
+    #if DIFFERENCE
+    long long   printatdifference = 50000;      // first printout (difference)
+    #endif
     #if SUCCESSRATE
     int     successrateinterval;                // success printout interval
     #endif
@@ -211,6 +1156,23 @@ int main(int argc, char **argv) {
     #if CDENSITY
     int     cdensityinterval;                   // density printout interval
     #endif
+    #if VIDEO
+    int     videointerval;                      // video frame interval
+    #endif
+    #if COMPONENTS
+    int     componentsinterval;                 // components printout interval
+    #endif
+    #if PATTERNS
+    int     patternsinterval;                   // patterns printout interval
+    #endif
+    #if CORRELATE
+    int     correlateinterval;                  // correlations printout interval
+    #endif
+    #if DIFFERENCE
+    int     differenceinterval;                 // difference printout interval
+    #endif
+    int     snapshotdue = 0;                    // outputs due this pass
+    long long   resident, residentpeak;         // resident bytes now and at most
     double  random;                             // random real used for tests
     double  flipchance, flipchance2;            // chance of flip occuring,
                                                 //   based on weight
@@ -224,9 +1186,39 @@ int main(int argc, char **argv) {
     char    filename[NAMELEN];                  // file name
     char    filename2[NAMELEN];                 // file name2
 
-    char    makeoutput[300];                    // output directory
+    #if DOMAIN
+    FILE    *domainfile;                        // domain mask file
+    #endif
+    #if INHOMOGENEOUS
+    FILE    *classfile;                         // class weight table
+    #endif
+    #if SCHEDULE
+    FILE    *schedulefile;                      // weight schedule
+    #endif
+    #if POOL
+    FILE    *poolfile;                          // chains to run
+    #endif
+    #if DOMAIN || INHOMOGENEOUS || SCHEDULE || POOL
+    int     argn = 14;                          // next optional argument
+    #endif
+    
+    // "main -d in.vtc out.matrix" decodes a coded snapshot
+    if(argc == 4 && strcmp(argv[1],"-d") == 0) return decodefile(argv[2], argv[3]);
+    
+    // "main -r dumpdir [flips]" replays a flight recorder dump
+    if((argc == 3 || argc == 4) && strcmp(argv[1],"-r") == 0) 
+        return recorderreplay(argv[2], argc == 4 ? atoll(argv[3]) : -1);
     
-    srand((unsigned)time(NULL));                // seed the random generator
+    #if DISTRIBUTE
+    // "main -c port sweepfile" coordinates a sweep, "main -w host port"
+    // works on one
+    if(argc == 4 && strcmp(argv[1],"-c") == 0) return distcoordinator(atoi(argv[2]), argv[3]);
+    if(argc == 4 && strcmp(argv[1],"-w") == 0) return distworker(argv[2], atoi(argv[3]));
+    #endif
+    
+    // seed the random generator; every stream derives from runseed
+    runseed = SEED ? (unsigned long long) SEED : (unsigned long long) time(NULL);
+    srand((unsigned) runseed);
 
     //------------------------------------------------------------------//
     //  Check for command line vars                                     //
@@ -272,7 +1264,72 @@ int main(int argc, char **argv) {
     cdensitystep = atoi(argv[12]);
     #endif
     
+    #if VIDEO
+    videointerval = atoi(argv[11]);
+    #endif
+    
+    #if COMPONENTS
+    componentsinterval = atoi(argv[11]);
+    #endif
+    
+    #if PATTERNS
+    patternsinterval = atoi(argv[11]);
+    #endif
+    
+    #if CORRELATE
+    correlateinterval = atoi(argv[11]);
+    #endif
+    
+    #if DIFFERENCE
+    differenceinterval = atoi(argv[11]);
+    #endif
+    
     flipstodo = atof(argv[13]);
+    
+    // optional files follow the flip count in this order
+    #if DOMAIN
+    if(argc <= argn) {
+        printf("*** domain mask file expected after the flip count\n");
+        return 0;
+    }
+    if((domainfile = fopen(argv[argn++],"r"))==NULL) {
+        printf("*** error opening domain mask\n");
+        return 0;
+    }
+    #endif
+    
+    #if INHOMOGENEOUS
+    if(argc <= argn) {
+        printf("*** class weight table expected after the flip count\n");
+        return 0;
+    }
+    if((classfile = fopen(argv[argn++],"r"))==NULL) {
+        printf("*** error opening class weight table\n");
+        return 0;
+    }
+    #endif
+    
+    #if SCHEDULE
+    if(argc <= argn) {
+        printf("*** weight schedule expected after the flip count\n");
+        return 0;
+    }
+    if((schedulefile = fopen(argv[argn++],"r"))==NULL) {
+        printf("*** error opening weight schedule\n");
+        return 0;
+    }
+    #endif
+    
+    #if POOL
+    if(argc <= argn) {
+        printf("*** job file expected after the flip count\n");
+        return 0;
+    }
+    if((poolfile = fopen(argv[argn++],"r"))==NULL) {
+        printf("*** error opening job file\n");
+        return 0;
+    }
+    #endif
        
    
     nltrim(filename);
@@ -295,6 +1352,12 @@ int main(int argc, char **argv) {
     printf("Matrices will not violate height parameters (\"sticking\" is enabled)\n");
     #endif
     
+    #if BOUNDARY == CYLINDER
+    printf("Boundary: cylinder (columns wrap)\n");
+    #elif BOUNDARY == PERIODIC
+    printf("Boundary: periodic (rows and columns wrap)\n");
+    #endif
+    
     
     printf("Weights:\n");
     printf("a1 = %lf, a2 = %lf\nb1 = %lf, b2 = %lf\nc1 = %lf, c2 = %lf",wts[0],wts[1],wts[2],wts[3],wts[4],wts[5]);
@@ -405,49 +1468,166 @@ int main(int argc, char **argv) {
      printf("step size for density plot (even integer): ");
      scanf("%d",&cdensitystep);
 #endif
+#if VIDEO
+     printf("interval to output video frame:       ");
+     scanf("%d",&videointerval);
+#endif
+#if COMPONENTS
+     printf("interval to output components:        ");
+     scanf("%d",&componentsinterval);
+#endif
+#if PATTERNS
+     printf("interval to output patterns:          ");
+     scanf("%d",&patternsinterval);
+#endif
+#if CORRELATE
+     printf("interval to output correlations:      ");
+     scanf("%d",&correlateinterval);
+#endif
+#if DIFFERENCE
+     printf("interval to output chain difference:  ");
+     scanf("%d",&differenceinterval);
+#endif
 
      printf("total flips to do:                    ");
      scanf("%d",&flipstodo);
 
+#if DOMAIN
+     printf("name of domain mask file:             ");
+     scanf("%79s",filename);
+     if((domainfile = fopen(filename,"r"))==NULL) {
+         printf("*** error opening domain mask\n");
+         return 0;
+     }
+#endif
+
+#if INHOMOGENEOUS
+     printf("name of class weight table:           ");
+     scanf("%79s",filename);
+     if((classfile = fopen(filename,"r"))==NULL) {
+         printf("*** error opening class weight table\n");
+         return 0;
+     }
+#endif
+
+#if SCHEDULE
+     printf("name of weight schedule:              ");
+     scanf("%79s",filename);
+     if((schedulefile = fopen(filename,"r"))==NULL) {
+         printf("*** error opening weight schedule\n");
+         return 0;
+     }
+#endif
+
+#if POOL
+     printf("name of job file:                     ");
+     scanf("%79s",filename);
+     if((poolfile = fopen(filename,"r"))==NULL) {
+         printf("*** error opening job file\n");
+         return 0;
+     }
+#endif
+
 }
+
+#if ANNEAL && (INHOMOGENEOUS || SCHEDULE)
+    // refuse before any directory, sink or banner exists
+    printf("*** annealing needs homogeneous weights and no schedule\n");
+    fclose(data);
+    fclose(data2);
+    #if INHOMOGENEOUS
+    fclose(classfile);
+    #endif
+    #if SCHEDULE
+    fclose(schedulefile);
+    #endif
+    return 0;
+#endif
      //------------------------------------------------------------------//
      //  Directory setup                                                 //
      //------------------------------------------------------------------//
 
+    // the directory is named after the starting weights, so it is
+    // built once and stays put if the weights change during the run
+    sprintf(outputdir,"./output/a1=%lf, a2=%lf, b1=%lf, b2=%lf, c1=%lf, c2=%lf, %dx%d",wts[0],wts[1],wts[2],wts[3],wts[4],wts[5],ncols,nrows);
+
     printf("Ensuring output directories are created...\n");     
-     // primary output directory for this matrix
-     sprintf(makeoutput,"mkdir \"./output/a1=%lf, a2=%lf, b1=%lf, b2=%lf, c1=%lf, c2=%lf, %dx%d\"",wts[0],wts[1],wts[2],wts[3],wts[4],wts[5],ncols,nrows);
-     system(makeoutput);
+     // primary output directory for this matrix; it holds the append
+     // logs for every sink but the null one
+     if(SINK != SINKNULL) {
+         mkdir("./output", 0777);
+         mkdir(outputdir, 0777);
+     }
 
 #if PDF
      // pdf output
-     sprintf(makeoutput,"mkdir \"./output/a1=%lf, a2=%lf, b1=%lf, b2=%lf, c1=%lf, c2=%lf, %dx%d/%s\"",wts[0],wts[1],wts[2],wts[3],wts[4],wts[5],ncols,nrows,PRINT_PDF);
-     system(makeoutput);
-    sprintf(makeoutput,"mkdir \"./output/a1=%lf, a2=%lf, b1=%lf, b2=%lf, c1=%lf, c2=%lf, %dx%d/%s2\"",wts[0],wts[1],wts[2],wts[3],wts[4],wts[5],ncols,nrows,PRINT_PDF);
-     system(makeoutput);
+     sinkmkdir(PRINT_PDF);
+     sinkmkdir(PRINT_PDF "2");
 #endif
 
 #if TEXT
      // text output
-     sprintf(makeoutput,"mkdir \"./output/a1=%lf, a2=%lf, b1=%lf, b2=%lf, c1=%lf, c2=%lf, %dx%d/%s\"",wts[0],wts[1],wts[2],wts[3],wts[4],wts[5],ncols,nrows,PRINT_TEXT);
-     system(makeoutput);
-     sprintf(makeoutput,"mkdir \"./output/a1=%lf, a2=%lf, b1=%lf, b2=%lf, c1=%lf, c2=%lf, %dx%d/%s2\"",wts[0],wts[1],wts[2],wts[3],wts[4],wts[5],ncols,nrows,PRINT_TEXT);
-     system(makeoutput);
+     sinkmkdir(PRINT_TEXT);
+     sinkmkdir(PRINT_TEXT "2");
 #endif
 
 #if CDENSITY
      // c-density output
-     sprintf(makeoutput,"mkdir \"./output/a1=%lf, a2=%lf, b1=%lf, b2=%lf, c1=%lf, c2=%lf, %dx%d/%s\"",wts[0],wts[1],wts[2],wts[3],wts[4],wts[5],ncols,nrows,PRINT_CDENSITY);
-     system(makeoutput);
-     sprintf(makeoutput,"mkdir \"./output/a1=%lf, a2=%lf, b1=%lf, b2=%lf, c1=%lf, c2=%lf, %dx%d/%s2\"",wts[0],wts[1],wts[2],wts[3],wts[4],wts[5],ncols,nrows,PRINT_CDENSITY);
-     system(makeoutput);
-    
-     sprintf(makeoutput,"mkdir \"./output/a1=%lf, a2=%lf, b1=%lf, b2=%lf, c1=%lf, c2=%lf, %dx%d/%s\"",wts[0],wts[1],wts[2],wts[3],wts[4],wts[5],ncols,nrows,PRINT_CDENSITYPDF);
-     system(makeoutput);
-     sprintf(makeoutput,"mkdir \"./output/a1=%lf, a2=%lf, b1=%lf, b2=%lf, c1=%lf, c2=%lf, %dx%d/%s2\"",wts[0],wts[1],wts[2],wts[3],wts[4],wts[5],ncols,nrows,PRINT_CDENSITYPDF);
-     system(makeoutput);
+     sinkmkdir(PRINT_CDENSITY);
+     sinkmkdir(PRINT_CDENSITY "2");
+     sinkmkdir(PRINT_CDENSITYPDF);
+     sinkmkdir(PRINT_CDENSITYPDF "2");
+     sinkmkdir(PRINT_CDENSITYPNG);
+     sinkmkdir(PRINT_CDENSITYPNG "2");
+#endif
+
+#if VITERBI
+     // exact solver output
+     sinkmkdir(PRINT_VITERBI);
+#endif
+
+#if BATCH
+     // batched lattices output
+     sinkmkdir(PRINT_BATCH);
+#endif
+
+#if POOL
+     // pooled chains output
+     sinkmkdir(PRINT_POOL);
+#endif
+
+#if COMPONENTS
+     // domain statistics output
+     sinkmkdir(PRINT_COMPONENTS);
+     sinkmkdir(PRINT_COMPONENTS "2");
+#endif
+
+#if PATTERNS
+     // pattern histogram output
+     sinkmkdir(PRINT_PATTERNS);
+     sinkmkdir(PRINT_PATTERNS "2");
+#endif
+
+#if CORRELATE
+     // correlation curve output
+     sinkmkdir(PRINT_CORRELATE);
+#endif
+
+#if DIFFERENCE
+     // chain difference output
+     sinkmkdir(PRINT_DIFFERENCE);
+#endif
+
+#if ANNEAL
+     // annealing output
+     sinkmkdir(PRINT_ANNEAL);
 #endif
 
+     if(sinkstart()) {
+         printf("*** error opening the output sink\n");
+         return 0;
+     }
+
 
     //------------------------------------------------------------------//
     //  Initialization                                                  //
@@ -456,14 +1636,132 @@ int main(int argc, char **argv) {
     // fill the matrices
     parse(data);
     parse2(data2);
+    
+    chainsize = nrows * ncols;
+    chainsites = nrows * ncols;
+    
+#if DOMAIN
+    // flips are only attempted on the active cells
+    if(parsedomain(domainfile) == 0) {
+        printf("*** domain mask has no active cells\n");
+        return 0;
+    }
+    chainsize = domaintiles << (2*TILESHIFT);
+    chainsites = domaincells;
+    printf("Domain: %d active cells in %d tiles (%d%% of the matrix)\n",
+           domaincells, domaintiles, (int) ((long long) domaincells * 100 / (nrows*ncols)));
+#endif
+    
+#if BOUNDARY != FIXED
+    // wrapped sides must join up or flips would break the ice rule
+    if(checkboundary(matrix) || checkboundary(matrix2)) {
+        printf("*** matrix edges do not join up across the boundary\n");
+        return 0;
+    }
+#endif
      
+#if SCHEDULE
+    if(parseschedule(schedulefile) || INHOMOGENEOUS) {
+        printf("*** error reading weight schedule (homogeneous weights only)\n");
+        return 0;
+    }
+    printf("Schedule: %d weight changes\n",schedulelength);
+#endif
+
+#if INHOMOGENEOUS
+    if(parseclasses(classfile)) {
+        printf("*** error reading class weight table\n");
+        return 0;
+    }
+    printf("Weights: %d row classes x %d column classes\n",rowclasses,colclasses);
+#endif
+    
     // set up rho (weight multiplier)
     definerho();
     
+    // the seed is all it takes to repeat this run
+    printf("Seed: %llu\n",runseed);
+    
     // set the heights on each vertex to begin
     matrixvol = setheights();
     matrixvol2 = setheights2();
+#if DIFFERENCE
+    differencestart();
+#endif
+    
+#if POOL
+    // the chains are planned for along with everything else
+    if(parsepool(poolfile) || DOMAIN || INHOMOGENEOUS || SCHEDULE) {
+        printf("*** error reading job file (homogeneous weights, no domain or schedule)\n");
+        return 0;
+    }
+#endif
+
+    // the plan comes before the engines, since each allocates its
+    // share as it starts
+    if(memorybudget()) return 0;
+    
+#if VITERBI
+    // solve for the most probable state exactly
+    viterbi();
+    return 0;
+#endif
+
+#if BATCH
+    // many small copies instead of one large pair
+    batch();
+    return 0;
+#endif
+
+#if POOL
+    // many different chains instead of one pair
+    pool();
+    return 0;
+#endif
+
+#if ANNEAL
+    // look for the most probable state instead of sampling
+    anneal();
+    return 0;
+#endif
+    
+    
+#if VIDEO
+    if(videoopen()) {
+        printf("*** error opening video stream\n");
+        return 0;
+    }
+#endif
+    
+#if PATTERNS
+    // counted once here; the flips keep the counts up to date
+    patternscan(matrix, patternlive[0]);
+    patternscan(matrix2, patternlive[1]);
+#endif
+
+#if CORRELATE
+    if(PARALLEL) {
+        printf("*** correlations follow single flips, not parallel sweeps\n");
+        return 0;
+    }
+    correlatestart();
+#endif
+
+#if RECORDER
+    if(PARALLEL) {
+        printf("*** the flight recorder journals single flips, not parallel sweeps\n");
+        return 0;
+    }
+    recorderstart();
+#endif
     
+#if PARALLEL
+    if(STICKY || INHOMOGENEOUS) {
+        printf("*** parallel sweeps need homogeneous weights and no sticking\n");
+        return 0;
+    }
+    parallelstart();
+#endif
     
     // initialize the global timers
     globalmatrixtimestart = time(NULL);
@@ -477,18 +1775,42 @@ int main(int argc, char **argv) {
 //while(((double) (matrixvol-matrixvol2)*100/matrixvol)>1) { //volume delta is greater than 1%, proceed 
 while(1==1) {
         random = (double) rand()/RAND_MAX;
+        
+        #if SCHEDULE
+        // one compare per flip until a change point is due
+        if(flipcompleted >= schedulenextat) applyschedule();
+        #endif
+        
+        #if CORRELATE
+        // one compare per pass until a lag or an origin is due
+        if(flipcompleted >= correlatenextat) correlatestep();
+        #endif
+        
+        #if RECORDER
+        // one compare per pass until a frame is due or a dump asked for
+        if(++recorderpass >= recordernextat || recorderwanted) recordercheck();
+        #endif
 
+        #if PARALLEL
+        // a whole sweep per pass; the outputs below see its result
+        parallelsweep();
+        #else
         // proceed with the actual flipping
         
         // get a random position
+        #if DOMAIN
+        getdomainposition();
+        #else
         getflippablepositionrow();
         getflippablepositioncol();           
+        #endif
         
         
         // makes tests to check if a high flip, low flip, 
         // or bi flip should be executed
         vcanfliphigh1 = getisflippable(&flipchoicerow,&flipchoicecol,&HIGH);
         vcanfliplow1 = getisflippable(&flipchoicerow,&flipchoicecol,&LOW);
+        #endif
         
 
     //------------------------------------------------------------------//
@@ -499,6 +1821,17 @@ while(1==1) {
         if(flipcompleted > printatsuccessrate-1){
         printf("Success rate of flips: %Lf%% | Executing %lf flips/second\n",((long double) flipcompleted*100) / (flipfailed + flipcompleted),((double)successrateinterval) / (secondtime-firsttime));
         printf("Volume delta = %d | %lf%% | %lf%%\n",matrixvol-matrixvol2,((double) (matrixvol-matrixvol2)*100/matrixvol),((double) (matrixvol-matrixvol2)*100/matrixvol2));
+        #if DIFFERENCE
+        printf("Heights differ at %lld positions | %lf%%\n",differencecount,((double) differencecount*100/((long long) nrows*ncols)));
+        #endif
+        if(memoryresident(&resident, &residentpeak) == 0) 
+            printf("Resident memory: %lld MB, peak %lld MB of %lld MB planned\n",
+                   MEGABYTES(resident), MEGABYTES(residentpeak), MEGABYTES(memoryplanned));
+        #if ALLOCCHECK
+        // zero once every output has been through a first round
+        printf("Heap allocations since the last report: %lld\n",allocations-allocationsreported);
+        allocationsreported = allocations;
+        #endif
         firsttime = secondtime;
         secondtime = time(NULL);
         printatsuccessrate+=(long long)successrateinterval;
@@ -508,16 +1841,14 @@ while(1==1) {
 #if TEXT
         if(flipcompleted > printattext){
         printattext+=(long long)textinterval;
-        print_text();
-        print_text2();
+        snapshotdue |= SNAPTEXT;
         }
 #endif
 
 #if PDF
         if(flipcompleted > printatpdf + 1){
         printatpdf+=(long long)pdfinterval;
-        print_pdf();
-        print_pdf2();
+        snapshotdue |= SNAPPDF;
         }
 #endif
 
@@ -532,6 +1863,8 @@ while(1==1) {
 #if TOTALWEIGHT
         if(flipcompleted > printattotalweight + 3){
             printattotalweight+=(long long)totalweightinterval;
+            // appended here, not in a snapshot child, so the lines
+            // stay in order
             print_totalweight();
             print_totalweight2();
         }
@@ -540,17 +1873,62 @@ while(1==1) {
 #if CDENSITY
         if(flipcompleted > printatcdensity + 4){
             printatcdensity+=(long long)cdensityinterval;
-            print_cdensity();
-            print_cdensity2();
-#if CDENSITYPDF
-            print_cdensitypdf();
-            print_cdensitypdf2();
+            snapshotdue |= SNAPCDENSITY;
+        }
+#endif
+
+#if VIDEO
+        if(flipcompleted > printatvideo + 5){
+            printatvideo+=(long long)videointerval;
+            snapshotdue |= SNAPVIDEO;
+        }
+#endif
+
+#if COMPONENTS
+        if(flipcompleted > printatcomponents + 6){
+            printatcomponents+=(long long)componentsinterval;
+            snapshotdue |= SNAPCOMPONENTS;
+        }
 #endif
+
+#if PATTERNS
+        if(flipcompleted > printatpatterns + 7){
+            printatpatterns+=(long long)patternsinterval;
+            // summed here, so a forked snapshot cannot lose a sample
+            patternsample();
+            snapshotdue |= SNAPPATTERNS;
+        }
+#endif
+
+#if CORRELATE
+        if(flipcompleted > printatcorrelate + 8){
+            printatcorrelate+=(long long)correlateinterval;
+            snapshotdue |= SNAPCORRELATE;
         }
 #endif
 
+#if DIFFERENCE
+        if(flipcompleted > printatdifference + 9){
+            printatdifference+=(long long)differenceinterval;
+            snapshotdue |= SNAPDIFFERENCE;
+        }
+#endif
+
+        if(snapshotdue) {
+            snapshot(snapshotdue);
+            snapshotdue = 0;
+        }
+        
+        // a run is killed, never ended, so lines appended this pass
+        // go out now rather than when the buffer fills
+        if(sinkpending) sinkflush();
+
 
         
+        #if PARALLEL
+        continue;
+        #endif
+        
     //------------------------------------------------------------------//
     //  Handle the matrices                                             //
     //------------------------------------------------------------------//
@@ -746,14 +2124,25 @@ while(1==1) {
     globalmatrixtimeend = time(NULL);
     globalmatrixclockend = clock();
     
+#if FORK
+    // let every snapshot finish before the final outputs
+    snapshotwait(1);
+#endif
+
+#if SCHEDULE
+    snapshotschedule(SNAPTEXT | SNAPPDF | SNAPCDENSITY);
+#endif
+    
 #if TEXT
     print_text();
     print_text2();
 #endif
 
 #if PDF
-    print_pdf();
-    print_pdf2();
+    if(pdfactive) {
+        print_pdf();
+        print_pdf2();
+    }
 #endif
 
 #if VOLUME
@@ -773,6 +2162,25 @@ while(1==1) {
     print_cdensitypdf();
     print_cdensitypdf2();
 #endif
+#if CDENSITYPNG
+    print_cdensitypng();
+    print_cdensitypng2();
+#endif
+#endif
+
+#if CORRELATE
+    print_correlations(0, "matrix");
+    print_correlations(1, "matrix2");
+#endif
+
+#if DIFFERENCE
+    print_difference();
+#endif
+
+#if VIDEO
+    print_video();
+    if(VIDEOPIPE[0]) pclose(videostream);
+    else fclose(videostream);
 #endif
     
     // print out the final stats on the matrix
@@ -799,8 +2207,8 @@ while(1==1) {
     
     // print the output file
     
-    sprintf(endname,"./output/a1=%lf, a2=%lf, b1=%lf, b2=%lf, c1=%lf, c2=%lf, %dx%d/matrix.end",wts[0],wts[1],wts[2],wts[3],wts[4],wts[5],ncols,nrows);    
-    endfile = fopen(endname,"a");
+    sprintf(endname,"%s/matrix.end",outputdir);    
+    endfile = sinkopen(endname,"a");
 
     fprintf(endfile, "\n\nEnd statistics:\n\n");
     
@@ -808,6 +2216,27 @@ while(1==1) {
     fprintf(endfile, "a1 = %lf, a2 = %lf\nb1 = %lf, b2 = %lf\nc1 = %lf, c2 = %lf",wts[0],wts[1],wts[2],wts[3],wts[4],wts[5]);
     
     fprintf(endfile, "\n\nSize: %dx%d",nrows,ncols);
+    
+    #if SCHEDULE
+    fprintf(endfile, "\n\nSchedule: %d of %d weight changes applied",schedulestage,schedulelength);
+    #endif
+    
+    #if RECORDER
+    fprintf(endfile, "\n\nFlight recorder: %d frames, %d dumps",recorderframes,recorderdumps);
+    #endif
+    
+    fprintf(endfile, "\n\nSeed: %llu",runseed);
+    #if PARALLEL
+    fprintf(endfile, "\nSweeps: %lld of %dx%d tiles",parallelepoch,PARALLELTILE,PARALLELTILE);
+    fprintf(endfile, "\nRebalances: %lld, %lld tiles moved",parallelrebalances,parallelmoved);
+    #endif
+    #if PATTERNS
+    fprintf(endfile, "\nPattern samples: %lld",patternsamples);
+    #endif
+        
+    if(memoryresident(&resident, &residentpeak) == 0) 
+        fprintf(endfile, "\nMemory: %lld MB planned, %lld MB resident at peak",
+                MEGABYTES(memoryplanned), MEGABYTES(residentpeak));
         
     fprintf(endfile, "\n\nAlgorithmic Efficiency:\n");
     fprintf(endfile, "Total flips completed: %lld\n",flipcompleted);
@@ -820,7 +2249,7 @@ while(1==1) {
     fprintf(endfile, "Total flips per second (non-cpu):          %Lf flips/second\n", ((long double) flipcompleted) / (globalmatrixtimeend - globalmatrixtimestart));
     fprintf(endfile, "Total flips per second (cpu):              %Lf flips/second\n\n", ((long double) flipcompleted) / ((globalmatrixclockend - globalmatrixclockstart) / (CLOCKS_PER_SEC)));      
     
-    fclose(endfile);
+    sinkclose(endfile);
 
     return 0;
 }
@@ -841,6 +2270,186 @@ int nltrim(char s[]) {
     return 0;
 }
 
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+long long memoryplan(int report) {
+    
+    long long   n = (long long) nrows * ncols;
+    long long   total = 0, pdf = 0;
+    #if POOL
+    long long   chains = 0;
+    int     k;
+    #endif
+    
+    // the matrices are static but only their used rows are touched
+    total += memoryitem("matrices", 2 * n * (long long) sizeof(mstruct), report);
+    total += memoryitem("output buffers", (long long) sinkentrysize + 2 * n + 16, report);
+    #if CDENSITY
+    total += memoryitem("density image", 4 * (n + nrows + ncols + 1) + 6 * n + nrows, report);
+    #endif
+    #if DIFFERENCE
+    total += memoryitem("difference overlay", 3 * n + 5LL * nrows, report);
+    #endif
+    #if DOMAIN
+    total += memoryitem("domain tiles", 12LL * domaintilerows * domaintilecols + 4 * n, report);
+    #endif
+    #if COMPONENTS
+    total += memoryitem("component labels", (9 + (long long) sizeof(kstruct)) * n, report);
+    #endif
+    #if PATTERNS
+    total += memoryitem("pattern counters", 24LL * patternregionrows * patternregioncols * PATTERNSLOTS, report);
+    #endif
+    #if CORRELATE
+    total += memoryitem("correlation origins", 6LL * correlateorigins * n, report);
+    #endif
+    #if RECORDER
+    total += memoryitem("flight recorder", RECORDERFRAMES * (n + 2) 
+                                           + 8LL * RECORDERFRAMES * RECORDERSWEEPS * n, report);
+    #endif
+    #if VIDEO
+    total += memoryitem("video frame", 3 * (n / (VIDEOSCALE * VIDEOSCALE) + nrows + ncols + 4), report);
+    #endif
+    #if PARALLEL
+    total += memoryitem("parallel planes", 2LL * chainsize + 24LL * ((nrows + PARALLELTILE - 1) / PARALLELTILE) 
+                                                       * ((ncols + PARALLELTILE - 1) / PARALLELTILE), report);
+    #endif
+    #if ANNEAL
+    total += memoryitem("annealing restarts", 2LL * ANNEALCHAINS * chainsize, report);
+    #endif
+    #if BATCH
+    total += memoryitem("batched copies", BATCHLATTICES * n + 8LL * (BATCHTHREADS + 1) * (n + 1), report);
+    #endif
+    #if POOL
+    for(k=0;k<pooljobcount;k++) chains += (long long) pooljobs[k].rows * pooljobs[k].cols;
+    total += memoryitem("pooled chains", chains + MAXPOOLJOBS * (long long) sizeof(pstruct), report);
+    #endif
+    #if VITERBI
+    if(ncols <= VITERBIMAXCOLS) total += memoryitem("transfer tables", (16 + n) << (ncols + 1), report);
+    #endif
+    
+    // a pdf is built whole in memory before it is written; the density
+    // pdfs are written straight into the output buffer
+    #if PDF
+    if(pdfactive) pdf = PDFBYTES * n;
+    #endif
+    
+    #if FORK
+    // each child fills its own copy of the buffers, builds its pdf,
+    // and keeps the old copy of every matrix page the parent flips
+    if(forklimit > 0) {
+        total += memoryitem("snapshot children", forklimit * ((long long) sinkentrysize 
+                                                + 2 * n * (long long) sizeof(mstruct) + pdf), report);
+        pdf = 0;
+    }
+    #endif
+    total += memoryitem("pdf rendering", pdf, report);
+    
+    return total;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+long long memoryitem(char *what, long long bytes, int report) {
+    
+    if(report && bytes > 0) printf("  %-22s %8lld MB\n", what, MEGABYTES(bytes));
+    return bytes;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+int memorybudget(void) {
+    
+    long long   budget = (long long) MEMBUDGET << 20;
+    
+    // over budget, the outputs go in order of what they cost the run:
+    // extra snapshot children, then vertex pdfs, then forking at all, then
+    // half the correlation origins at a time
+    memoryplanned = memoryplan(0);
+    while(MEMBUDGET && MEMDEGRADE && memoryplanned > budget) {
+        #if FORK
+        if(forklimit > 1) {
+            forklimit = 1;
+            printf("Memory: one snapshot child at a time\n");
+            memoryplanned = memoryplan(0);
+            continue;
+        }
+        #endif
+        #if PDF
+        if(pdfactive) {
+            pdfactive = 0;
+            printf("Memory: vertex pdfs off\n");
+            memoryplanned = memoryplan(0);
+            continue;
+        }
+        #endif
+        #if FORK
+        if(forklimit > 0) {
+            forklimit = 0;
+            printf("Memory: snapshots written in place\n");
+            memoryplanned = memoryplan(0);
+            continue;
+        }
+        #endif
+        #if CORRELATE
+        if(correlateorigins > 1) {
+            correlateorigins /= 2;
+            printf("Memory: %d correlation origins\n", correlateorigins);
+            memoryplanned = memoryplan(0);
+            continue;
+        }
+        #endif
+        break;
+    }
+    
+    printf("Memory plan:\n");
+    memoryplan(1);
+    if(MEMBUDGET) printf("  %-22s %8lld MB of %d MB\n", "total", MEGABYTES(memoryplanned), MEMBUDGET);
+    else printf("  %-22s %8lld MB\n", "total", MEGABYTES(memoryplanned));
+    
+    if(MEMBUDGET && memoryplanned > budget) {
+        printf("*** planned memory is over the budget of %d MB\n", MEMBUDGET);
+        return 1;
+    }
+    return 0;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+int memoryresident(long long *rss, long long *peak) {
+    
+    static char buf[4096];                      // static: no allocation per report
+    char    *line;
+    long long   len;
+    int     fd, found = 0;
+    
+    // Linux only; elsewhere the report leaves the line out.  Plain
+    // descriptors, since stdio would allocate a buffer every call
+    if((fd = open("/proc/self/status", O_RDONLY)) < 0) return 1;
+    len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if(len <= 0) return 1;
+    buf[len] = '\0';
+    
+    // the leading space of the formats skips the newline before a line
+    for(line=buf;line!=NULL;line=strchr(line + 1, '\n')) {
+        if(sscanf(line, " VmRSS: %lld", rss) == 1) found |= 1;
+        if(sscanf(line, " VmHWM: %lld", peak) == 1) found |= 2;
+    }
+    
+    // the kernel reports kB
+    *rss <<= 10;
+    *peak <<= 10;
+    return found != 3;
+}
+
 
 #if TEXT
 //==============================================================================
@@ -849,11 +2458,16 @@ int nltrim(char s[]) {
 void print_text(void) {
     printf("Flips completed: %lld - Matrix file  written\n",flipcompleted);
 
-    int i,j;
     FILE *data;
     char name[512];
-    sprintf(name,"./output/a1=%lf, a2=%lf, b1=%lf, b2=%lf, c1=%lf, c2=%lf, %dx%d/%s/output%d.matrix",wts[0],wts[1],wts[2],wts[3],wts[4],wts[5],ncols,nrows,PRINT_TEXT,tprint);    
-    data = fopen(name,"w");
+    #if COMPRESS
+    sprintf(name,"%s/%s/output%d.vtc",outputdir,PRINT_TEXT,tprint);    
+    data = sinkopen(name,"wb");
+    writecoded(data, matrix);
+    #else
+    int i,j;
+    sprintf(name,"%s/%s/output%d.matrix",outputdir,PRINT_TEXT,tprint);    
+    data = sinkopen(name,"w");
 
 	for(i=0;i<nrows;i++) {
 		for(j=0;j<ncols;j++) {
@@ -879,7 +2493,8 @@ void print_text(void) {
 			}
 		}
 	}	
-	fclose(data);
+    #endif
+	sinkclose(data);
     tprint++;
     if(tprint>20) tprint=0;
     
@@ -888,11 +2503,16 @@ void print_text(void) {
 void print_text2(void) {
     printf("Flips completed: %lld - Matrix2 file  written\n",flipcompleted);
 
-    int i,j;
     FILE *data;
     char name[512];
-    sprintf(name,"./output/a1=%lf, a2=%lf, b1=%lf, b2=%lf, c1=%lf, c2=%lf, %dx%d/%s2/output%d.matrix",wts[0],wts[1],wts[2],wts[3],wts[4],wts[5],ncols,nrows,PRINT_TEXT,tprint);    
-    data = fopen(name,"w");
+    #if COMPRESS
+    sprintf(name,"%s/%s2/output%d.vtc",outputdir,PRINT_TEXT,tprint);    
+    data = sinkopen(name,"wb");
+    writecoded(data, matrix2);
+    #else
+    int i,j;
+    sprintf(name,"%s/%s2/output%d.matrix",outputdir,PRINT_TEXT,tprint);    
+    data = sinkopen(name,"w");
 
 	for(i=0;i<nrows;i++) {
 		for(j=0;j<ncols;j++) {
@@ -918,7 +2538,8 @@ void print_text2(void) {
 			}
 		}
 	}	
-	fclose(data);
+    #endif
+	sinkclose(data);
 }
 #endif
 
@@ -1112,7 +2733,7 @@ void print_pdf(void) {
     // 6 point width/height vertices
     
     char name[512];
-    sprintf(name,"./output/a1=%lf, a2=%lf, b1=%lf, b2=%lf, c1=%lf, c2=%lf, %dx%d/%s/output%d.pdf",wts[0],wts[1],wts[2],wts[3],wts[4],wts[5],ncols,nrows,PRINT_PDF,pprint);    
+    sprintf(name,"%s/%s/output%d.pdf",outputdir,PRINT_PDF,pprint);    
     
     char pdfOutputSize[512];
     sprintf(pdfOutputSize,"0 0 %d %d",(36 + (ncols * 6)),(36 + (nrows * 6)));
@@ -1137,7 +2758,7 @@ void print_pdf(void) {
     }
     
     cpdf_finalizeAll(pdf);			/* PDF file/memstream is actually written here */
-    cpdf_savePDFmemoryStreamToFile(pdf, name);
+    sinkpdf(pdf, name);
     
     cpdf_close(pdf);
     
@@ -1158,7 +2779,7 @@ void print_pdf2(void) {
     // 9 point width/height vertices
     
     char name[512];
-    sprintf(name,"./output/a1=%lf, a2=%lf, b1=%lf, b2=%lf, c1=%lf, c2=%lf, %dx%d/%s2/output%d.pdf",wts[0],wts[1],wts[2],wts[3],wts[4],wts[5],ncols,nrows,PRINT_PDF,pprint);    
+    sprintf(name,"%s/%s2/output%d.pdf",outputdir,PRINT_PDF,pprint);    
     
     char pdfOutputSize[512];
     sprintf(pdfOutputSize,"0 0 %d %d",(36 + (ncols * 6)),(36 + (nrows * 6)));
@@ -1183,7 +2804,7 @@ void print_pdf2(void) {
     }
     
     cpdf_finalizeAll(pdf);			/* PDF file/memstream is actually written here */
-    cpdf_savePDFmemoryStreamToFile(pdf, name);
+    sinkpdf(pdf, name);
     
     cpdf_close(pdf);
     
@@ -1198,127 +2819,31 @@ void print_pdf2(void) {
 void print_cdensitypdf(void) {
     printf("Flips completed: %lld - PDF cdensity written\n",flipcompleted);
     
-    CPDFdoc *pdf;
-    int currentdensity;
-    double currentdensitydouble;
-    int i, j, k, l;
-    double x, y;
-    x = ((double) 18 / 72);
-    y = ((double) ((nrows * 2) + 18) / 72);
-    //start it at the border.
-    double rectWidth = ((double) 2 / 72);
-    // 9 point width/height vertices
-    
-    char name[512];
-    sprintf(name,"./output/a1=%lf, a2=%lf, b1=%lf, b2=%lf, c1=%lf, c2=%lf, %dx%d/%s/output%d.pdf",wts[0],wts[1],wts[2],wts[3],wts[4],wts[5],ncols,nrows,PRINT_CDENSITYPDF,cprint);    
-    char pdfOutputSize[512];
-    sprintf(pdfOutputSize,"0 0 %d %d",(36 + (ncols * 2)),(36 + (nrows * 2)));
-    // this allows for a quarter inch border (18 points)
-    
-    pdf = cpdf_open(0, NULL);
-    cpdf_enableCompression(pdf, YES);		/* use Flate/Zlib compression */
-    cpdf_init(pdf);
-    cpdf_pageInit(pdf, 1, PORTRAIT, pdfOutputSize, pdfOutputSize);		/* page orientation */
-    
-    cpdf_setlinewidth(pdf, 2);
-    //linewidth = 2 points (2/72 inch)
-    
-    for(i=(cdensitystep/2);i<(nrows-(cdensitystep/2));i++) {
-		for(j=(cdensitystep/2);j<(ncols-(cdensitystep/2));j++) {
-            currentdensity = 0;	
-            for(k=0-(cdensitystep/2);k<(cdensitystep/2)+1;k++) {
-                for(l=0-(cdensitystep/2);l<(cdensitystep/2)+1;l++) {
-                    // count +1 for c vertices
-                    if(matrix[i+k][j+l].type == 4 || 
-                       matrix[i+k][j+l].type == 5) {
-                        currentdensity++;
-                    }
-                }
-            }
-            // print relative density for the point to the file
-            currentdensitydouble = ((double)currentdensity/((cdensitystep+1)*(cdensitystep+1)));
-            
-            cpdf_newpath(pdf);
-            //cpdf_setrgbcolor(pdf, (float) currentdensitydouble, (float) currentdensitydouble, (float) currentdensitydouble);
-            cpdf_setgray(pdf, (float) currentdensitydouble);
-            cpdf_rect(pdf, x, y, rectWidth, rectWidth);
-            cpdf_fill(pdf);
-            
-            
-            x += rectWidth;
-        }
-        x = ((double) 18 / 72);
-        y = y - rectWidth;
-    }
-    
-    cpdf_finalizeAll(pdf);			/* PDF file/memstream is actually written here */
-    cpdf_savePDFmemoryStreamToFile(pdf, name);
-    
-    cpdf_close(pdf);
-    
+    print_cdensityimage(matrix, PRINT_CDENSITYPDF, 1);
 }
 
 void print_cdensitypdf2(void) {
     printf("Flips completed: %lld - PDF cdensity 2 written\n",flipcompleted);
     
-    CPDFdoc *pdf;
-    int currentdensity;
-    double currentdensitydouble;
-    int i, j, k, l;
-    double x, y;
-    x = ((double) 18 / 72);
-    y = ((double) ((nrows * 2) + 18) / 72);
-    //start it at the border.
-    double rectWidth = ((double) 2 / 72);
-    // 9 point width/height vertices
-    
-    char name[512];
-    sprintf(name,"./output/a1=%lf, a2=%lf, b1=%lf, b2=%lf, c1=%lf, c2=%lf, %dx%d/%s2/output%d.pdf",wts[0],wts[1],wts[2],wts[3],wts[4],wts[5],ncols,nrows,PRINT_CDENSITYPDF,cprint);    
-    char pdfOutputSize[512];
-    sprintf(pdfOutputSize,"0 0 %d %d",(36 + (ncols * 2)),(36 + (nrows * 2)));
-    // this allows for a quarter inch border (18 points)
-    
-    pdf = cpdf_open(0, NULL);
-    cpdf_enableCompression(pdf, YES);		/* use Flate/Zlib compression */
-    cpdf_init(pdf);
-    cpdf_pageInit(pdf, 1, PORTRAIT, pdfOutputSize, pdfOutputSize);		/* page orientation */
-    
-    cpdf_setlinewidth(pdf, 2);
-    //linewidth = 2 points (2/72 inch)
-    
-    for(i=(cdensitystep/2);i<(nrows-(cdensitystep/2));i++) {
-		for(j=(cdensitystep/2);j<(ncols-(cdensitystep/2));j++) {
-            currentdensity = 0;	
-            for(k=0-(cdensitystep/2);k<(cdensitystep/2)+1;k++) {
-                for(l=0-(cdensitystep/2);l<(cdensitystep/2)+1;l++) {
-                    // count +1 for c vertices
-                    if(matrix2[i+k][j+l].type == 4 || 
-                       matrix2[i+k][j+l].type == 5) {
-                        currentdensity++;
-                    }
-                }
-            }
-            // print relative density for the point to the file
-            currentdensitydouble = ((double)currentdensity/((cdensitystep+1)*(cdensitystep+1)));
-            
-            cpdf_newpath(pdf);
-            //cpdf_setrgbcolor(pdf, (float) currentdensitydouble, (float) currentdensitydouble, (float) currentdensitydouble);
-            cpdf_setgray(pdf, (float) currentdensitydouble);
-            cpdf_rect(pdf, x, y, rectWidth, rectWidth);
-            cpdf_fill(pdf);
-            
-            
-            x += rectWidth;
-        }
-        x = ((double) 18 / 72);
-        y = y - rectWidth;
-    }
-    
-    cpdf_finalizeAll(pdf);			/* PDF file/memstream is actually written here */
-    cpdf_savePDFmemoryStreamToFile(pdf, name);
+    print_cdensityimage(matrix2, PRINT_CDENSITYPDF "2", 1);
+}
+#endif
+
+#if CDENSITYPNG
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void print_cdensitypng(void) {
+    printf("Flips completed: %lld - PNG cdensity written\n",flipcompleted);
     
-    cpdf_close(pdf);
+    print_cdensityimage(matrix, PRINT_CDENSITYPNG, 0);
+}
+
+void print_cdensitypng2(void) {
+    printf("Flips completed: %lld - PNG cdensity 2 written\n",flipcompleted);
     
+    print_cdensityimage(matrix2, PRINT_CDENSITYPNG "2", 0);
 }
 #endif
 
@@ -1331,14 +2856,17 @@ void print_cdensitypdf2(void) {
 void print_volume(void) {
 
     printf("Flips completed: %lld - volume file  written \n",flipcompleted);
+    #if SCHEDULE
+    print_schedule("volume", -1);
+    #endif
     
     int current = 0;
     int total = 0;
     int i, j;
     FILE *data;
     char name[512];
-    sprintf(name,"./output/a1=%lf, a2=%lf, b1=%lf, b2=%lf, c1=%lf, c2=%lf, %dx%d/matrix.volume",wts[0],wts[1],wts[2],wts[3],wts[4],wts[5],ncols,nrows);    
-    data = fopen(name,"a");
+    sprintf(name,"%s/matrix.volume",outputdir);    
+    data = sinkopen(name,"a");
 
 	for(i=0;i<nrows;i++) {
         current = 0;
@@ -1351,7 +2879,7 @@ void print_volume(void) {
 		
 	}	
     fprintf(data, "%d\n",total);
-	fclose(data);
+	sinkclose(data);
 
     
 }
@@ -1365,8 +2893,8 @@ void print_volume2(void) {
     int i, j;
     FILE *data;
     char name[512];
-    sprintf(name,"./output/a1=%lf, a2=%lf, b1=%lf, b2=%lf, c1=%lf, c2=%lf, %dx%d/matrix2.volume",wts[0],wts[1],wts[2],wts[3],wts[4],wts[5],ncols,nrows);    
-    data = fopen(name,"a");
+    sprintf(name,"%s/matrix2.volume",outputdir);    
+    data = sinkopen(name,"a");
 
 	for(i=0;i<nrows;i++) {
         current = 0;
@@ -1379,7 +2907,7 @@ void print_volume2(void) {
 		
 	}	
     fprintf(data, "%d\n",total);
-	fclose(data);
+	sinkclose(data);
 
     
 }
@@ -1393,17 +2921,26 @@ void print_volume2(void) {
 void print_totalweight(void) {
 
     printf("Flips completed: %lld - total weight file  written \n",flipcompleted);
+    #if SCHEDULE
+    print_schedule("totalweight", -1);
+    #endif
     
     int numa1 = 0, numa2 = 0, numb1 = 0, numb2 = 0, numc1 = 0, numc2 = 0;
     int i,j;
+    #if INHOMOGENEOUS
+    double logweight = 0;
+    #endif
     
     FILE *data;
     char name[512];
-    sprintf(name,"./output/a1=%lf, a2=%lf, b1=%lf, b2=%lf, c1=%lf, c2=%lf, %dx%d/matrix.totalweight",wts[0],wts[1],wts[2],wts[3],wts[4],wts[5],ncols,nrows);
-    data = fopen(name,"a");
+    sprintf(name,"%s/matrix.totalweight",outputdir);
+    data = sinkopen(name,"a");
 
 	for(i=0;i<nrows;i++) {
         for(j=0;j<ncols;j++) {
+        #if INHOMOGENEOUS
+        logweight += log(classwts[siteclass[i][j]][matrix[i][j].type]);
+        #endif
         switch(matrix[i][j].type) {
                 case 0:
                     numa1++;
@@ -1426,8 +2963,13 @@ void print_totalweight(void) {
             }
         }
 	}	
+    #if INHOMOGENEOUS
+    // the weights differ by class, so write the log of the product
+    fprintf(data, "%lf\n",logweight);
+    #else
     fprintf(data, "%lf^%d * %lf^%d * %lf^%d * %lf^%d * %lf^%d * %lf^%d\n",wts[0],numa1,wts[1],numa2,wts[2],numb1,wts[3],numb2,wts[4],numc1,wts[5],numc2);
-	fclose(data);
+    #endif
+	sinkclose(data);
 }
 
 void print_totalweight2(void) {
@@ -1436,14 +2978,20 @@ void print_totalweight2(void) {
     
     int numa1 = 0, numa2 = 0, numb1 = 0, numb2 = 0, numc1 = 0, numc2 = 0;
     int i,j;
+    #if INHOMOGENEOUS
+    double logweight = 0;
+    #endif
     
     FILE *data;
     char name[512];
-    sprintf(name,"./output/a1=%lf, a2=%lf, b1=%lf, b2=%lf, c1=%lf, c2=%lf, %dx%d/matrix2.totalweight",wts[0],wts[1],wts[2],wts[3],wts[4],wts[5],ncols,nrows);
-    data = fopen(name,"a");
+    sprintf(name,"%s/matrix2.totalweight",outputdir);
+    data = sinkopen(name,"a");
 
 	for(i=0;i<nrows;i++) {
         for(j=0;j<ncols;j++) {
+        #if INHOMOGENEOUS
+        logweight += log(classwts[siteclass[i][j]][matrix2[i][j].type]);
+        #endif
         switch(matrix2[i][j].type) {
                 case 0:
                     numa1++;
@@ -1466,8 +3014,13 @@ void print_totalweight2(void) {
             }
         }
 	}	
+    #if INHOMOGENEOUS
+    // the weights differ by class, so write the log of the product
+    fprintf(data, "%lf\n",logweight);
+    #else
     fprintf(data, "%lf^%d * %lf^%d * %lf^%d * %lf^%d * %lf^%d * %lf^%d\n",wts[0],numa1,wts[1],numa2,wts[2],numb1,wts[3],numb2,wts[4],numc1,wts[5],numc2);
-	fclose(data);
+    #endif
+	sinkclose(data);
 
     
 }
@@ -1482,23 +3035,16 @@ void print_cdensity(void) {
     printf("Flips completed: %lld - density file  written\n",flipcompleted);
     
     double currentdensity = 0;
-    int i, j, k, l;
+    int i, j;
     FILE *data;
     char name[512];
-    sprintf(name,"./output/a1=%lf, a2=%lf, b1=%lf, b2=%lf, c1=%lf, c2=%lf, %dx%d/%s/matrix%d.cdensity",wts[0],wts[1],wts[2],wts[3],wts[4],wts[5],ncols,nrows,PRINT_CDENSITY,cprint);    
-    data = fopen(name,"w");
+    sprintf(name,"%s/%s/matrix%d.cdensity",outputdir,PRINT_CDENSITY,cprint);    
+    data = sinkopen(name,"w");
     
+    cdensitytable(matrix);
 	for(i=(cdensitystep/2);i<(nrows-(cdensitystep/2));i++) {
 		for(j=(cdensitystep/2);j<(ncols-(cdensitystep/2));j++) {
-            currentdensity = 0;	
-            for(k=0-(cdensitystep/2);k<(cdensitystep/2)+1;k++) {
-                for(l=0-(cdensitystep/2);l<(cdensitystep/2)+1;l++) {
-                    // count +1 for c vertices
-                    if(matrix[i+k][j+l].type == 4 || matrix[i+k][j+l].type == 5) {
-                        currentdensity++;
-                    }
-                }
-            }
+            currentdensity = cdensitycount(i, j);
             // print relative density for the point to the file
             fprintf(data, "%lf,",(currentdensity/((cdensitystep+1)*(cdensitystep+1))));
             
@@ -1506,7 +3052,7 @@ void print_cdensity(void) {
         
     }
     
-    fclose(data);
+    sinkclose(data);
     cprint++;
     if(cprint>50) cprint=0;
 }
@@ -1515,23 +3061,16 @@ void print_cdensity2(void) {
     printf("Flips completed: %lld - density file 2 written\n",flipcompleted);
     
     double currentdensity = 0;
-    int i, j, k, l;
+    int i, j;
     FILE *data;
     char name[512];
-    sprintf(name,"./output/a1=%lf, a2=%lf, b1=%lf, b2=%lf, c1=%lf, c2=%lf, %dx%d/%s2/matrix%d.cdensity",wts[0],wts[1],wts[2],wts[3],wts[4],wts[5],ncols,nrows,PRINT_CDENSITY,cprint);    
-    data = fopen(name,"w");
+    sprintf(name,"%s/%s2/matrix%d.cdensity",outputdir,PRINT_CDENSITY,cprint);    
+    data = sinkopen(name,"w");
     
+    cdensitytable(matrix2);
 	for(i=(cdensitystep/2);i<(nrows-(cdensitystep/2));i++) {
 		for(j=(cdensitystep/2);j<(ncols-(cdensitystep/2));j++) {
-            currentdensity = 0;	
-            for(k=0-(cdensitystep/2);k<(cdensitystep/2)+1;k++) {
-                for(l=0-(cdensitystep/2);l<(cdensitystep/2)+1;l++) {
-                    // count +1 for c vertices
-                    if(matrix2[i+k][j+l].type == 4 || matrix2[i+k][j+l].type == 5) {
-                        currentdensity++;
-                    }
-                }
-            }
+            currentdensity = cdensitycount(i, j);
             // print relative density for the point to the file
             fprintf(data, "%lf,",(currentdensity/((cdensitystep+1)*(cdensitystep+1))));
             
@@ -1539,842 +3078,5451 @@ void print_cdensity2(void) {
         
     }
     
-    fclose(data);
+    sinkclose(data);
 }
-#endif
-
 
 //==============================================================================
 ////////////////////////////////////********////////////////////////////////////
 //==============================================================================
 
-void parse(FILE *data) {
+void cdensitytable(mstruct m[MAXROWS][MAXCOLS]) {
     
-    int i,j;
+    int     i, j, row, stride = ncols + 1;
+    int     *sat = cdensitysat;
+    
+    // sat[i][j] counts the c vertices above and left of (i,j), so any
+    // window is four lookups whatever the step
+    for(j=0;j<stride;j++) sat[j] = 0;
     for(i=0;i<nrows;i++) {
+        row = 0;
+        sat[(i+1)*stride] = 0;
         for(j=0;j<ncols;j++) {
-            matrix[i][j].type = (int)fgetc(data)-(int)'0';
+            row += m[i][j].type >= 4;
+            sat[(i+1)*stride+j+1] = sat[i*stride+j+1] + row;
         }
     }
-    fclose(data);
+}
+
+int cdensitycount(int i, int j) {
+    
+    int     half = cdensitystep/2, stride = ncols + 1;
+    int     *sat = cdensitysat;
+    
+    return sat[(i+half+1)*stride+j+half+1] - sat[(i-half)*stride+j+half+1]
+         - sat[(i+half+1)*stride+j-half] + sat[(i-half)*stride+j-half];
 }
 
 //==============================================================================
 ////////////////////////////////////********////////////////////////////////////
 //==============================================================================
 
-void parse2(FILE *data) {
-    
-    int i,j;
-    for(i=0;i<nrows;i++) {
-        for(j=0;j<ncols;j++) {
-            matrix2[i][j].type = (int)fgetc(data)-(int)'0';
+long long cdensityimage(int *w, int *h) {
+    
+    int     i, j, c, v, half = cdensitystep/2;
+    int     top = (1 << CDENSITYDEPTH) - 1;
+    double  d, window = (double) (cdensitystep+1) * (cdensitystep+1);
+    double  sample[3];
+    unsigned char   *p = cdensityraster;
+    
+    *w = ncols - 2*half;
+    *h = nrows - 2*half;
+    for(i=half;i<nrows-half;i++) {
+        *p++ = 0;                               // filter type none
+        for(j=half;j<ncols-half;j++) {
+            d = cdensitycount(i, j) / window;
+            #if CDENSITYCOLOR
+            // black through red and yellow to white, still rising in
+            // brightness like the gray
+            sample[0] = d < 1.0/3 ? 3*d : 1;
+            sample[1] = d < 1.0/3 ? 0 : (d < 2.0/3 ? 3*d - 1 : 1);
+            sample[2] = d < 2.0/3 ? 0 : 3*d - 2;
+            #else
+            sample[0] = d;
+            #endif
+            for(c=0;c<(CDENSITYCOLOR ? 3 : 1);c++) {
+                v = (int) (sample[c] * top + 0.5);
+                #if CDENSITYDEPTH == 16
+                *p++ = (unsigned char) (v >> 8);
+                #endif
+                *p++ = (unsigned char) v;
+            }
         }
     }
-    fclose(data);
+    return p - cdensityraster;
 }
 
 //==============================================================================
 ////////////////////////////////////********////////////////////////////////////
 //==============================================================================
-int setheights(void) {
-    
-    int current = 0;
-    int total = 0;
-    int i, j;
+
+void print_cdensityimage(mstruct m[MAXROWS][MAXCOLS], char *sub, int pdf) {
     
-	for(i=0;i<nrows;i++) {
-        current = 0;
-		for(j=0;j<ncols;j++) {
-			if(matrix[i][j].type == 0 || matrix[i][j].type == 2 || matrix[i][j].type == 5) {
-                current++;
-            }
-            matrix[i][j].height = current; // set the height value
-            total = total+current;  // keep a current total
-            #if DEBUG
-            printf("%d",current);
-            #endif
-		}
-        #if DEBUG
-        printf("\n");
-        #endif
-	}	
+    char    name[512];
+    long long   len;
+    int     w, h;
     
-    return(total);
+    // both formats carry the same zlib stream: PNG scanlines are what a
+    // pdf image reads with the PNG predictor, so one rendering serves;
+    // the pdf page is the one the per-position squares used to fill
+    cdensitytable(m);
+    len = cdensityimage(&w, &h);
+    if(w <= 0 || h <= 0) {
+        printf("*** c-density window larger than the matrix, no image\n");
+        return;
+    }
+    sprintf(name,"%s/%s/output%d.%s",outputdir,sub,cprint,pdf ? "pdf" : "png");
+    sinkimage(name, cdensityraster, len, w, h, CDENSITYCOLOR ? 3 : 1, CDENSITYDEPTH,
+              pdf, 20 + 4*(cdensitystep/2));
 }
+#endif
+
 
 //==============================================================================
 ////////////////////////////////////********////////////////////////////////////
 //==============================================================================
-int setheights2(void) {
+
+int sinkstart(void) {
     
-    int current = 0;
-    int total = 0;
-    int i, j;
+    char    name[512];
+    int     missing;
+    #if PATTERNS
+    int     k;
+    #endif
     
-	for(i=0;i<nrows;i++) {
-        current = 0;
-		for(j=0;j<ncols;j++) {
-			if(matrix2[i][j].type == 0 || matrix2[i][j].type == 2 || matrix2[i][j].type == 5) {
-                current++;
-            }
-            matrix2[i][j].height = current; // set the height value
-            total = total+current;  // keep a current total
-            #if DEBUG
-            printf("%d",current);
-            #endif
-		}
-        #if DEBUG
-        printf("\n");
-        #endif
-	}	
+    // an empty command would start a shell that exits at once, and
+    // the first entry written would raise SIGPIPE
+    if(SINK == SINKPIPE && SINKPIPECMD[0] == '\0') {
+        printf("*** SINKPIPE needs a command in SINKPIPECMD\n");
+        return 1;
+    }
     
-    return(total);
+    // every snapshot is rendered into this one buffer and handed on
+    // from there, so no output opens a stream of its own; the largest
+    // is a c-density file at 9 bytes per position
+    sinkentrysize = 16 * (size_t) nrows * ncols + 65536;
+    if((sinkentrybuf = malloc(sinkentrysize)) == NULL) {
+        printf("*** no memory for a %lld byte snapshot buffer\n", (long long) sinkentrysize);
+        return 1;
+    }
+    sinkentry = fmemopen(sinkentrybuf, sinkentrysize, "w");
+    codedplane = malloc((size_t) nrows * ncols);
+    codedout = malloc((size_t) nrows * ncols + 16);
+    #if CDENSITY
+    // a filter byte per row and up to six bytes per position (16 bit rgb)
+    cdensitysat = malloc(sizeof(int) * (nrows + 1) * (ncols + 1));
+    cdensityraster = malloc((size_t) nrows * (6 * ncols + 1));
+    #endif
+    #if DIFFERENCE
+    differencerow = malloc(sizeof(int) * nrows);
+    differenceraster = malloc((size_t) nrows * (3 * ncols + 1));
+    #endif
+    #if COMPONENTS
+    componentparent = malloc(sizeof(int) * nrows * ncols);
+    componentlabel = malloc(sizeof(int) * nrows * ncols);
+    componentclass = malloc((size_t) nrows * ncols);
+    component = malloc(sizeof(kstruct) * nrows * ncols);
+    #endif
+    #if PATTERNS
+    // windows belong to the region of their top left position
+    patternside = PATTERNREGION ? PATTERNREGION : nrows + ncols;
+    patternregionrows = (nrows + patternside - 1) / patternside;
+    patternregioncols = (ncols + patternside - 1) / patternside;
+    for(k=0;k<2;k++) {
+        patternlive[k] = calloc((size_t) patternregionrows * patternregioncols * PATTERNSLOTS, sizeof(int));
+        patternsum[k] = calloc((size_t) patternregionrows * patternregioncols * PATTERNSLOTS, sizeof(long long));
+    }
+    patterncode = malloc(sizeof(unsigned short) * ncols);
+    #endif
+    
+    // every buffer is written into unchecked later on
+    missing = codedplane == NULL || codedout == NULL;
+    #if CDENSITY
+    missing |= cdensitysat == NULL || cdensityraster == NULL;
+    #endif
+    #if DIFFERENCE
+    missing |= differencerow == NULL || differenceraster == NULL;
+    #endif
+    #if COMPONENTS
+    missing |= componentparent == NULL || componentlabel == NULL || 
+               componentclass == NULL || component == NULL;
+    #endif
+    #if PATTERNS
+    for(k=0;k<2;k++) missing |= patternlive[k] == NULL || patternsum[k] == NULL;
+    missing |= patterncode == NULL;
+    #endif
+    if(missing) {
+        printf("*** no memory for the output buffers\n");
+        return 1;
+    }
+    if(sinkentry == NULL) return 1;
+    
+    if(SINK == SINKNULL) {
+        // the few lines still written (volumes, end statistics) go
+        // nowhere; a large buffer keeps them off the syscall path
+        sinkstream = fopen("/dev/null","w");
+        if(sinkstream != NULL) setvbuf(sinkstream, NULL, _IOFBF, 1 << 20);
+    } else if(SINK == SINKARCHIVE) {
+        sprintf(name,"%s.tar",outputdir);
+        sinkstream = fopen(name,"wb");
+    } else if(SINK == SINKPIPE) {
+        sinkstream = popen(SINKPIPECMD, "w");
+    } else {
+        return 0;
+    }
+    if(sinkstream == NULL) return 1;
+    
+    // every return from main, early or not, has to end the stream
+    atexit(sinkfinish);
+    return 0;
 }
 
 //==============================================================================
 ////////////////////////////////////********////////////////////////////////////
 //==============================================================================
 
-double getweightratio(int *rpos, int *cpos, int *type) {
-    
-    xshift = matrix[*rpos][*cpos-1+(2**type)].type;
-    yshift = matrix[*rpos+1-(2**type)][*cpos].type;
-    dshift = matrix[*rpos+1-(2**type)][*cpos-1+(2**type)].type;
-    base = matrix[*rpos][*cpos].type;
-    
-    // define new values
-    if(*type) {  
-        
-        // If vertex was a1, it will be c1; if it was c2, it will be a2
-        if(base == 0) base = 4;
-        if(base == 5) base = 1;
-        
-        // If vertex was a2, it will be c1; if it was c2, it will be a1
-        if(dshift == 1) dshift = 4;
-        if(dshift == 5) dshift = 0;
-        
-        // If vertex was b2, it will be c2; if it was c1, it will be b1 
-        if(xshift == 3) xshift = 5;
-        if(xshift == 4) xshift = 2;
-        
-        // If vertex was b1, it will be c2; if it was c1, it will be b2
-        if(yshift == 2) yshift = 5;
-        if(yshift == 4) yshift = 3;
-        
-    } else {
-        
-        // If vertex was c1, it will be a2; if it was a1, it will be c2
-        if(base == 4) base = 1;
-        if(base == 0) base = 5;
-        
-        // If vertex was c1, it will be a1; if it was a2, it will be c2
-        if(dshift == 4) dshift = 0;
-        if(dshift == 1) dshift = 5;
-        
-        // If vertex was c2, it will be b1; if it was b2, it will be c1 
-        if(xshift == 5) xshift = 2;
-        if(xshift == 3) xshift = 4;
-        
-        // If vertex was c2, it will be b2; if it was b1, it will be c1 
-        if(yshift == 5) yshift = 3;
-        if(yshift == 2) yshift = 4;
-        
-    }
+void sinkmkdir(char *sub) {
     
-    #if DEBUG
-        printf("\n%lf \n \n",   wts[base] * wts[xshift] *
-                    wts[yshift] * wts[dshift] / rho);
-    #endif
+    char    name[512];
     
-    return (wts[base] * wts[xshift] *
-            wts[yshift] * wts[dshift] / rho);
+    // archives and pipes name the directories inside each entry
+    if(SINK != SINKFILES) return;
+    sprintf(name,"%s/%s",outputdir,sub);
+    mkdir(name, 0777);
 }
 
 //==============================================================================
 ////////////////////////////////////********////////////////////////////////////
 //==============================================================================
 
-double getweightratio2(int *rpos, int *cpos, int *type) {
+FILE *sinkopen(char *name, char *mode) {
     
-    xshift = matrix2[*rpos][*cpos-1+(2**type)].type;
-    yshift = matrix2[*rpos+1-(2**type)][*cpos].type;
-    dshift = matrix2[*rpos+1-(2**type)][*cpos-1+(2**type)].type;
-    base = matrix2[*rpos][*cpos].type;
+    FILE    *data;
+    char    dir[512], *split;
+    int     k;
     
-    // define new values
-    if(*type) {  
-        
-        // If vertex was a1, it will be c1; if it was c2, it will be a2
-        if(base == 0) base = 4;
-        if(base == 5) base = 1;
-        
-        // If vertex was a2, it will be c1; if it was c2, it will be a1
-        if(dshift == 1) dshift = 4;
-        if(dshift == 5) dshift = 0;
-        
-        // If vertex was b2, it will be c2; if it was c1, it will be b1 
-        if(xshift == 3) xshift = 5;
-        if(xshift == 4) xshift = 2;
-        
-        // If vertex was b1, it will be c2; if it was c1, it will be b2
-        if(yshift == 2) yshift = 5;
-        if(yshift == 4) yshift = 3;
-        
-    } else {
-        
-        // If vertex was c1, it will be a2; if it was a1, it will be c2
-        if(base == 4) base = 1;
-        if(base == 0) base = 5;
-        
-        // If vertex was c1, it will be a1; if it was a2, it will be c2
-        if(dshift == 4) dshift = 0;
-        if(dshift == 1) dshift = 5;
-        
-        // If vertex was c2, it will be b1; if it was b2, it will be c1 
-        if(xshift == 5) xshift = 2;
-        if(xshift == 3) xshift = 4;
-        
-        // If vertex was c2, it will be b2; if it was b1, it will be c1 
-        if(yshift == 5) yshift = 3;
-        if(yshift == 2) yshift = 4;
-        
-    }
+    if(SINK == SINKNULL) return sinkstream;
     
-    #if DEBUG
-        printf("\n%lf \n \n",   wts[base] * wts[xshift] *
-                    wts[yshift] * wts[dshift] / rho);
-    #endif
+    // append logs stay on disk for every other sink, opened once; an
+    // archive or pipe made no directories, so make the log's own
+    if(mode[0] == 'a') {
+        for(k=0;k<sinkhandles;k++) 
+            if(strcmp(sinkhandlename[k], name) == 0) return sinkhandle[k];
+        if(SINK != SINKFILES && (split = strrchr(name, '/')) != NULL) {
+            memcpy(dir, name, split - name);
+            dir[split - name] = '\0';
+            mkdir(dir, 0777);
+        }
+        data = fopen(name, mode);
+        if(data != NULL && sinkhandles < SINKHANDLES) {
+            setvbuf(data, NULL, _IOFBF, SINKBUFFER);
+            strcpy(sinkhandlename[sinkhandles], name);
+            sinkhandle[sinkhandles++] = data;
+        }
+        return data;
+    }
     
-    return (wts[base] * wts[xshift] *
-            wts[yshift] * wts[dshift] / rho);
+    // a snapshot is built in memory, then written out in one go when
+    // it is closed
+    strcpy(sinkentryname, name);
+    fseek(sinkentry, 0, SEEK_SET);
+    return sinkentry;
 }
 
 //==============================================================================
 ////////////////////////////////////********////////////////////////////////////
 //==============================================================================
 
-int getflippablepositionrow(void) {
-    //random between 0 and nrows-1
-    flipchoicerow = ((int) nrows * ((double) (rand()/(RAND_MAX + 1.0))));
-
-
-    return 0;
+void sinkclose(FILE *data) {
+    
+    long long   len;
+    int     k, fd;
+    
+    if(data == NULL || data == sinkstream) return;
+    
+    if(data != sinkentry) {
+        // append logs stay open and buffered until sinkflush
+        for(k=0;k<sinkhandles;k++) {
+            if(sinkhandle[k] == data) {
+                sinkpending = 1;
+                return;
+            }
+        }
+        fclose(data);
+        return;
+    }
+    
+    fflush(data);
+    len = ftell(data);
+    if(len >= (long long) sinkentrysize - 1) printf("*** %s truncated\n", sinkentryname);
+    
+    if(SINK == SINKFILES) {
+        // plain descriptors, since stdio would allocate a buffer
+        if((fd = open(sinkentryname, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) return;
+        if(write(fd, sinkentrybuf, len) != len) printf("*** error writing %s\n", sinkentryname);
+        close(fd);
+    } else {
+        sinkwrite(sinkentryname, sinkentrybuf, len);
+    }
 }
 
 //==============================================================================
 ////////////////////////////////////********////////////////////////////////////
 //==============================================================================
 
-int getflippablepositioncol(void) {
-    //random between 0 and ncols-1
-    flipchoicecol = ((int) ncols * ((double) (rand()/(RAND_MAX + 1.0))));
-
-
-    return 0;
+void sinkflush(void) {
+    
+    int     k;
+    
+    for(k=0;k<sinkhandles;k++) fflush(sinkhandle[k]);
+    sinkpending = 0;
 }
 
 //==============================================================================
 ////////////////////////////////////********////////////////////////////////////
 //==============================================================================
 
-int getisflippable(int *rpos, int *cpos, int *type) {
+void sinkfinish(void) {
     
-	//printf("getisflippable called - row: %d col: %d type: %d\n",*rpos,*cpos,*type);
-	if(*rpos < 0 || *rpos >= nrows) return 0;
-	if(*cpos < 0 || *cpos >= ncols) return 0;
-	
-    if(*type) {
-        if(*rpos>0 && *cpos<(ncols-1)) { //check high bounds
-            #if STICKY
-            if(matrix[*rpos][*cpos].height>matrix2[*rpos][*cpos].height) { //check the height
-            #endif
-                if(matrix[*rpos][*cpos].type==0 || matrix[*rpos][*cpos].type==5) { //check position contents
-                    if(matrix[*rpos-1][*cpos+1].type==1 || 
-                       matrix[*rpos-1][*cpos+1].type==5) { // check upper right free
-                        //printf("    returned true\n");
-                        return 1;
-                    }
-                #if STICKY
-                }
-                #endif
-            }
-        }
-    } else {
-        if(*rpos<(nrows-1) && *cpos>0) { //check low bounds
-            if(matrix[*rpos][*cpos].type==0 || matrix[*rpos][*cpos].type==4) { //check position contents
-                if(matrix[*rpos+1][*cpos-1].type==1 || 
-                   matrix[*rpos+1][*cpos-1].type==4) { // check lower left free
-                    //printf("    returned true\n");
-                    return 1;
-                }
-            }    
-        }
+    char    end[1024];
+    int     k;
+    
+    #if FORK
+    // children still writing entries have to finish first
+    snapshotwait(1);
+    #endif
+    
+    for(k=0;k<sinkhandles;k++) fclose(sinkhandle[k]);
+    sinkhandles = 0;
+    if(sinkstream == NULL) return;
+    
+    // archive and pipe both carry a tar, which ends with two zero blocks
+    if(SINK != SINKNULL) {
+        memset(end, 0, 1024);
+        fwrite(end, 1, 1024, sinkstream);
     }
-	//printf("    returned false\n");
-    return 0;
+    if(SINK == SINKPIPE) pclose(sinkstream);
+    else fclose(sinkstream);
+    sinkstream = NULL;
 }
 
 //==============================================================================
 ////////////////////////////////////********////////////////////////////////////
 //==============================================================================
 
-int getisflippable2(int *rpos, int *cpos, int *type) {
+void sinkwrite(char *name, char *buf, long long len) {
     
-	//printf("getisflippable called - row: %d col: %d type: %d\n",*rpos,*cpos,*type);
-	if(*rpos < 0 || *rpos >= nrows) return 0;
-	if(*cpos < 0 || *cpos >= ncols) return 0;
+    unsigned char   header[512];
+    char    *path = name, *split;
+    unsigned int    sum = 0;
+    int     k;
     
+    // entries are named from the output directory down
+    if(strncmp(path, "./output/", 9) == 0) path += 9;
     
-	
-    if(*type) {
-        if(*rpos>0 && *cpos<(ncols-1)) { //check high bounds
-            
-            if(matrix2[*rpos][*cpos].type==0 || matrix2[*rpos][*cpos].type==5) { //check position contents
-                if(matrix2[*rpos-1][*cpos+1].type==1 || 
-                   matrix2[*rpos-1][*cpos+1].type==5) { // check upper right free
-                    //printf("    returned true\n");
-                    return 1;
-                }
-                
-            }
-        }
+    // ustar: a name of up to 100 bytes after a prefix of up to 155
+    memset(header, 0, 512);
+    split = strlen(path) > 100 ? strchr(path + strlen(path) - 100, '/') : NULL;
+    if(split != NULL && split - path <= 155) {
+        memcpy(header + 345, path, split - path);
+        strncpy((char *) header, split + 1, 100);
     } else {
-        if(*rpos<(nrows-1) && *cpos>0) { //check low bounds
-            #if STICKY
-            if(matrix2[*rpos][*cpos].height<matrix[*rpos][*cpos].height) { //check the height
-            #endif
-                if(matrix2[*rpos][*cpos].type==0 || matrix2[*rpos][*cpos].type==4) { //check position contents
-                    if(matrix2[*rpos+1][*cpos-1].type==1 || 
-                       matrix2[*rpos+1][*cpos-1].type==4) { // check lower left free
-                        //printf("    returned true\n");
-                        return 1;
-                    }
-                #if STICKY
-                }
-                #endif
-            }
-        }    
+        strncpy((char *) header, path, 100);
     }
-	//printf("    returned false\n");
-    return 0;
+    sprintf((char *) header + 100, "%07o", 0644);
+    sprintf((char *) header + 108, "%07o", 0);
+    sprintf((char *) header + 116, "%07o", 0);
+    sprintf((char *) header + 124, "%011llo", len);
+    sprintf((char *) header + 136, "%011llo", (long long) time(NULL));
+    header[156] = '0';
+    memcpy(header + 257, "ustar", 6);
+    memcpy(header + 263, "00", 2);
+    memset(header + 148, ' ', 8);
+    for(k=0;k<512;k++) sum += header[k];
+    sprintf((char *) header + 148, "%06o", sum);
+    header[155] = ' ';
+    
+    fwrite(header, 1, 512, sinkstream);
+    fwrite(buf, 1, len, sinkstream);
+    memset(header, 0, 512);
+    fwrite(header, 1, (512 - len % 512) % 512, sinkstream);
+    fflush(sinkstream);
 }
 
+#if PDF
 //==============================================================================
 ////////////////////////////////////********////////////////////////////////////
 //==============================================================================
 
-int executeflip(int *rpos, int *cpos, int *type) {
-    updatepositions(rpos,cpos,type);
-
-    //increase or decrease the height
-    if(*type) {
-    matrix[*rpos][*cpos].height--;
-    matrixvol--;
-    } else {
-    matrix[*rpos+1][*cpos-1].height++;      //add one to lower left
-    matrixvol++;
+void sinkpdf(CPDFdoc *pdf, char *name) {
+    
+    char    *buf;
+    int     len;
+    
+    if(SINK == SINKFILES) {
+        cpdf_savePDFmemoryStreamToFile(pdf, name);
+    } else if(SINK != SINKNULL) {
+        buf = cpdf_getBufferForPDF(pdf, &len);
+        sinkwrite(name, buf, len);
     }
-    // return no error
-    return 0;
 }
+#endif
 
 //==============================================================================
 ////////////////////////////////////********////////////////////////////////////
 //==============================================================================
 
-int executeflip2(int *rpos, int *cpos, int *type) {
-    updatepositions2(rpos,cpos,type);
-
-    //increase or decrease the height
-    if(*type) {
-    matrix2[*rpos][*cpos].height--;
-    matrixvol2--;
+void sinkimage(char *name, unsigned char *raster, long long len, int w, int h, 
+               int colors, int depth, int pdf, int bottom) {
+    
+    FILE    *data;
+    char    content[128];
+    unsigned char   head[13];
+    unsigned int    crc;
+    long long   zlen, obj[6];
+    int     k;
+    
+    zlen = zlibstored(NULL, raster, len, NULL);
+    data = sinkopen(name,"w");
+    if(data == NULL) return;
+    
+    if(pdf) {
+        // 2 points a pixel inside an 18 point border, as the vector
+        // pdfs draw a position
+        fprintf(data, "%%PDF-1.4\n");
+        obj[1] = ftell(data);
+        fprintf(data, "1 0 obj\n<< /Type /Catalog /Pages 2 0 R >>\nendobj\n");
+        obj[2] = ftell(data);
+        fprintf(data, "2 0 obj\n<< /Type /Pages /Kids [3 0 R] /Count 1 >>\nendobj\n");
+        obj[3] = ftell(data);
+        fprintf(data, "3 0 obj\n<< /Type /Page /Parent 2 0 R /MediaBox [0 0 %d %d]\n"
+                      "   /Resources << /XObject << /Im0 4 0 R >> >> /Contents 5 0 R >>\nendobj\n",
+                      36 + ncols*2, 36 + nrows*2);
+        obj[4] = ftell(data);
+        fprintf(data, "4 0 obj\n<< /Type /XObject /Subtype /Image /Width %d /Height %d\n"
+                      "   /ColorSpace /%s /BitsPerComponent %d /Filter /FlateDecode\n"
+                      "   /DecodeParms << /Predictor 15 /Colors %d /BitsPerComponent %d /Columns %d >>\n"
+                      "   /Length %lld >>\nstream\n",
+                      w, h, colors == 3 ? "DeviceRGB" : "DeviceGray", depth,
+                      colors, depth, w, zlen);
+        zlibstored(data, raster, len, NULL);
+        fprintf(data, "\nendstream\nendobj\n");
+        obj[5] = ftell(data);
+        sprintf(content, "q %d 0 0 %d 18 %d cm /Im0 Do Q", 2*w, 2*h, bottom);
+        fprintf(data, "5 0 obj\n<< /Length %d >>\nstream\n%s\nendstream\nendobj\n",
+                      (int) strlen(content), content);
+        len = ftell(data);
+        fprintf(data, "xref\n0 6\n0000000000 65535 f \n");
+        for(k=1;k<6;k++) fprintf(data, "%010lld 00000 n \n", obj[k]);
+        fprintf(data, "trailer\n<< /Size 6 /Root 1 0 R >>\nstartxref\n%lld\n%%%%EOF\n", len);
     } else {
-    matrix2[*rpos+1][*cpos-1].height++;    //add one to lower left
-    matrixvol2++;
+        fwrite("\211PNG\r\n\032\n", 1, 8, data);
+        head[0] = w >> 24; head[1] = w >> 16; head[2] = w >> 8; head[3] = w;
+        head[4] = h >> 24; head[5] = h >> 16; head[6] = h >> 8; head[7] = h;
+        head[8] = depth;
+        head[9] = colors == 3 ? 2 : 0;      // truecolor or grayscale
+        head[10] = head[11] = head[12] = 0;     // deflate, adaptive, not interlaced
+        pngchunk(data, "IHDR", head, 13);
+        
+        // the data chunk is streamed, so its crc is kept as it goes
+        head[0] = zlen >> 24; head[1] = zlen >> 16; head[2] = zlen >> 8; head[3] = zlen;
+        fwrite(head, 1, 4, data);
+        fwrite("IDAT", 1, 4, data);
+        crc = pngcrc(0xffffffff, (unsigned char *) "IDAT", 4);
+        zlibstored(data, raster, len, &crc);
+        crc ^= 0xffffffff;
+        head[0] = crc >> 24; head[1] = crc >> 16; head[2] = crc >> 8; head[3] = crc;
+        fwrite(head, 1, 4, data);
+        pngchunk(data, "IEND", NULL, 0);
     }
-    // return no error
-    return 0;
+    
+    sinkclose(data);
 }
 
 //==============================================================================
 ////////////////////////////////////********////////////////////////////////////
 //==============================================================================
 
-void updatepositions(int *rpos, int *cpos, int *type) {
-    
+long long zlibstored(FILE *data, unsigned char *raw, long long len, unsigned int *crc) {
+    
+    unsigned char   head[5];
+    unsigned int    a = 1, b = 0;
+    long long   at, k;
+    int     block;
+    
+    // stored blocks of at most 65535 bytes, no compression: no zlib is
+    // linked, and the images are already a fraction of the vector
+    // pages they replace
+    if(data == NULL) return 2 + len + 5 * ((len + 65534) / 65535 + (len == 0)) + 4;
+    
+    head[0] = 0x78; head[1] = 0x01;
+    fwrite(head, 1, 2, data);
+    if(crc) *crc = pngcrc(*crc, head, 2);
+    at = 0;
+    do {
+        block = len - at > 65535 ? 65535 : (int) (len - at);
+        head[0] = at + block == len;            // last block flag
+        head[1] = block; head[2] = block >> 8;
+        head[3] = ~block; head[4] = ~block >> 8;
+        fwrite(head, 1, 5, data);
+        fwrite(raw + at, 1, block, data);
+        if(crc) {
+            *crc = pngcrc(*crc, head, 5);
+            *crc = pngcrc(*crc, raw + at, block);
+        }
+        for(k=at;k<at+block;k++) {
+            a += raw[k];
+            if(a >= 65521) a -= 65521;
+            b += a;
+            if(b >= 65521) b -= 65521;
+        }
+        at += block;
+    } while(at < len);
+    head[0] = b >> 8; head[1] = b; head[2] = a >> 8; head[3] = a;
+    fwrite(head, 1, 4, data);
+    if(crc) *crc = pngcrc(*crc, head, 4);
+    
+    return 2 + len + 5 * ((len + 65534) / 65535 + (len == 0)) + 4;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+unsigned int pngcrc(unsigned int crc, unsigned char *buf, long long len) {
+    
+    static unsigned int     table[256];
+    static int      ready = 0;
+    unsigned int    c;
+    long long   k;
+    int     n, bit;
+    
+    if(!ready) {
+        for(n=0;n<256;n++) {
+            c = n;
+            for(bit=0;bit<8;bit++) c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            table[n] = c;
+        }
+        ready = 1;
+    }
+    for(k=0;k<len;k++) crc = table[(crc ^ buf[k]) & 255] ^ (crc >> 8);
+    return crc;
+}
+
+void pngchunk(FILE *data, char *type, unsigned char *buf, int len) {
+    
+    unsigned char   word[4];
+    unsigned int    crc;
+    
+    word[0] = len >> 24; word[1] = len >> 16; word[2] = len >> 8; word[3] = len;
+    fwrite(word, 1, 4, data);
+    fwrite(type, 1, 4, data);
+    if(len > 0) fwrite(buf, 1, len, data);
+    crc = pngcrc(pngcrc(0xffffffff, (unsigned char *) type, 4), buf, len) ^ 0xffffffff;
+    word[0] = crc >> 24; word[1] = crc >> 16; word[2] = crc >> 8; word[3] = crc;
+    fwrite(word, 1, 4, data);
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void snapshot(int due) {
+    
+    #if FORK
+    pid_t   pid;
+    int     k, status;
+    int     stream = (due & SNAPVIDEO) || SINK == SINKARCHIVE || SINK == SINKPIPE;
+    #endif
+    
+    // nothing is rendered for the null sink, so a run with every
+    // output configured still measures the flips alone
+    if(SINK == SINKNULL) {
+        snapshotstep(due);
+        return;
+    }
+    
+    #if SCHEDULE
+    snapshotschedule(due);
+    #endif
+    
+    #if FORK
+    // a budget too tight for any child writes in place
+    if(forklimit > 0) {
+        snapshotwait(forklimit);
+    
+        // children sharing a stream take turns, so entries stay whole
+        // and in order
+        if(stream && streamchild) {
+            waitpid(streamchild, &status, 0);
+            for(k=0;k<forkchildren;k++) if(forkpid[k] == streamchild) snapshotforget(k);
+        }
+    
+        // anything buffered now would otherwise be written twice
+        fflush(NULL);
+        pid = fork();
+        if(pid == 0) {
+            // the child sees the matrices as they are now, however much
+            // the parent flips them meanwhile
+            snapshotwrite(due);
+            fflush(NULL);
+            _exit(0);
+        }
+        if(pid > 0) {
+            forkpid[forkchildren++] = pid;
+            if(stream) streamchild = pid;
+        
+            // the print functions step their counters in the child only,
+            // so step them here the same way
+            snapshotstep(due);
+            return;
+        }
+        printf("*** fork failed, writing the snapshot in place\n");
+    }
+    #endif
+    
+    snapshotwrite(due);
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void snapshotstep(int due) {
+    
+    #if TEXT
+    if(due & SNAPTEXT) {
+        tprint++;
+        if(tprint>20) tprint=0;
+    }
+    #endif
+    #if PDF
+    if(due & SNAPPDF) {
+        pprint++;
+        if(pprint>20) pprint=0;
+    }
+    #endif
+    #if CDENSITY
+    if(due & SNAPCDENSITY) {
+        cprint++;
+        if(cprint>50) cprint=0;
+    }
+    #endif
+    #if COMPONENTS
+    if(due & SNAPCOMPONENTS) {
+        lprint++;
+        if(lprint>20) lprint=0;
+    }
+    #endif
+    #if PATTERNS
+    if(due & SNAPPATTERNS) {
+        qprint++;
+        if(qprint>20) qprint=0;
+    }
+    #endif
+    #if DIFFERENCE
+    if(due & SNAPDIFFERENCE) {
+        dprint++;
+        if(dprint>50) dprint=0;
+    }
+    #endif
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void snapshotwrite(int due) {
+    
+    #if TEXT
+    if(due & SNAPTEXT) {
+        print_text();
+        print_text2();
+    }
+    #endif
+    
+    #if PDF
+    if((due & SNAPPDF) && pdfactive) {
+        print_pdf();
+        print_pdf2();
+    }
+    #endif
+    
+    #if CDENSITY
+    if(due & SNAPCDENSITY) {
+        print_cdensity();
+        print_cdensity2();
+        #if CDENSITYPDF
+        print_cdensitypdf();
+        print_cdensitypdf2();
+        #endif
+        #if CDENSITYPNG
+        print_cdensitypng();
+        print_cdensitypng2();
+        #endif
+    }
+    #endif
+    
+    #if VIDEO
+    if(due & SNAPVIDEO) print_video();
+    #endif
+    
+    #if COMPONENTS
+    if(due & SNAPCOMPONENTS) {
+        print_components(matrix, PRINT_COMPONENTS);
+        print_components(matrix2, PRINT_COMPONENTS "2");
+        snapshotstep(SNAPCOMPONENTS);
+    }
+    #endif
+    
+    #if PATTERNS
+    if(due & SNAPPATTERNS) {
+        print_patterns(0, PRINT_PATTERNS);
+        print_patterns(1, PRINT_PATTERNS "2");
+        snapshotstep(SNAPPATTERNS);
+    }
+    #endif
+    
+    #if CORRELATE
+    if(due & SNAPCORRELATE) {
+        print_correlations(0, "matrix");
+        print_correlations(1, "matrix2");
+    }
+    #endif
+    
+    #if DIFFERENCE
+    if(due & SNAPDIFFERENCE) {
+        print_difference();
+        snapshotstep(SNAPDIFFERENCE);
+    }
+    #endif
+}
+
+#if COMPONENTS
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void print_components(mstruct m[MAXROWS][MAXCOLS], char *sub) {
+    
+    struct timespec start, end;
+    long long   sites[7] = {0}, largest[7] = {0}, count[7] = {0};
+    const char  *names[7] = {"a1", "a2", "b1", "b2", "", "", "disordered"};
+    FILE    *data;
+    char    name[512];
+    int     i, j, k;
+    
+    for(i=0;i<nrows;i++) 
+        for(j=0;j<ncols;j++) codedplane[i*ncols+j] = (unsigned char) m[i][j].type;
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    components(codedplane, nrows, ncols);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    
+    printf("Flips completed: %lld - %d components labelled in %.2lf ms\n", flipcompleted,
+           componentcount, (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+    
+    for(k=0;k<componentcount;k++) {
+        count[component[k].class]++;
+        sites[component[k].class] += component[k].size;
+        if(largest[component[k].class] < component[k].size) 
+            largest[component[k].class] = component[k].size;
+    }
+    
+    // totals for each class, then every component of COMPONENTMIN
+    // positions or more with its bounding box
+    sprintf(name,"%s/%s/matrix%d.components",outputdir,sub,lprint);
+    if((data = sinkopen(name,"w"))!=NULL) {
+        for(k=0;k<7;k++) {
+            if(k==4 || k==5) continue;
+            fprintf(data, "%s: %lld components, %lld positions, largest %lld\n",
+                    names[k], count[k], sites[k], largest[k]);
+        }
+        fprintf(data, "\nid class size rows cols\n");
+        for(k=0;k<componentcount;k++) {
+            if(component[k].size < COMPONENTMIN) continue;
+            fprintf(data, "%d %s %d %d-%d %d-%d\n", k, names[component[k].class],
+                    component[k].size, component[k].minr, component[k].maxr,
+                    component[k].minc, component[k].maxc);
+        }
+        sinkclose(data);
+    }
+    
+    #if COMPONENTMAP
+    // rows and cols as a text line, then the id of each position as
+    // 32-bit little-endian integers in row order
+    sprintf(name,"%s/%s/matrix%d.labels",outputdir,sub,lprint);
+    if((data = sinkopen(name,"w"))!=NULL) {
+        fprintf(data, "%d %d\n", nrows, ncols);
+        fwrite(componentlabel, sizeof(int), (size_t) nrows * ncols, data);
+        sinkclose(data);
+    }
+    #endif
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+int components(unsigned char *t, int rows, int cols) {
+    
+    pthread_t   threads[COMPONENTTHREADS];      // one thread per band
+    int         i;
+    
+    componenttypes = t;
+    componentrows = rows;
+    componentcols = cols;
+    
+    pthread_barrier_init(&componentbarrier, NULL, COMPONENTTHREADS);
+    for(i=0;i<COMPONENTTHREADS;i++) 
+        pthread_create(&threads[i], NULL, componentband, (void *) (long) i);
+    for(i=0;i<COMPONENTTHREADS;i++) pthread_join(threads[i], NULL);
+    pthread_barrier_destroy(&componentbarrier);
+    
+    return componentcount;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void *componentband(void *arg) {
+    
+    int     id = (int) (long) arg;
+    int     rows = componentrows, cols = componentcols;
+    int     rlo = (int) ((long long) rows * id / COMPONENTTHREADS);
+    int     rhi = (int) ((long long) rows * (id+1) / COMPONENTTHREADS);
+    int     lo = rlo * cols, hi = rhi * cols;
+    unsigned char *t = componenttypes, *cls = componentclass;
+    int     *parent = componentparent;
+    int     i, j, k, r, c, run, label;
+    kstruct *kp;
+    
+    // a position is frozen if every neighbour has its type, so a
+    // domain is the inside of a region of one a or b type; the rest,
+    // c vertices included, is disordered.  Each row is classed, then
+    // labelled while still in cache.  The band is labelled on its own:
+    // every root is the first position of its tree, so it lies in the
+    // band.  A position joining its left or upper neighbour takes that
+    // neighbour's parent, which is at or near the root, so the trees
+    // stay shallow
+    for(r=rlo;r<rhi;r++) {
+        for(c=0,i=r*cols;c<cols;c++,i++) {
+            k = t[i];
+            if(k >= 4 || (c > 0 && t[i-1] != k) || (c < cols-1 && t[i+1] != k) ||
+               (r > 0 && t[i-cols] != k) || (r < rows-1 && t[i+cols] != k)) k = 6;
+            cls[i] = (unsigned char) k;
+        }
+        for(c=0,i=r*cols;c<cols;c++,i++) {
+            if(c > 0 && cls[i-1] == cls[i]) {
+                parent[i] = parent[i-1];
+                if(r > rlo && cls[i-cols] == cls[i] && parent[i-cols] != parent[i]) 
+                    componentunion(i, i-cols);
+            } else if(r > rlo && cls[i-cols] == cls[i]) {
+                parent[i] = parent[i-cols];
+            } else {
+                parent[i] = i;
+            }
+        }
+    }
+    pthread_barrier_wait(&componentbarrier);
+    
+    // join the bands across their borders, one thread for all of them
+    if(id == 0) {
+        for(k=1;k<COMPONENTTHREADS;k++) {
+            j = (int) ((long long) rows * k / COMPONENTTHREADS) * cols;
+            if(j == 0 || j >= rows * cols) continue;
+            for(i=j;i<j+cols;i++) if(cls[i-cols] == cls[i]) componentunion(i, i-cols);
+        }
+    }
+    pthread_barrier_wait(&componentbarrier);
+    
+    // resolve every position without writing to the forest, and count
+    // the roots, which number the components band by band
+    componentroots[id+1] = 0;
+    for(i=lo;i<hi;i++) {
+        k = parent[i];
+        componentlabel[i] = parent[k] == k ? k : componentfind(k);
+        componentroots[id+1] += componentlabel[i] == i;
+    }
+    pthread_barrier_wait(&componentbarrier);
+    
+    if(id == 0) {
+        componentroots[0] = 0;
+        for(k=1;k<=COMPONENTTHREADS;k++) componentroots[k] += componentroots[k-1];
+        componentcount = componentroots[COMPONENTTHREADS];
+    }
+    pthread_barrier_wait(&componentbarrier);
+    
+    label = componentroots[id];
+    for(i=lo;i<hi;i++) {
+        if(componentlabel[i] != i) continue;
+        kp = &component[label];
+        kp->size = 0;
+        kp->minr = kp->minc = 0x7FFFFFFF;
+        kp->maxr = kp->maxc = -1;
+        kp->class = cls[i];
+        componentparent[i] = label++;
+    }
+    pthread_barrier_wait(&componentbarrier);
+    
+    // number the positions and add up the statistics a run at a time,
+    // so a large domain costs one atomic update per row
+    for(i=lo;i<hi;i=run) {
+        k = componentlabel[i];
+        label = parent[k];
+        r = i / cols;
+        j = (r+1) * cols;
+        for(run=i;run<j && componentlabel[run]==k;run++) componentlabel[run] = label;
+        kp = &component[label];
+        
+        __atomic_add_fetch(&kp->size, run - i, __ATOMIC_RELAXED);
+        for(k=__atomic_load_n(&kp->minr, __ATOMIC_RELAXED);r<k;) 
+            if(__atomic_compare_exchange_n(&kp->minr, &k, r, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+        for(k=__atomic_load_n(&kp->maxr, __ATOMIC_RELAXED);r>k;) 
+            if(__atomic_compare_exchange_n(&kp->maxr, &k, r, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+        c = i % cols;
+        for(k=__atomic_load_n(&kp->minc, __ATOMIC_RELAXED);c<k;) 
+            if(__atomic_compare_exchange_n(&kp->minc, &k, c, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+        c = (run-1) % cols;
+        for(k=__atomic_load_n(&kp->maxc, __ATOMIC_RELAXED);c>k;) 
+            if(__atomic_compare_exchange_n(&kp->maxc, &k, c, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+    }
+    
+    return NULL;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+static inline int componentfind(int i) {
+    
+    while(componentparent[i] != i) i = componentparent[i];
+    return i;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+static inline void componentunion(int i, int j) {
+    
+    int     a, b;
+    
+    // path halving while climbing; only called while one thread owns
+    // every position it can reach
+    while(componentparent[i] != i) i = componentparent[i] = componentparent[componentparent[i]];
+    while(componentparent[j] != j) j = componentparent[j] = componentparent[componentparent[j]];
+    a = i < j ? i : j;
+    b = i < j ? j : i;
+    componentparent[b] = a;
+}
+#endif
+
+#if PATTERNS
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void patternscan(mstruct m[MAXROWS][MAXCOLS], int *counts) {
+    
+    unsigned char *t0, *t1, *t2;
+    unsigned short *code = patterncode;
+    int     i, j;
+    
+    for(i=0;i<nrows;i++) 
+        for(j=0;j<ncols;j++) codedplane[i*ncols+j] = (unsigned char) m[i][j].type;
+    memset(counts, 0, sizeof(int) * patternregionrows * patternregioncols * PATTERNSLOTS);
+    
+    // windows never wrap.  The codes along a row do not depend on each
+    // other, so each code loop compiles to wide loads and multiplies;
+    // only the increments, which can hit one counter twice, go singly
+    for(i=0;i<nrows;i++) {
+        t0 = codedplane + (size_t) i * ncols;
+        if(i < nrows-1) {
+            t1 = t0 + ncols;
+            for(j=0;j<ncols-1;j++) 
+                code[j] = (unsigned short) (t0[j]*216 + t0[j+1]*36 + t1[j]*6 + t1[j+1]);
+            for(j=0;j<ncols-1;j++) counts[PATTERNAT(i,j) + code[j]]++;
+        }
+        for(j=0;j<ncols-2;j++) 
+            code[j] = (unsigned short) (PATTERNSQUARES + t0[j]*36 + t0[j+1]*6 + t0[j+2]);
+        for(j=0;j<ncols-2;j++) counts[PATTERNAT(i,j) + code[j]]++;
+        if(i < nrows-2) {
+            t1 = t0 + ncols;
+            t2 = t1 + ncols;
+            for(j=0;j<ncols;j++) 
+                code[j] = (unsigned short) (PATTERNSQUARES + PATTERNTRIPLES + t0[j]*36 + t1[j]*6 + t2[j]);
+            for(j=0;j<ncols;j++) counts[PATTERNAT(i,j) + code[j]]++;
+        }
+    }
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void patternflip(mstruct m[MAXROWS][MAXCOLS], int *counts, int rpos, int cpos, int type, int sign) {
+    
+    int     rows[2], cols[2], r[6], c[6];
+    int     nr, nc, i, j, code;
+    
+    // the flip changes rows rpos and FLIPROW, cols cpos and FLIPCOL.
+    // Every window holding one of them is taken out before and put
+    // back after; a window in the spans holding none of them cancels.
+    // The ends are found apart, so a plaquette across a wrapped edge
+    // costs no more
+    rows[0] = rpos;
+    rows[1] = FLIPROW(rpos,type);
+    cols[0] = cpos;
+    cols[1] = FLIPCOL(cpos,type);
+    
+    // 2x2 windows
+    nr = patternspan(rows, 1, nrows-2, r);
+    nc = patternspan(cols, 1, ncols-2, c);
+    for(i=0;i<nr;i++) {
+        for(j=0;j<nc;j++) {
+            code = ((m[r[i]][c[j]].type*6 + m[r[i]][c[j]+1].type)*6 
+                    + m[r[i]+1][c[j]].type)*6 + m[r[i]+1][c[j]+1].type;
+            counts[PATTERNAT(r[i],c[j]) + code] += sign;
+        }
+    }
+    
+    // three along a row
+    nr = patternspan(rows, 0, nrows-1, r);
+    nc = patternspan(cols, 2, ncols-3, c);
+    for(i=0;i<nr;i++) {
+        for(j=0;j<nc;j++) {
+            code = (m[r[i]][c[j]].type*6 + m[r[i]][c[j]+1].type)*6 + m[r[i]][c[j]+2].type;
+            counts[PATTERNAT(r[i],c[j]) + PATTERNSQUARES + code] += sign;
+        }
+    }
+    
+    // three down a column
+    nr = patternspan(rows, 2, nrows-3, r);
+    nc = patternspan(cols, 0, ncols-1, c);
+    for(i=0;i<nr;i++) {
+        for(j=0;j<nc;j++) {
+            code = (m[r[i]][c[j]].type*6 + m[r[i]+1][c[j]].type)*6 + m[r[i]+2][c[j]].type;
+            counts[PATTERNAT(r[i],c[j]) + PATTERNSQUARES + PATTERNTRIPLES + code] += sign;
+        }
+    }
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+int patternspan(int *x, int below, int limit, int *out) {
+    
+    int     k, v, i, n = 0;
+    
+    for(k=0;k<2;k++) {
+        for(v=x[k]-below;v<=x[k];v++) {
+            if(v < 0 || v > limit) continue;
+            for(i=0;i<n && out[i]!=v;i++);
+            if(i == n) out[n++] = v;
+        }
+    }
+    return n;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void patternsample(void) {
+    
+    long long   s, n = (long long) patternregionrows * patternregioncols * PATTERNSLOTS;
+    int     k;
+    
+    #if PARALLEL
+    // sweeps flip the type planes, not the matrices, so count afresh;
+    // a rescan costs far less than the sweep before it
+    patternscan(matrix, patternlive[0]);
+    patternscan(matrix2, patternlive[1]);
+    #endif
+    
+    for(k=0;k<2;k++) 
+        for(s=0;s<n;s++) patternsum[k][s] += patternlive[k][s];
+    patternsamples++;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void print_patterns(int k, char *sub) {
+    
+    int     *live = patternlive[k];
+    long long   *sum = patternsum[k];
+    long long   total[3];
+    const char  *shapes[3] = {"square", "row", "col"};
+    FILE    *data;
+    char    name[512], pattern[16];
+    int     region, regions = patternregionrows * patternregioncols;
+    int     rlo, clo, s, shape;
+    
+    printf("Flips completed: %lld - pattern counts written\n",flipcompleted);
+    
+    // this sample, then the mean over every sample so far with its
+    // share of the windows of that shape; one block per region, with
+    // only the patterns seen.  Squares list their types top left, top
+    // right, bottom left, bottom right
+    sprintf(name,"%s/%s/matrix%d.patterns",outputdir,sub,qprint);
+    if((data = sinkopen(name,"w"))!=NULL) {
+        for(region=0;region<regions;region++) {
+            rlo = region / patternregioncols * patternside;
+            clo = region % patternregioncols * patternside;
+            fprintf(data, "region %d rows %d-%d cols %d-%d\n", region, rlo, 
+                    (rlo+patternside < nrows ? rlo+patternside : nrows) - 1, clo,
+                    (clo+patternside < ncols ? clo+patternside : ncols) - 1);
+            for(s=0;s<PATTERNSLOTS;s++) {
+                if(live[region*PATTERNSLOTS+s] == 0) continue;
+                shape = patternname(s, pattern);
+                fprintf(data, "%s %s %d\n", shapes[shape], pattern, live[region*PATTERNSLOTS+s]);
+            }
+        }
+        sinkclose(data);
+    }
+    
+    sprintf(name,"%s/%s/patterns.average",outputdir,sub);
+    if((data = sinkopen(name,"w"))!=NULL) {
+        fprintf(data, "samples %lld\n", patternsamples);
+        for(region=0;region<regions;region++) {
+            total[0] = total[1] = total[2] = 0;
+            for(s=0;s<PATTERNSLOTS;s++) total[patternname(s, pattern)] += sum[region*PATTERNSLOTS+s];
+            fprintf(data, "region %d\n", region);
+            for(s=0;s<PATTERNSLOTS;s++) {
+                if(sum[region*PATTERNSLOTS+s] == 0) continue;
+                shape = patternname(s, pattern);
+                fprintf(data, "%s %s %lf %lf\n", shapes[shape], pattern,
+                        (double) sum[region*PATTERNSLOTS+s] / patternsamples,
+                        (double) sum[region*PATTERNSLOTS+s] / total[shape]);
+            }
+        }
+        sinkclose(data);
+    }
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+int patternname(int slot, char *out) {
+    
+    const char  *names[6] = {"a1", "a2", "b1", "b2", "c1", "c2"};
+    int     shape, n, code, i, div;
+    
+    if(slot < PATTERNSQUARES) {
+        shape = 0; n = 4; code = slot;
+    } else if(slot < PATTERNSQUARES + PATTERNTRIPLES) {
+        shape = 1; n = 3; code = slot - PATTERNSQUARES;
+    } else {
+        shape = 2; n = 3; code = slot - PATTERNSQUARES - PATTERNTRIPLES;
+    }
+    
+    // the first type is the most significant digit
+    for(i=0,div=(n==4 ? 216 : 36);i<n;i++,div/=6) {
+        out += sprintf(out, i ? " %s" : "%s", names[code / div % 6]);
+    }
+    return shape;
+}
+#endif
+
+#if CORRELATE
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void correlatestart(void) {
+    
+    int     i, j, k, l, o;
+    long long   lag;
+    
+    // CORRELATEOCTAVE lags to each doubling, rounded to whole flips
+    // and kept strictly increasing
+    for(l=0,k=0;l<CORRELATELAGS;k++) {
+        lag = (long long) (CORRELATEFIRST * pow(2.0, (double) k / CORRELATEOCTAVE) + 0.5);
+        if(l == 0 || lag > correlatelag[l-1]) correlatelag[l++] = lag;
+    }
+    
+    for(k=0;k<2;k++) {
+        correlatehnow[k] = 0;
+        correlatecnow[k] = 0;
+        for(i=0;i<nrows;i++) {
+            for(j=0;j<ncols;j++) {
+                correlatehnow[k] += k ? matrix2[i][j].height : matrix[i][j].height;
+                correlatecnow[k] += (k ? matrix2[i][j].type : matrix[i][j].type) >= 4;
+            }
+        }
+    }
+    
+    // heights stay within rows+cols of the boundary, so a short holds
+    // them and an origin costs 3 bytes per position and matrix
+    for(o=0;o<correlateorigins;o++) {
+        for(k=0;k<2;k++) {
+            correlateorigin[o].height[k] = malloc(sizeof(short) * nrows * ncols);
+            correlateorigin[o].c[k] = malloc((size_t) nrows * ncols);
+        }
+        correlateorigin[o].lag = -1;
+    }
+    correlatenextorigin = flipcompleted;
+    correlatenextat = flipcompleted;
+    
+    printf("Correlations: %d origins %d flips apart, lags %lld to %lld flips\n",
+           correlateorigins, CORRELATESPACING, correlatelag[0], correlatelag[CORRELATELAGS-1]);
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void correlateflip(int k, mstruct m[MAXROWS][MAXCOLS], int rpos, int cpos, int type, int sign) {
+    
+    int     rows[4], cols[4];
+    int     s;
+    
+    // a flip changes the types of its four positions and the height
+    // of one of them, so C(t) moves by the origin's value times the
+    // change at those four alone
+    rows[0] = rows[1] = rpos;
+    rows[2] = rows[3] = FLIPROW(rpos,type);
+    cols[0] = cols[2] = cpos;
+    cols[1] = cols[3] = FLIPCOL(cpos,type);
+    
+    for(s=0;s<4;s++) correlateat(k, m, rows[s], cols[s], sign);
+}
+
+static inline void correlateat(int k, mstruct m[MAXROWS][MAXCOLS], int r, int c, int sign) {
+    
+    int     o, h, v, at;
+    tstruct *to;
+    
+    h = sign * m[r][c].height;
+    v = sign * (m[r][c].type >= 4);
+    at = r * ncols + c;
+    correlatehnow[k] += h;
+    correlatecnow[k] += v;
+    for(o=0;o<correlateorigins;o++) {
+        to = &correlateorigin[o];
+        if(to->lag < 0) continue;
+        to->hh[k] += h * to->height[k][at];
+        to->cc[k] += v * to->c[k][at];
+    }
+}
+
+void correlaterow(int k, mstruct m[MAXROWS][MAXCOLS], int r, int sign) {
+    
+    int     c;
+    
+    for(c=0;c<ncols;c++) correlateat(k, m, r, c, sign);
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void correlatestep(void) {
+    
+    tstruct *to;
+    double  n = (double) nrows * ncols;
+    double  hsq, csq;
+    int     i, j, k, l, o, h;
+    
+    // record every origin whose next lag has come.  Products and sums
+    // are divided by the positions, so each record is one sample of
+    // <h(x,0) h(x,t)> and <h(x,0)> <h(x,t)>
+    for(o=0;o<correlateorigins;o++) {
+        to = &correlateorigin[o];
+        while(to->lag >= 0 && flipcompleted - to->at >= correlatelag[to->lag]) {
+            l = to->lag;
+            correlatecount[l]++;
+            for(k=0;k<2;k++) {
+                correlatesum[k][l][0] += to->hh[k] / n;
+                correlatesum[k][l][1] += to->h0[k] * (correlatehnow[k] / n);
+                correlatesum[k][l][2] += to->hvar[k];
+                correlatesum[k][l][3] += to->cc[k] / n;
+                correlatesum[k][l][4] += to->c0[k] * (correlatecnow[k] / n);
+                correlatesum[k][l][5] += to->cvar[k];
+            }
+            to->lag = l+1 < CORRELATELAGS ? l+1 : -1;
+        }
+    }
+    
+    // a new origin takes a free slot; with none free this one is
+    // skipped rather than an old one cut short
+    if(flipcompleted >= correlatenextorigin) {
+        for(o=0;o<correlateorigins && correlateorigin[o].lag >= 0;o++);
+        if(o < correlateorigins) {
+            to = &correlateorigin[o];
+            for(k=0;k<2;k++) {
+                hsq = csq = 0;
+                for(i=0;i<nrows;i++) {
+                    for(j=0;j<ncols;j++) {
+                        h = k ? matrix2[i][j].height : matrix[i][j].height;
+                        to->height[k][i*ncols+j] = (short) h;
+                        to->c[k][i*ncols+j] = (k ? matrix2[i][j].type : matrix[i][j].type) >= 4;
+                        hsq += (double) h * h;
+                        csq += to->c[k][i*ncols+j];
+                    }
+                }
+                // at lag 0 the products are the squares
+                to->hh[k] = (long long) hsq;
+                to->cc[k] = (long long) csq;
+                to->h0[k] = correlatehnow[k] / n;
+                to->c0[k] = correlatecnow[k] / n;
+                to->hvar[k] = hsq / n - to->h0[k] * to->h0[k];
+                to->cvar[k] = csq / n - to->c0[k] * to->c0[k];
+            }
+            to->at = flipcompleted;
+            to->lag = 0;
+        }
+        correlatenextorigin += CORRELATESPACING;
+    }
+    
+    correlatenextat = correlatenextorigin;
+    for(o=0;o<correlateorigins;o++) {
+        to = &correlateorigin[o];
+        if(to->lag >= 0 && to->at + correlatelag[to->lag] < correlatenextat) 
+            correlatenextat = to->at + correlatelag[to->lag];
+    }
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void print_correlations(int k, char *stem) {
+    
+    FILE    *data;
+    char    name[512];
+    double  (*sum)[6] = correlatesum[k];
+    double  hh, hc, cc, cconn;
+    int     l;
+    
+    printf("Flips completed: %lld - correlations written\n",flipcompleted);
+    
+    // one line per lag with any records: the lag in flips, the origins
+    // averaged, then for the heights and the c-density in turn
+    // <f(x,0) f(x,t)>, the connected part less <f(x,0)> <f(x,t)>, and
+    // that divided by the variance at the origin
+    sprintf(name,"%s/%s/%s.correlation",outputdir,PRINT_CORRELATE,stem);
+    if((data = sinkopen(name,"w"))!=NULL) {
+        fprintf(data, "lag origins h connected normalized c connected normalized\n");
+        for(l=0;l<CORRELATELAGS;l++) {
+            if(correlatecount[l] == 0) continue;
+            hh = sum[l][0] / correlatecount[l];
+            hc = hh - sum[l][1] / correlatecount[l];
+            cc = sum[l][3] / correlatecount[l];
+            cconn = cc - sum[l][4] / correlatecount[l];
+            fprintf(data, "%lld %lld %lf %lf %lf %lf %lf %lf\n", correlatelag[l], correlatecount[l],
+                    hh, hc, sum[l][2] > 0 ? hc / (sum[l][2] / correlatecount[l]) : 0,
+                    cc, cconn, sum[l][5] > 0 ? cconn / (sum[l][5] / correlatecount[l]) : 0);
+        }
+        sinkclose(data);
+    }
+}
+#endif
+
+#if RECORDER
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void recorderstart(void) {
+    
+    int     f, k;
+    
+    // a pass makes at most one flip of each matrix, so the journal
+    // holds every flip since the oldest frame kept
+    recorderinterval = (long long) RECORDERSWEEPS * nrows * ncols;
+    recordercap = 2 * recorderinterval * RECORDERFRAMES;
+    recorderjournal = malloc(sizeof(unsigned int) * recordercap);
+    for(f=0;f<RECORDERFRAMES;f++) 
+        for(k=0;k<2;k++) recorderring[f].type[k] = malloc(((size_t) nrows * ncols + 1) / 2);
+    
+    signal(SIGUSR1, recordersignal);
+    recordertake();
+    
+    printf("Flight recorder: %d frames %lld passes apart (kill -USR1 %d dumps them)\n",
+           RECORDERFRAMES, recorderinterval, (int) getpid());
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void recordersignal(int sig) {
+    
+    // only the flag; the main loop writes the dump at the next pass
+    (void) sig;
+    recorderwanted = 1;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void recordercheck(void) {
+    
+    if(recorderwanted) {
+        recorderwanted = 0;
+        recorderdump("asked for by SIGUSR1");
+    }
+    if(recorderpass >= recordernextat) recordertake();
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void recordertake(void) {
+    
+    fstruct *fr = &recorderring[recorderframes % RECORDERFRAMES];
+    fstruct *last = &recorderring[(recorderframes + RECORDERFRAMES - 1) % RECORDERFRAMES];
+    long long   tried;
+    int     i, j, k, at;
+    char    reason[128];
+    
+    // packing is a pass over the matrices and nothing more; frames
+    // are only entropy coded if they are dumped
+    for(k=0;k<2;k++) {
+        at = 0;
+        for(i=0;i<nrows;i++) {
+            for(j=0;j<ncols;j++,at++) {
+                if(at & 1) fr->type[k][at>>1] |= (unsigned char) ((k ? matrix2[i][j].type : matrix[i][j].type) << 4);
+                else fr->type[k][at>>1] = (unsigned char) (k ? matrix2[i][j].type : matrix[i][j].type);
+            }
+        }
+    }
+    fr->pass = recorderpass;
+    fr->flipcompleted = flipcompleted;
+    fr->flipfailed = flipfailed;
+    fr->journal = recorderflips;
+    fr->volume[0] = matrixvol;
+    fr->volume[1] = matrixvol2;
+    fr->acceptance = 0;
+    recordernextat = recorderpass + recorderinterval;
+    
+    if(recorderframes++ == 0) return;
+    
+    tried = (flipcompleted - last->flipcompleted) + (flipfailed - last->flipfailed);
+    fr->acceptance = tried ? (double) (flipcompleted - last->flipcompleted) / tried : 0;
+    
+    // the watchdog: a volume that has stopped, or an acceptance that
+    // has fallen away since the frame before; one dump per episode
+    if(fr->volume[0] == last->volume[0] && fr->volume[1] == last->volume[1]) recorderstall++;
+    else recorderstall = 0;
+    
+    reason[0] = '\0';
+    if(RECORDERSTALL && recorderstall >= RECORDERSTALL) 
+        sprintf(reason, "volume stuck for %d frames", recorderstall);
+    else if(RECORDERDROP > 0 && recorderframes > 2 && fr->acceptance < RECORDERDROP * last->acceptance) 
+        sprintf(reason, "acceptance fell from %lf to %lf", last->acceptance, fr->acceptance);
+    
+    if(reason[0] == '\0') recordertripped = 0;
+    else if(!recordertripped) {
+        recordertripped = 1;
+        recorderdump(reason);
+    }
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+static inline void recordernote(int k, int rpos, int cpos, int type) {
+    
+    recorderjournal[recorderhead] = (unsigned int) k << 31 | (unsigned int) (type != 0) << 30 
+                                    | (unsigned int) rpos << 15 | (unsigned int) cpos;
+    if(++recorderhead == recordercap) recorderhead = 0;
+    recorderflips++;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void recorderdump(char *reason) {
+    
+    FILE    *data;
+    char    dir[512], name[600];
+    int     f, first, kept, i, k;
+    long long   n = (long long) nrows * ncols, len, from, at;
+    fstruct *fr;
+    
+    // a dump is read by hand after something went wrong, so it goes
+    // to plain files in the run directory whatever the sink
+    mkdir("./output", 0777);
+    mkdir(outputdir, 0777);
+    sprintf(dir,"%s/%s",outputdir,PRINT_RECORDER);
+    mkdir(dir, 0777);
+    sprintf(dir,"%s/%s/dump%d",outputdir,PRINT_RECORDER,recorderdumps);
+    mkdir(dir, 0777);
+    
+    kept = recorderframes < RECORDERFRAMES ? recorderframes : RECORDERFRAMES;
+    first = recorderframes - kept;
+    from = recorderring[first % RECORDERFRAMES].journal;
+    
+    printf("Flips completed: %lld - flight recorder dump %d: %s\n", flipcompleted, recorderdumps, reason);
+    
+    sprintf(name,"%s/recorder.log",dir);
+    if((data = fopen(name,"w"))==NULL) {
+        printf("*** error opening %s\n", name);
+        return;
+    }
+    fprintf(data, "reason: %s\n", reason);
+    fprintf(data, "size: %d %d\n", nrows, ncols);
+    fprintf(data, "boundary: %d\n", BOUNDARY);
+    fprintf(data, "frames: %d\n", kept);
+    for(f=first;f<recorderframes;f++) {
+        fr = &recorderring[f % RECORDERFRAMES];
+        fprintf(data, "frame %d: pass %lld completed %lld failed %lld volume %d %d acceptance %lf journal %lld\n",
+                f - first, fr->pass, fr->flipcompleted, fr->flipfailed, fr->volume[0], fr->volume[1],
+                fr->acceptance, fr->journal - from);
+    }
+    fprintf(data, "now: pass %lld completed %lld failed %lld volume %d %d journal %lld\n",
+            recorderpass, flipcompleted, flipfailed, matrixvol, matrixvol2, recorderflips - from);
+    fclose(data);
+    
+    // every frame kept as a .vtc that "main -d" reads
+    for(f=first;f<recorderframes;f++) {
+        fr = &recorderring[f % RECORDERFRAMES];
+        for(k=0;k<2;k++) {
+            for(i=0;i<n;i++) codedplane[i] = (fr->type[k][i>>1] >> ((i & 1) * 4)) & 15;
+            len = encodeplane(codedplane, nrows, ncols, codedout, n + 16);
+            sprintf(name,"%s/frame%d%s.vtc",dir,f - first,k ? "-2" : "");
+            if((data = fopen(name,"wb"))==NULL) continue;
+            fwrite(codedout, 1, len, data);
+            fclose(data);
+        }
+    }
+    
+    // the flips since the oldest frame, oldest first, as 32-bit words
+    sprintf(name,"%s/flips.journal",dir);
+    if((data = fopen(name,"wb"))!=NULL) {
+        at = (recorderhead - (recorderflips - from) + recordercap) % recordercap;
+        if(at + (recorderflips - from) <= recordercap) {
+            fwrite(recorderjournal + at, sizeof(unsigned int), recorderflips - from, data);
+        } else {
+            fwrite(recorderjournal + at, sizeof(unsigned int), recordercap - at, data);
+            fwrite(recorderjournal, sizeof(unsigned int), recorderhead, data);
+        }
+        fclose(data);
+    }
+    
+    recorderdumps++;
+}
+#endif
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+int recorderreplay(char *dir, long long upto) {
+    
+    FILE    *data, *flips;
+    char    name[600], line[512];
+    unsigned char   *in, *t[2], *check;
+    unsigned int    flip;
+    long long   len, journal[1024], target, done = 0, total = -1;
+    int     frames = 0, checked = 0, f, k, r, c, type;
+    int     rows = 0, cols = 0, boundary = -1;
+    
+    // frame offsets into the journal, and where it ends; a ring never
+    // keeps anywhere near 1024 frames
+    sprintf(name,"%s/recorder.log",dir);
+    if((data = fopen(name,"r"))==NULL) {
+        printf("*** error opening %s\n", name);
+        return 1;
+    }
+    while(fgets(line, sizeof(line), data) != NULL) {
+        sscanf(line, "size: %d %d", &rows, &cols);
+        sscanf(line, "boundary: %d", &boundary);
+        if(strstr(line, "journal") == NULL) continue;
+        if(sscanf(line, "frame %d:", &f) == 1 && f >= 0 && f < 1024) {
+            journal[f] = atoll(strstr(line, "journal") + 8);
+            if(f >= frames) frames = f + 1;
+        }
+        if(strncmp(line, "now:", 4) == 0) total = atoll(strstr(line, "journal") + 8);
+    }
+    fclose(data);
+    
+    // the flip geometry is compiled in, so the dump must match it
+    if(rows <= 0 || cols <= 0 || rows > MAXROWS || cols > MAXCOLS || frames == 0 || total < 0 
+       || boundary != BOUNDARY) {
+        printf("*** %s is not a dump this build can replay\n", dir);
+        return 1;
+    }
+    nrows = rows;
+    ncols = cols;
+    
+    sprintf(name,"%s/flips.journal",dir);
+    if((flips = fopen(name,"rb"))==NULL) {
+        printf("*** error opening %s\n", name);
+        return 1;
+    }
+    
+    // one block for the read buffer, the frame being checked and both
+    // replayed planes, so every way out frees it the same way
+    if((in = malloc(4 * ((size_t) rows * cols + 16))) == NULL) {
+        printf("*** no memory to replay a %dx%d dump\n", rows, cols);
+        fclose(flips);
+        return 1;
+    }
+    check = in + (size_t) rows * cols + 16;
+    t[0] = check + (size_t) rows * cols + 16;
+    t[1] = t[0] + (size_t) rows * cols + 16;
+    
+    // from the oldest frame through every flip, checking each later
+    // frame as it is reached
+    for(f=0;f<=frames;f++) {
+        if(f < frames) {
+            for(k=0;k<2;k++) {
+                sprintf(name,"%s/frame%d%s.vtc",dir,f,k ? "-2" : "");
+                len = 0;
+                if((data = fopen(name,"rb"))!=NULL) {
+                    len = (long long) fread(in, 1, (size_t) rows * cols + 16, data);
+                    fclose(data);
+                }
+                if(len == 0 || decodeplane(in, len, f ? check : t[k], rows, cols)) {
+                    printf("*** %s is not a coded matrix\n", name);
+                    fclose(flips);
+                    free(in);
+                    return 1;
+                }
+                if(f && memcmp(check, t[k], (size_t) rows * cols) != 0) {
+                    printf("*** replay differs from frame %d of matrix %d\n", f, k+1);
+                    fclose(flips);
+                    free(in);
+                    return 1;
+                }
+            }
+            checked++;
+            if(f == frames - 1 && total == journal[f]) break;
+        }
+        
+        target = f+1 < frames ? journal[f+1] : total;
+        if(upto >= 0 && target > upto) target = upto;
+        while(done < target && fread(&flip, sizeof(flip), 1, flips) == 1) {
+            k = flip >> 31;
+            type = (flip >> 30) & 1;
+            r = (flip >> 15) & 0x7fff;
+            c = flip & 0x7fff;
+            t[k][r*cols+c] = flipmap[type][0][t[k][r*cols+c]];
+            t[k][r*cols+FLIPCOL(c,type)] = flipmap[type][1][t[k][r*cols+FLIPCOL(c,type)]];
+            t[k][FLIPROW(r,type)*cols+c] = flipmap[type][2][t[k][FLIPROW(r,type)*cols+c]];
+            t[k][FLIPROW(r,type)*cols+FLIPCOL(c,type)] 
+                = flipmap[type][3][t[k][FLIPROW(r,type)*cols+FLIPCOL(c,type)]];
+            done++;
+        }
+        if(done < target) {
+            printf("*** %s/flips.journal ends after %lld flips\n", dir, done);
+            fclose(flips);
+            free(in);
+            return 1;
+        }
+        if(f+1 >= frames || (upto >= 0 && done >= upto)) break;
+    }
+    fclose(flips);
+    
+    // the state the replay stopped at, in the usual text layout
+    for(k=0;k<2;k++) {
+        sprintf(name,"%s/replay%s.matrix",dir,k ? "-2" : "");
+        if((data = fopen(name,"w"))==NULL) {
+            printf("*** error opening %s\n", name);
+            free(in);
+            return 1;
+        }
+        for(r=0;r<rows*cols;r++) fputc('0' + t[k][r], data);
+        fclose(data);
+    }
+    printf("%s: %d frames checked, %lld of %lld flips replayed\n", dir, checked, done, total);
+    
+    free(in);
+    return 0;
+}
+
+#if DIFFERENCE
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void differencestart(void) {
+    
+    int     i;
+    
+    differencecount = 0;
+    for(i=0;i<nrows;i++) {
+        differencerow[i] = 0;
+        differencerecount(i);
+    }
+}
+
+void differencerecount(int r) {
+    
+    int     j;
+    
+    differencecount -= differencerow[r];
+    differencerow[r] = 0;
+    for(j=0;j<ncols;j++) differencerow[r] += matrix[r][j].height != matrix2[r][j].height;
+    differencecount += differencerow[r];
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+static inline void differenceflip(int rpos, int cpos, int type, int sign) {
+    
+    // a flip moves one height: its own down, or the one below left up
+    int     r = type ? rpos : ROWDOWN(rpos);
+    int     c = type ? cpos : COLLEFT(cpos);
+    
+    if(matrix[r][c].height != matrix2[r][c].height) {
+        differencerow[r] += sign;
+        differencecount += sign;
+    }
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void print_difference(void) {
+    
+    unsigned char   *p = differenceraster;
+    char    name[512];
+    int     i, j, d, most = 1;
+    double  t;
+    
+    printf("Flips completed: %lld - difference overlay written\n",flipcompleted);
+    
+    // rows the counts say agree are one fill each, so a coupled pair
+    // that has nearly met costs next to nothing; the largest gap sets
+    // the colour scale
+    for(i=0;i<nrows;i++) {
+        if(differencerow[i] == 0) continue;
+        for(j=0;j<ncols;j++) {
+            d = abs(matrix[i][j].height - matrix2[i][j].height);
+            if(d > most) most = d;
+        }
+    }
+    for(i=0;i<nrows;i++) {
+        *p++ = 0;                               // filter type none
+        if(differencerow[i] == 0) {
+            memset(p, DIFFERENCEGREY, 3 * ncols);
+            p += 3 * ncols;
+            continue;
+        }
+        for(j=0;j<ncols;j++,p+=3) {
+            d = matrix[i][j].height - matrix2[i][j].height;
+            t = most > 1 ? (double) (abs(d) - 1) / (most - 1) : 1;
+            if(d == 0) {
+                p[0] = p[1] = p[2] = DIFFERENCEGREY;
+            } else if(d > 0) {
+                // high above low: yellow for one step, red at the most
+                p[0] = 255;
+                p[1] = (unsigned char) (255 * (1 - t));
+                p[2] = 0;
+            } else {
+                // low above high, which the coupling should never allow
+                p[0] = 0;
+                p[1] = (unsigned char) (255 * (1 - t));
+                p[2] = 255;
+            }
+        }
+    }
+    
+    sprintf(name,"%s/%s/output%d.png",outputdir,PRINT_DIFFERENCE,dprint);
+    sinkimage(name, differenceraster, p - differenceraster, ncols, nrows, 3, 8, 0, 18);
+}
+#endif
+
+#if VIDEO
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+int videoopen(void) {
+    
+    char    name[512];
+    
+    // whole pixels, even sides so encoders can subsample the chroma
+    videowidth = ((ncols + VIDEOSCALE - 1) / VIDEOSCALE + 1) & ~1;
+    videoheight = ((nrows + VIDEOSCALE - 1) / VIDEOSCALE + 1) & ~1;
+    videoframe = malloc(3 * videowidth * videoheight);
+    
+    if(VIDEOPIPE[0]) {
+        videostream = popen(VIDEOPIPE, "w");
+    } else {
+        sprintf(name,"%s/lattice.y4m",outputdir);
+        videostream = fopen(name,"wb");
+    }
+    if(videostream == NULL) return 1;
+    
+    fprintf(videostream, "YUV4MPEG2 W%d H%d F25:1 Ip A1:1 C444\n", videowidth, videoheight);
+    
+    // a forked child must not find the header still in the buffer
+    fflush(videostream);
+    
+    printf("Video: %dx%d frames to %s\n", videowidth, videoheight,
+           VIDEOPIPE[0] ? VIDEOPIPE : name);
+    return 0;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void print_video(void) {
+    
+    // Y, U, V of a1, a2, b1, b2, c1, c2: a grey, b blue, c red, the
+    // second of each pair darker
+    static const unsigned char palette[6][3] = {
+        {200,128,128}, {120,128,128}, {150,190,100}, {90,180,110},
+        {140,90,210}, {80,100,190}
+    };
+    unsigned char *y = videoframe;
+    unsigned char *u = videoframe + videowidth * videoheight;
+    unsigned char *v = videoframe + 2 * videowidth * videoheight;
+    int     i, j, k, l, n, px;
+    int     sum[3];
+    
+    printf("Flips completed: %lld - video frame written\n",flipcompleted);
+    
+    memset(y, 0, videowidth * videoheight);
+    memset(u, 128, 2 * videowidth * videoheight);
+    
+    // each pixel averages a VIDEOSCALE x VIDEOSCALE block
+    for(i=0;i*VIDEOSCALE<nrows;i++) {
+        for(j=0;j*VIDEOSCALE<ncols;j++) {
+            sum[0] = sum[1] = sum[2] = 0;
+            n = 0;
+            for(k=i*VIDEOSCALE;k<(i+1)*VIDEOSCALE && k<nrows;k++) {
+                for(l=j*VIDEOSCALE;l<(j+1)*VIDEOSCALE && l<ncols;l++) {
+                    #if VIDEOMODE == VIDEOTYPES
+                    sum[0] += palette[matrix[k][l].type][0];
+                    sum[1] += palette[matrix[k][l].type][1];
+                    sum[2] += palette[matrix[k][l].type][2];
+                    #elif VIDEOMODE == VIDEODENSITY
+                    sum[0] += (matrix[k][l].type >= 4) * 255;
+                    #else
+                    sum[0] += (matrix[k][l].type != matrix2[k][l].type) * 255;
+                    #endif
+                    n++;
+                }
+            }
+            px = i * videowidth + j;
+            y[px] = (unsigned char) (sum[0] / n);
+            #if VIDEOMODE == VIDEOTYPES
+            u[px] = (unsigned char) (sum[1] / n);
+            v[px] = (unsigned char) (sum[2] / n);
+            #endif
+        }
+    }
+    
+    fputs("FRAME\n", videostream);
+    fwrite(videoframe, 1, 3 * videowidth * videoheight, videostream);
+    fflush(videostream);
+}
+#endif
+
+#if FORK
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void snapshotwait(int limit) {
+    
+    int     k, status;
+    
+    // only our own children, never waitpid(-1): that would also reap
+    // a popen'd encoder and leave pclose nothing to wait for; a pid
+    // that can no longer be waited for is gone all the same
+    for(k=forkchildren-1;k>=0;k--)
+        if(waitpid(forkpid[k], &status, WNOHANG) != 0) snapshotforget(k);
+    
+    // then wait only if too many are still writing, oldest first
+    while(forkchildren >= limit && forkchildren > 0) {
+        waitpid(forkpid[0], &status, 0);
+        snapshotforget(0);
+    }
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void snapshotforget(int k) {
+    
+    if(forkpid[k] == streamchild) streamchild = 0;
+    forkchildren--;
+    memmove(forkpid + k, forkpid + k + 1, sizeof(pid_t) * (forkchildren - k));
+}
+#endif
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void parse(FILE *data) {
+    
+    int i,j;
+    for(i=0;i<nrows;i++) {
+        for(j=0;j<ncols;j++) {
+            matrix[i][j].type = (int)fgetc(data)-(int)'0';
+        }
+    }
+    fclose(data);
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void parse2(FILE *data) {
+    
+    int i,j;
+    for(i=0;i<nrows;i++) {
+        for(j=0;j<ncols;j++) {
+            matrix2[i][j].type = (int)fgetc(data)-(int)'0';
+        }
+    }
+    fclose(data);
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+#if DOMAIN
+int parsedomain(FILE *data) {
+    
+    int     i, j, k, tile, ch;
+    
+    domaintilerows = (nrows + (1<<TILESHIFT) - 1) >> TILESHIFT;
+    domaintilecols = (ncols + (1<<TILESHIFT) - 1) >> TILESHIFT;
+    domaintile = malloc(sizeof(int) * domaintilerows * domaintilecols);
+    domainoccupancy = calloc(domaintilerows * domaintilecols, sizeof(unsigned long long));
+    domainactive = malloc(sizeof(int) * nrows * ncols);
+    
+    // read the mask as one character per position, like parse
+    for(i=0;i<nrows;i++) {
+        for(j=0;j<ncols;j++) {
+            ch = fgetc(data);
+            if(ch != '1') continue;
+            tile = (i>>TILESHIFT)*domaintilecols + (j>>TILESHIFT);
+            domainoccupancy[tile] |= 1ULL << (((i&((1<<TILESHIFT)-1))<<TILESHIFT) + (j&((1<<TILESHIFT)-1)));
+            domainactive[domaincells++] = (i << 16) | j;
+        }
+    }
+    fclose(data);
+    
+    // only tiles with an active cell get room in a chain's plane
+    for(k=0;k<domaintilerows*domaintilecols;k++) {
+        domaintile[k] = domainoccupancy[k] ? (domaintiles++) << (2*TILESHIFT) : -1;
+    }
+    
+    return domaincells;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+int domainisactive(int rpos, int cpos) {
+    
+    int     tile = (rpos>>TILESHIFT)*domaintilecols + (cpos>>TILESHIFT);
+    
+    return (int) ((domainoccupancy[tile] >> 
+            (((rpos&((1<<TILESHIFT)-1))<<TILESHIFT) + (cpos&((1<<TILESHIFT)-1)))) & 1);
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+int domainplaquette(int rpos, int cpos, int type) {
+    
+    // the flip changes base, xshift, yshift and dshift, so all four
+    // must be inside; positions outside act as a fixed boundary
+    if(type ? !HIGHINBOUNDS(rpos,cpos) : !LOWINBOUNDS(rpos,cpos)) return 0;
+    return domainisactive(rpos, cpos) &&
+           domainisactive(rpos, FLIPCOL(cpos,type)) &&
+           domainisactive(FLIPROW(rpos,type), cpos) &&
+           domainisactive(FLIPROW(rpos,type), FLIPCOL(cpos,type));
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+int getdomainposition(void) {
+    
+    int     k;
+    
+    //random active cell
+    k = domainactive[(int) (domaincells * ((double) (rand()/(RAND_MAX + 1.0))))];
+    flipchoicerow = k >> 16;
+    flipchoicecol = k & 0xFFFF;
+    
+    return 0;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+#endif
+
+void loadplane(unsigned char *t, mstruct m[MAXROWS][MAXCOLS]) {
+    
+    int     i, j;
+    
+    for(i=0;i<nrows;i++) {
+        for(j=0;j<ncols;j++) {
+            #if DOMAIN
+            if(!domainisactive(i,j)) continue;
+            #endif
+            t[CELL(i,j)] = (unsigned char) m[i][j].type;
+        }
+    }
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void writeplane(FILE *data, unsigned char *t) {
+    
+    int     i, j;
+    
+    // positions outside a domain keep the type they were loaded with
+    for(i=0;i<nrows;i++) {
+        for(j=0;j<ncols;j++) {
+            #if DOMAIN
+            if(!domainisactive(i,j)) {
+                fputc('0' + matrix[i][j].type, data);
+                continue;
+            }
+            #endif
+            fputc('0' + t[CELL(i,j)], data);
+        }
+    }
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void storeplane(unsigned char *t, mstruct m[MAXROWS][MAXCOLS]) {
+    
+    int     i, j;
+    
+    for(i=0;i<nrows;i++) {
+        for(j=0;j<ncols;j++) {
+            #if DOMAIN
+            if(!domainisactive(i,j)) continue;
+            #endif
+            m[i][j].type = t[CELL(i,j)];
+        }
+    }
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+int checkboundary(mstruct m[MAXROWS][MAXCOLS]) {
+    
+    int     i, j, mismatches = 0;
+    
+    // columns wrap for both CYLINDER and PERIODIC
+    for(i=0;i<nrows;i++) {
+        if(((vertexedges[m[i][ncols-1].type] >> 2) & 1) != 
+           (vertexedges[m[i][0].type] & 1)) mismatches++;
+    }
+    
+    if(BOUNDARY == PERIODIC) {
+        for(j=0;j<ncols;j++) {
+            if(((vertexedges[m[nrows-1][j].type] >> 3) & 1) != 
+               ((vertexedges[m[0][j].type] >> 1) & 1)) mismatches++;
+        }
+    }
+    
+    return mismatches;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+int setheights(void) {
+    
+    int current = 0;
+    int total = 0;
+    int i, j;
+    
+	for(i=0;i<nrows;i++) {
+        current = 0;
+		for(j=0;j<ncols;j++) {
+			if(matrix[i][j].type == 0 || matrix[i][j].type == 2 || matrix[i][j].type == 5) {
+                current++;
+            }
+            matrix[i][j].height = current; // set the height value
+            total = total+current;  // keep a current total
+            #if DEBUG
+            printf("%d",current);
+            #endif
+		}
+        #if DEBUG
+        printf("\n");
+        #endif
+	}	
+    
+    return(total);
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+int setheights2(void) {
+    
+    int current = 0;
+    int total = 0;
+    int i, j;
+    
+	for(i=0;i<nrows;i++) {
+        current = 0;
+		for(j=0;j<ncols;j++) {
+			if(matrix2[i][j].type == 0 || matrix2[i][j].type == 2 || matrix2[i][j].type == 5) {
+                current++;
+            }
+            matrix2[i][j].height = current; // set the height value
+            total = total+current;  // keep a current total
+            #if DEBUG
+            printf("%d",current);
+            #endif
+		}
+        #if DEBUG
+        printf("\n");
+        #endif
+	}	
+    
+    return(total);
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+double getweightratio(int *rpos, int *cpos, int *type) {
+    
+    xshift = matrix[*rpos][FLIPCOL(*cpos,*type)].type;
+    yshift = matrix[FLIPROW(*rpos,*type)][*cpos].type;
+    dshift = matrix[FLIPROW(*rpos,*type)][FLIPCOL(*cpos,*type)].type;
+    base = matrix[*rpos][*cpos].type;
+    
+    // define new values
+    if(*type) {  
+        
+        // If vertex was a1, it will be c1; if it was c2, it will be a2
+        if(base == 0) base = 4;
+        if(base == 5) base = 1;
+        
+        // If vertex was a2, it will be c1; if it was c2, it will be a1
+        if(dshift == 1) dshift = 4;
+        if(dshift == 5) dshift = 0;
+        
+        // If vertex was b2, it will be c2; if it was c1, it will be b1 
+        if(xshift == 3) xshift = 5;
+        if(xshift == 4) xshift = 2;
+        
+        // If vertex was b1, it will be c2; if it was c1, it will be b2
+        if(yshift == 2) yshift = 5;
+        if(yshift == 4) yshift = 3;
+        
+    } else {
+        
+        // If vertex was c1, it will be a2; if it was a1, it will be c2
+        if(base == 4) base = 1;
+        if(base == 0) base = 5;
+        
+        // If vertex was c1, it will be a1; if it was a2, it will be c2
+        if(dshift == 4) dshift = 0;
+        if(dshift == 1) dshift = 5;
+        
+        // If vertex was c2, it will be b1; if it was b2, it will be c1 
+        if(xshift == 5) xshift = 2;
+        if(xshift == 3) xshift = 4;
+        
+        // If vertex was c2, it will be b2; if it was b1, it will be c1 
+        if(yshift == 5) yshift = 3;
+        if(yshift == 2) yshift = 4;
+        
+    }
+    
+    #if DEBUG
+        printf("\n%lf \n \n",   wts[base] * wts[xshift] *
+                    wts[yshift] * wts[dshift] / rho);
+    #endif
+    
+    #if INHOMOGENEOUS
+    return (classbase[siteclass[*rpos][*cpos]][base] *
+            classwts[siteclass[*rpos][FLIPCOL(*cpos,*type)]][xshift] *
+            classwts[siteclass[FLIPROW(*rpos,*type)][*cpos]][yshift] *
+            classwts[siteclass[FLIPROW(*rpos,*type)][FLIPCOL(*cpos,*type)]][dshift]);
+    #else
+    return (wts[base] * wts[xshift] *
+            wts[yshift] * wts[dshift] / rho);
+    #endif
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+double getweightratio2(int *rpos, int *cpos, int *type) {
+    
+    xshift = matrix2[*rpos][FLIPCOL(*cpos,*type)].type;
+    yshift = matrix2[FLIPROW(*rpos,*type)][*cpos].type;
+    dshift = matrix2[FLIPROW(*rpos,*type)][FLIPCOL(*cpos,*type)].type;
+    base = matrix2[*rpos][*cpos].type;
+    
+    // define new values
+    if(*type) {  
+        
+        // If vertex was a1, it will be c1; if it was c2, it will be a2
+        if(base == 0) base = 4;
+        if(base == 5) base = 1;
+        
+        // If vertex was a2, it will be c1; if it was c2, it will be a1
+        if(dshift == 1) dshift = 4;
+        if(dshift == 5) dshift = 0;
+        
+        // If vertex was b2, it will be c2; if it was c1, it will be b1 
+        if(xshift == 3) xshift = 5;
+        if(xshift == 4) xshift = 2;
+        
+        // If vertex was b1, it will be c2; if it was c1, it will be b2
+        if(yshift == 2) yshift = 5;
+        if(yshift == 4) yshift = 3;
+        
+    } else {
+        
+        // If vertex was c1, it will be a2; if it was a1, it will be c2
+        if(base == 4) base = 1;
+        if(base == 0) base = 5;
+        
+        // If vertex was c1, it will be a1; if it was a2, it will be c2
+        if(dshift == 4) dshift = 0;
+        if(dshift == 1) dshift = 5;
+        
+        // If vertex was c2, it will be b1; if it was b2, it will be c1 
+        if(xshift == 5) xshift = 2;
+        if(xshift == 3) xshift = 4;
+        
+        // If vertex was c2, it will be b2; if it was b1, it will be c1 
+        if(yshift == 5) yshift = 3;
+        if(yshift == 2) yshift = 4;
+        
+    }
+    
+    #if DEBUG
+        printf("\n%lf \n \n",   wts[base] * wts[xshift] *
+                    wts[yshift] * wts[dshift] / rho);
+    #endif
+    
+    #if INHOMOGENEOUS
+    return (classbase[siteclass[*rpos][*cpos]][base] *
+            classwts[siteclass[*rpos][FLIPCOL(*cpos,*type)]][xshift] *
+            classwts[siteclass[FLIPROW(*rpos,*type)][*cpos]][yshift] *
+            classwts[siteclass[FLIPROW(*rpos,*type)][FLIPCOL(*cpos,*type)]][dshift]);
+    #else
+    return (wts[base] * wts[xshift] *
+            wts[yshift] * wts[dshift] / rho);
+    #endif
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+int getflippablepositionrow(void) {
+    //random between 0 and nrows-1
+    flipchoicerow = ((int) nrows * ((double) (rand()/(RAND_MAX + 1.0))));
+
+
+    return 0;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+int getflippablepositioncol(void) {
+    //random between 0 and ncols-1
+    flipchoicecol = ((int) ncols * ((double) (rand()/(RAND_MAX + 1.0))));
+
+
+    return 0;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+int getisflippable(int *rpos, int *cpos, int *type) {
+    
+	//printf("getisflippable called - row: %d col: %d type: %d\n",*rpos,*cpos,*type);
+	if(*rpos < 0 || *rpos >= nrows) return 0;
+	if(*cpos < 0 || *cpos >= ncols) return 0;
+	#if DOMAIN
+	if(!domainplaquette(*rpos,*cpos,*type)) return 0;
+	#endif
+	
+    if(*type) {
+        if(HIGHINBOUNDS(*rpos,*cpos)) { //check high bounds
+            #if STICKY
+            if(matrix[*rpos][*cpos].height>matrix2[*rpos][*cpos].height) { //check the height
+            #endif
+                if(matrix[*rpos][*cpos].type==0 || matrix[*rpos][*cpos].type==5) { //check position contents
+                    if(matrix[ROWUP(*rpos)][COLRIGHT(*cpos)].type==1 || 
+                       matrix[ROWUP(*rpos)][COLRIGHT(*cpos)].type==5) { // check upper right free
+                        //printf("    returned true\n");
+                        return 1;
+                    }
+                #if STICKY
+                }
+                #endif
+            }
+        }
+    } else {
+        if(LOWINBOUNDS(*rpos,*cpos)) { //check low bounds
+            if(matrix[*rpos][*cpos].type==0 || matrix[*rpos][*cpos].type==4) { //check position contents
+                if(matrix[ROWDOWN(*rpos)][COLLEFT(*cpos)].type==1 || 
+                   matrix[ROWDOWN(*rpos)][COLLEFT(*cpos)].type==4) { // check lower left free
+                    //printf("    returned true\n");
+                    return 1;
+                }
+            }    
+        }
+    }
+	//printf("    returned false\n");
+    return 0;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+int getisflippable2(int *rpos, int *cpos, int *type) {
+    
+	//printf("getisflippable called - row: %d col: %d type: %d\n",*rpos,*cpos,*type);
+	if(*rpos < 0 || *rpos >= nrows) return 0;
+	if(*cpos < 0 || *cpos >= ncols) return 0;
+	#if DOMAIN
+	if(!domainplaquette(*rpos,*cpos,*type)) return 0;
+	#endif
+    
+    
+	
+    if(*type) {
+        if(HIGHINBOUNDS(*rpos,*cpos)) { //check high bounds
+            
+            if(matrix2[*rpos][*cpos].type==0 || matrix2[*rpos][*cpos].type==5) { //check position contents
+                if(matrix2[ROWUP(*rpos)][COLRIGHT(*cpos)].type==1 || 
+                   matrix2[ROWUP(*rpos)][COLRIGHT(*cpos)].type==5) { // check upper right free
+                    //printf("    returned true\n");
+                    return 1;
+                }
+                
+            }
+        }
+    } else {
+        if(LOWINBOUNDS(*rpos,*cpos)) { //check low bounds
+            #if STICKY
+            if(matrix2[*rpos][*cpos].height<matrix[*rpos][*cpos].height) { //check the height
+            #endif
+                if(matrix2[*rpos][*cpos].type==0 || matrix2[*rpos][*cpos].type==4) { //check position contents
+                    if(matrix2[ROWDOWN(*rpos)][COLLEFT(*cpos)].type==1 || 
+                       matrix2[ROWDOWN(*rpos)][COLLEFT(*cpos)].type==4) { // check lower left free
+                        //printf("    returned true\n");
+                        return 1;
+                    }
+                #if STICKY
+                }
+                #endif
+            }
+        }    
+    }
+	//printf("    returned false\n");
+    return 0;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+int executeflip(int *rpos, int *cpos, int *type) {
+    #if RECORDER
+    recordernote(0, *rpos, *cpos, *type);
+    #endif
+    #if CORRELATE
+    correlateflip(0, matrix, *rpos, *cpos, *type, -1);
+    #endif
+    #if PATTERNS
+    patternflip(matrix, patternlive[0], *rpos, *cpos, *type, -1);
+    #endif
+    updatepositions(rpos,cpos,type);
+    #if PATTERNS
+    patternflip(matrix, patternlive[0], *rpos, *cpos, *type, 1);
+    #endif
+
+    #if DIFFERENCE
+    differenceflip(*rpos, *cpos, *type, -1);
+    #endif
+    //increase or decrease the height
+    if(*type) {
+    matrix[*rpos][*cpos].height--;
+    matrixvol--;
+    } else {
+    matrix[ROWDOWN(*rpos)][COLLEFT(*cpos)].height++;      //add one to lower left
+    matrixvol++;
+    }
+    #if DIFFERENCE
+    differenceflip(*rpos, *cpos, *type, 1);
+    #endif
+    #if CORRELATE
+    correlateflip(0, matrix, *rpos, *cpos, *type, 1);
+    #endif
+    #if BOUNDARY != FIXED
+    // the single height above is right away from the seam only
+    if(SEAMFLIP(*cpos,*type)) heightseam(0, matrix, *type ? *rpos : ROWDOWN(*rpos), *type ? 1 : -1);
+    #endif
+    // return no error
+    return 0;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+int executeflip2(int *rpos, int *cpos, int *type) {
+    #if RECORDER
+    recordernote(1, *rpos, *cpos, *type);
+    #endif
+    #if CORRELATE
+    correlateflip(1, matrix2, *rpos, *cpos, *type, -1);
+    #endif
+    #if PATTERNS
+    patternflip(matrix2, patternlive[1], *rpos, *cpos, *type, -1);
+    #endif
+    updatepositions2(rpos,cpos,type);
+    #if PATTERNS
+    patternflip(matrix2, patternlive[1], *rpos, *cpos, *type, 1);
+    #endif
+
+    #if DIFFERENCE
+    differenceflip(*rpos, *cpos, *type, -1);
+    #endif
+    //increase or decrease the height
+    if(*type) {
+    matrix2[*rpos][*cpos].height--;
+    matrixvol2--;
+    } else {
+    matrix2[ROWDOWN(*rpos)][COLLEFT(*cpos)].height++;    //add one to lower left
+    matrixvol2++;
+    }
+    #if DIFFERENCE
+    differenceflip(*rpos, *cpos, *type, 1);
+    #endif
+    #if CORRELATE
+    correlateflip(1, matrix2, *rpos, *cpos, *type, 1);
+    #endif
+    #if BOUNDARY != FIXED
+    // the single height above is right away from the seam only
+    if(SEAMFLIP(*cpos,*type)) heightseam(1, matrix2, *type ? *rpos : ROWDOWN(*rpos), *type ? 1 : -1);
+    #endif
+    // return no error
+    return 0;
+}
+
+#if BOUNDARY != FIXED
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void heightseam(int k, mstruct m[MAXROWS][MAXCOLS], int row, int delta) {
+    
+    int     j;
+    
+    // heights are prefix sums of the top edges along the row; a seam
+    // flip trades the top edge of the last column for that of column
+    // 0, so on top of the one height executeflip moved, the whole row
+    // moves by one
+    #if CORRELATE
+    correlaterow(k, m, row, -1);
+    #endif
+    for(j=0;j<ncols;j++) m[row][j].height += delta;
+    if(k) matrixvol2 += delta * ncols;
+    else matrixvol += delta * ncols;
+    #if CORRELATE
+    correlaterow(k, m, row, 1);
+    #endif
+    #if DIFFERENCE
+    differencerecount(row);
+    #endif
+}
+#endif
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void updatepositions(int *rpos, int *cpos, int *type) {
+    
+	#if DEBUG
+        printf("updatepositions called - row: %d col: %d type: %d\n",*rpos,*cpos,*type);
+    #endif
+    
+    if(*type) {
+        // base: If vertex was a1, it will be c1; if it was c2, it will be a2
+        #if DEBUG
+            printf("base position is %d\n",matrix[*rpos][*cpos].type);
+        #endif
+        
+        if(matrix[*rpos][*cpos].type == 0) {
+            #if DEBUG
+                printf("Updating base position on up flip1\n");
+            #endif
+            
+            matrix[*rpos][*cpos].type = 4;
+        }
+        if(matrix[*rpos][*cpos].type == 5) {
+            #if DEBUG
+                printf("Updating base position on up flip1\n");
+            #endif
+            
+            matrix[*rpos][*cpos].type = 1;
+        }
+        
+        //up right: If vertex was a2, it will be c1; if it was c2, it will be a1
+        if(matrix[ROWUP(*rpos)][COLRIGHT(*cpos)].type == 1) {
+            #if DEBUG
+                printf("Updating up right position on up flip2\n");
+            #endif
+            
+            matrix[ROWUP(*rpos)][COLRIGHT(*cpos)].type =  4;
+        }
+        if(matrix[ROWUP(*rpos)][COLRIGHT(*cpos)].type == 5) {
+            #if DEBUG
+                printf("Updating up right position on up flip2\n");
+            #endif
+            
+            matrix[ROWUP(*rpos)][COLRIGHT(*cpos)].type =  0;
+        }
+        
+        // right: If vertex was b2, it will be c2; if it was c1, it will be b1 
+        if(matrix[*rpos][COLRIGHT(*cpos)].type == 3) {
+            #if DEBUG
+                printf("Updating right position on up flip3\n");
+            #endif
+            
+            matrix[*rpos][COLRIGHT(*cpos)].type =  5;
+        }
+        if(matrix[*rpos][COLRIGHT(*cpos)].type == 4) {
+            #if DEBUG
+                printf("Updating right position on up flip3\n");
+            #endif
+            
+            matrix[*rpos][COLRIGHT(*cpos)].type =  2;
+        }
+        
+        // up: If vertex was b1, it will be c2; if it was c1, it will be b2
+        if(matrix[ROWUP(*rpos)][*cpos].type == 2){
+            #if DEBUG
+                printf("Updating up position on up flip4\n");
+            #endif
+            
+            matrix[ROWUP(*rpos)][*cpos].type =  5;
+        }
+        if(matrix[ROWUP(*rpos)][*cpos].type == 4){
+            #if DEBUG
+                printf("Updating up position on up flip4\n");
+            #endif
+            
+            matrix[ROWUP(*rpos)][*cpos].type =  3;
+        }
+        
+    } else {
+        
+        // base: If vertex was c1, it will be a2; if it was a1, it will be c2
+        #if DEBUG
+            printf("base position is %d\n",matrix[*rpos][*cpos].type);
+        #endif
+        
+        if(matrix[*rpos][*cpos].type == 4){
+            #if DEBUG
+                printf("Updating base position on down flip1\n");
+            #endif
+            
+            matrix[*rpos][*cpos].type = 1;
+        }
+        if(matrix[*rpos][*cpos].type == 0) {
+            #if DEBUG
+                printf("Updating base position on down flip1\n");
+            #endif
+            
+            matrix[*rpos][*cpos].type = 5;
+        }
+        
+        // down left: If vertex was c1, it will be a1; if it was a2, it will be c2
+        if(matrix[ROWDOWN(*rpos)][COLLEFT(*cpos)].type == 4) {
+            #if DEBUG
+                printf("Updating down left position on down flip2\n");
+            #endif
+            
+            matrix[ROWDOWN(*rpos)][COLLEFT(*cpos)].type =  0;}
+        
+        if(matrix[ROWDOWN(*rpos)][COLLEFT(*cpos)].type == 1) {
+            #if DEBUG
+                printf("Updating down left position on down flip2\n");
+            #endif
+            
+            matrix[ROWDOWN(*rpos)][COLLEFT(*cpos)].type =  5;
+        }
+        
+        // left: If vertex was c2, it will be b1; if it was b2, it will be c1 
+        if(matrix[*rpos][COLLEFT(*cpos)].type == 5) {
+            #if DEBUG
+                printf("Updating left position on down flip3\n");
+            #endif
+            
+            matrix[*rpos][COLLEFT(*cpos)].type =  2;
+        }
+        if(matrix[*rpos][COLLEFT(*cpos)].type == 3) {
+            #if DEBUG
+                printf("Updating left position on down flip3\n");
+            #endif
+            
+            matrix[*rpos][COLLEFT(*cpos)].type =  4;
+        }
+        
+        // down: If vertex was c2, it will be b2; if it was b1, it will be c1 
+        if(matrix[ROWDOWN(*rpos)][*cpos].type == 5) {
+            #if DEBUG
+                printf("Updating down position on down flip4\n");
+            #endif
+            
+            matrix[ROWDOWN(*rpos)][*cpos].type =  3;
+        }
+        if(matrix[ROWDOWN(*rpos)][*cpos].type == 2) {
+            #if DEBUG
+                printf("Updating down position on down flip4\n");
+            #endif
+            
+            matrix[ROWDOWN(*rpos)][*cpos].type =  4;
+        }
+    }
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void updatepositions2(int *rpos, int *cpos, int *type) {
+    
 	#if DEBUG
-        printf("updatepositions called - row: %d col: %d type: %d\n",*rpos,*cpos,*type);
+        printf("updatepositions2 called - row: %d col: %d type: %d\n",*rpos,*cpos,*type);
+    #endif
+    
+    if(*type) {
+        // base: If vertex was a1, it will be c1; if it was c2, it will be a2
+        #if DEBUG
+            printf("base position is %d\n",matrix2[*rpos][*cpos].type);
+        #endif
+        
+        if(matrix2[*rpos][*cpos].type == 0) {
+            #if DEBUG
+                printf("Updating base position on up flip1\n");
+            #endif
+            
+            matrix2[*rpos][*cpos].type = 4;
+        }
+        if(matrix2[*rpos][*cpos].type == 5) {
+            #if DEBUG
+                printf("Updating base position on up flip1\n");
+            #endif
+            
+            matrix2[*rpos][*cpos].type = 1;
+        }
+        
+        //up right: If vertex was a2, it will be c1; if it was c2, it will be a1
+        if(matrix2[ROWUP(*rpos)][COLRIGHT(*cpos)].type == 1) {
+            #if DEBUG
+                printf("Updating up right position on up flip2\n");
+            #endif
+            
+            matrix2[ROWUP(*rpos)][COLRIGHT(*cpos)].type =  4;
+        }
+        if(matrix2[ROWUP(*rpos)][COLRIGHT(*cpos)].type == 5) {
+            #if DEBUG
+                printf("Updating up right position on up flip2\n");
+            #endif
+            
+            matrix2[ROWUP(*rpos)][COLRIGHT(*cpos)].type =  0;
+        }
+        
+        // right: If vertex was b2, it will be c2; if it was c1, it will be b1 
+        if(matrix2[*rpos][COLRIGHT(*cpos)].type == 3) {
+            #if DEBUG
+                printf("Updating right position on up flip3\n");
+            #endif
+            
+            matrix2[*rpos][COLRIGHT(*cpos)].type =  5;
+        }
+        if(matrix2[*rpos][COLRIGHT(*cpos)].type == 4) {
+            #if DEBUG
+                printf("Updating right position on up flip3\n");
+            #endif
+            
+            matrix2[*rpos][COLRIGHT(*cpos)].type =  2;
+        }
+        
+        // up: If vertex was b1, it will be c2; if it was c1, it will be b2
+        if(matrix2[ROWUP(*rpos)][*cpos].type == 2){
+            #if DEBUG
+                printf("Updating up position on up flip4\n");
+            #endif
+            
+            matrix2[ROWUP(*rpos)][*cpos].type =  5;
+        }
+        if(matrix2[ROWUP(*rpos)][*cpos].type == 4){
+            #if DEBUG
+                printf("Updating up position on up flip4\n");
+            #endif
+            
+            matrix2[ROWUP(*rpos)][*cpos].type =  3;
+        }
+        
+    } else {
+        
+        // base: If vertex was c1, it will be a2; if it was a1, it will be c2
+        #if DEBUG
+            printf("base position is %d\n",matrix2[*rpos][*cpos].type);
+        #endif
+        
+        if(matrix2[*rpos][*cpos].type == 4){
+            #if DEBUG
+                printf("Updating base position on down flip1\n");
+            #endif
+            
+            matrix2[*rpos][*cpos].type = 1;
+        }
+        if(matrix2[*rpos][*cpos].type == 0) {
+            #if DEBUG
+                printf("Updating base position on down flip1\n");
+            #endif
+            
+            matrix2[*rpos][*cpos].type = 5;
+        }
+        
+        // down left: If vertex was c1, it will be a1; if it was a2, it will be c2
+        if(matrix2[ROWDOWN(*rpos)][COLLEFT(*cpos)].type == 4) {
+            #if DEBUG
+                printf("Updating down left position on down flip2\n");
+            #endif
+            
+            matrix2[ROWDOWN(*rpos)][COLLEFT(*cpos)].type =  0;}
+        
+        if(matrix2[ROWDOWN(*rpos)][COLLEFT(*cpos)].type == 1) {
+            #if DEBUG
+                printf("Updating down left position on down flip2\n");
+            #endif
+            
+            matrix2[ROWDOWN(*rpos)][COLLEFT(*cpos)].type =  5;
+        }
+        
+        // left: If vertex was c2, it will be b1; if it was b2, it will be c1 
+        if(matrix2[*rpos][COLLEFT(*cpos)].type == 5) {
+            #if DEBUG
+                printf("Updating left position on down flip3\n");
+            #endif
+            
+            matrix2[*rpos][COLLEFT(*cpos)].type =  2;
+        }
+        if(matrix2[*rpos][COLLEFT(*cpos)].type == 3) {
+            #if DEBUG
+                printf("Updating left position on down flip3\n");
+            #endif
+            
+            matrix2[*rpos][COLLEFT(*cpos)].type =  4;
+        }
+        
+        // down: If vertex was c2, it will be b2; if it was b1, it will be c1 
+        if(matrix2[ROWDOWN(*rpos)][*cpos].type == 5) {
+            #if DEBUG
+                printf("Updating down position on down flip4\n");
+            #endif
+            
+            matrix2[ROWDOWN(*rpos)][*cpos].type =  3;
+        }
+        if(matrix2[ROWDOWN(*rpos)][*cpos].type == 2) {
+            #if DEBUG
+                printf("Updating down position on down flip4\n");
+            #endif
+            
+            matrix2[ROWDOWN(*rpos)][*cpos].type =  4;
+        }
+    }
+}
+
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+double computerho(double *w) {
+    
+    double  r = 0;                              // running maximum
+    
+    // down normal flip possibilities 
+    if(r<(w[1]*w[4]*w[5]*w[4])) r = w[1]*w[4]*w[5]*w[4];
+    if(r<(w[1]*w[4]*w[5]*w[3])) r = w[1]*w[4]*w[5]*w[3];
+    if(r<(w[1]*w[4]*w[0]*w[4])) r = w[1]*w[4]*w[0]*w[4];
+    if(r<(w[1]*w[4]*w[0]*w[3])) r = w[1]*w[4]*w[0]*w[3];
+    if(r<(w[1]*w[2]*w[5]*w[4])) r = w[1]*w[2]*w[5]*w[4];
+    if(r<(w[1]*w[2]*w[5]*w[3])) r = w[1]*w[2]*w[5]*w[3];
+    if(r<(w[1]*w[2]*w[0]*w[4])) r = w[1]*w[2]*w[0]*w[4];
+    if(r<(w[1]*w[2]*w[0]*w[3])) r = w[1]*w[2]*w[0]*w[3];
+    
+    // up normal flip possibilities
+    if(r<(w[1]*w[3]*w[4]*w[5])) r = w[1]*w[3]*w[4]*w[5];
+    if(r<(w[1]*w[3]*w[4]*w[2])) r = w[1]*w[3]*w[4]*w[2];
+    if(r<(w[1]*w[3]*w[0]*w[5])) r = w[1]*w[3]*w[0]*w[5];
+    if(r<(w[1]*w[3]*w[0]*w[2])) r = w[1]*w[3]*w[0]*w[2];
+    if(r<(w[1]*w[5]*w[4]*w[5])) r = w[1]*w[5]*w[4]*w[5];
+    if(r<(w[1]*w[5]*w[4]*w[2])) r = w[1]*w[5]*w[4]*w[2];
+    if(r<(w[1]*w[5]*w[0]*w[5])) r = w[1]*w[5]*w[0]*w[5];
+    if(r<(w[1]*w[5]*w[0]*w[2])) r = w[1]*w[5]*w[0]*w[2];
+    
+    // biflip possibilities 
+    if(r<(w[5]*w[4]*w[5]*w[4] + w[4]*w[3]*w[4]*w[5])) 
+      r = w[5]*w[4]*w[5]*w[4] + w[4]*w[3]*w[4]*w[5];
+    if(r<(w[5]*w[4]*w[5]*w[4] + w[4]*w[3]*w[4]*w[2])) 
+      r = w[5]*w[4]*w[5]*w[4] + w[4]*w[3]*w[4]*w[2];
+    if(r<(w[5]*w[4]*w[5]*w[4] + w[4]*w[3]*w[0]*w[5])) 
+      r = w[5]*w[4]*w[5]*w[4] + w[4]*w[3]*w[0]*w[5];
+    if(r<(w[5]*w[4]*w[5]*w[4] + w[4]*w[3]*w[0]*w[2])) 
+      r = w[5]*w[4]*w[5]*w[4] + w[4]*w[3]*w[0]*w[2];
+    if(r<(w[5]*w[4]*w[5]*w[4] + w[4]*w[5]*w[4]*w[5]))
+      r = w[5]*w[4]*w[5]*w[4] + w[4]*w[5]*w[4]*w[5];
+    if(r<(w[5]*w[4]*w[5]*w[4] + w[4]*w[5]*w[4]*w[2])) 
+      r = w[5]*w[4]*w[5]*w[4] + w[4]*w[5]*w[4]*w[2];
+    if(r<(w[5]*w[4]*w[5]*w[4] + w[4]*w[5]*w[1]*w[5])) 
+      r = w[5]*w[4]*w[5]*w[4] + w[4]*w[5]*w[1]*w[5];
+    if(r<(w[5]*w[4]*w[5]*w[4] + w[4]*w[5]*w[1]*w[2])) 
+      r = w[5]*w[4]*w[5]*w[4] + w[4]*w[5]*w[1]*w[2];
+    
+    // 2
+    if(r<(w[5]*w[4]*w[5]*w[3] + w[4]*w[3]*w[4]*w[5])) 
+      r = w[5]*w[4]*w[5]*w[3] + w[4]*w[3]*w[4]*w[5];
+    if(r<(w[5]*w[4]*w[5]*w[3] + w[4]*w[3]*w[4]*w[2]))
+      r = w[5]*w[4]*w[5]*w[3] + w[4]*w[3]*w[4]*w[2];
+    if(r<(w[5]*w[4]*w[5]*w[3] + w[4]*w[3]*w[0]*w[5])) 
+      r = w[5]*w[4]*w[5]*w[3] + w[4]*w[3]*w[0]*w[5];
+    if(r<(w[5]*w[4]*w[5]*w[3] + w[4]*w[3]*w[0]*w[2])) 
+      r = w[5]*w[4]*w[5]*w[3] + w[4]*w[3]*w[0]*w[2];
+    if(r<(w[5]*w[4]*w[5]*w[3] + w[4]*w[5]*w[4]*w[5])) 
+      r = w[5]*w[4]*w[5]*w[3] + w[4]*w[5]*w[4]*w[5];
+    if(r<(w[5]*w[4]*w[5]*w[3] + w[4]*w[5]*w[4]*w[2])) 
+      r = w[5]*w[4]*w[5]*w[3] + w[4]*w[5]*w[4]*w[2];
+    if(r<(w[5]*w[4]*w[5]*w[3] + w[4]*w[5]*w[1]*w[5])) 
+      r = w[5]*w[4]*w[5]*w[3] + w[4]*w[5]*w[1]*w[5];
+    if(r<(w[5]*w[4]*w[5]*w[3] + w[4]*w[5]*w[1]*w[2])) 
+      r = w[5]*w[4]*w[5]*w[3] + w[4]*w[5]*w[1]*w[2];
+    
+    // 3
+    if(r<(w[5]*w[4]*w[0]*w[4] + w[4]*w[3]*w[4]*w[5])) 
+      r = w[5]*w[4]*w[0]*w[4] + w[4]*w[3]*w[4]*w[5];
+    if(r<(w[5]*w[4]*w[0]*w[4] + w[4]*w[3]*w[4]*w[2])) 
+      r = w[5]*w[4]*w[0]*w[4] + w[4]*w[3]*w[4]*w[2];
+    if(r<(w[5]*w[4]*w[0]*w[4] + w[4]*w[3]*w[0]*w[5])) 
+      r = w[5]*w[4]*w[0]*w[4] + w[4]*w[3]*w[0]*w[5];
+    if(r<(w[5]*w[4]*w[0]*w[4] + w[4]*w[3]*w[0]*w[2])) 
+      r = w[5]*w[4]*w[0]*w[4] + w[4]*w[3]*w[0]*w[2];
+    if(r<(w[5]*w[4]*w[0]*w[4] + w[4]*w[5]*w[4]*w[5])) 
+      r = w[5]*w[4]*w[0]*w[4] + w[4]*w[5]*w[4]*w[5];
+    if(r<(w[5]*w[4]*w[0]*w[4] + w[4]*w[5]*w[4]*w[2])) 
+      r = w[5]*w[4]*w[0]*w[4] + w[4]*w[5]*w[4]*w[2];
+    if(r<(w[5]*w[4]*w[0]*w[4] + w[4]*w[5]*w[1]*w[5])) 
+      r = w[5]*w[4]*w[0]*w[4] + w[4]*w[5]*w[1]*w[5];
+    if(r<(w[5]*w[4]*w[0]*w[4] + w[4]*w[5]*w[1]*w[2])) 
+      r = w[5]*w[4]*w[0]*w[4] + w[4]*w[5]*w[1]*w[2];
+    
+    // 4
+    if(r<(w[5]*w[4]*w[0]*w[3] + w[4]*w[3]*w[4]*w[5])) 
+      r = w[5]*w[4]*w[0]*w[3] + w[4]*w[3]*w[4]*w[5];
+    if(r<(w[5]*w[4]*w[0]*w[3] + w[4]*w[3]*w[4]*w[2])) 
+      r = w[5]*w[4]*w[0]*w[3] + w[4]*w[3]*w[4]*w[2];
+    if(r<(w[5]*w[4]*w[0]*w[3] + w[4]*w[3]*w[0]*w[5])) 
+      r = w[5]*w[4]*w[0]*w[3] + w[4]*w[3]*w[0]*w[5];
+    if(r<(w[5]*w[4]*w[0]*w[3] + w[4]*w[3]*w[0]*w[2])) 
+      r = w[5]*w[4]*w[0]*w[3] + w[4]*w[3]*w[0]*w[2];
+    if(r<(w[5]*w[4]*w[0]*w[3] + w[4]*w[5]*w[4]*w[5])) 
+      r = w[5]*w[4]*w[0]*w[3] + w[4]*w[5]*w[4]*w[5];
+    if(r<(w[5]*w[4]*w[0]*w[3] + w[4]*w[5]*w[4]*w[2])) 
+      r = w[5]*w[4]*w[0]*w[3] + w[4]*w[5]*w[4]*w[2];
+    if(r<(w[5]*w[4]*w[0]*w[3] + w[4]*w[5]*w[1]*w[5])) 
+      r = w[5]*w[4]*w[0]*w[3] + w[4]*w[5]*w[1]*w[5];
+    if(r<(w[5]*w[4]*w[0]*w[3] + w[4]*w[5]*w[1]*w[2])) 
+      r = w[5]*w[4]*w[0]*w[3] + w[4]*w[5]*w[1]*w[2];
+    
+    // 5
+    if(r<(w[5]*w[2]*w[5]*w[4] + w[4]*w[3]*w[4]*w[5])) 
+      r = w[5]*w[2]*w[5]*w[4] + w[4]*w[3]*w[4]*w[5];
+    if(r<(w[5]*w[2]*w[5]*w[4] + w[4]*w[3]*w[4]*w[2])) 
+      r = w[5]*w[2]*w[5]*w[4] + w[4]*w[3]*w[4]*w[2];
+    if(r<(w[5]*w[2]*w[5]*w[4] + w[4]*w[3]*w[0]*w[5])) 
+      r = w[5]*w[2]*w[5]*w[4] + w[4]*w[3]*w[0]*w[5];
+    if(r<(w[5]*w[2]*w[5]*w[4] + w[4]*w[3]*w[0]*w[2])) 
+      r = w[5]*w[2]*w[5]*w[4] + w[4]*w[3]*w[0]*w[2];
+    if(r<(w[5]*w[2]*w[5]*w[4] + w[4]*w[5]*w[4]*w[5])) 
+      r = w[5]*w[2]*w[5]*w[4] + w[4]*w[5]*w[4]*w[5];
+    if(r<(w[5]*w[2]*w[5]*w[4] + w[4]*w[5]*w[4]*w[2])) 
+      r = w[5]*w[2]*w[5]*w[4] + w[4]*w[5]*w[4]*w[2];
+    if(r<(w[5]*w[2]*w[5]*w[4] + w[4]*w[5]*w[1]*w[5])) 
+      r = w[5]*w[2]*w[5]*w[4] + w[4]*w[5]*w[1]*w[5];
+    if(r<(w[5]*w[2]*w[5]*w[4] + w[4]*w[5]*w[1]*w[2])) 
+      r = w[5]*w[2]*w[5]*w[4] + w[4]*w[5]*w[1]*w[2];
+    
+    // 6
+    if(r<(w[5]*w[2]*w[5]*w[3] + w[4]*w[3]*w[4]*w[5])) 
+      r = w[5]*w[2]*w[5]*w[3] + w[4]*w[3]*w[4]*w[5];
+    if(r<(w[5]*w[2]*w[5]*w[3] + w[4]*w[3]*w[4]*w[2])) 
+      r = w[5]*w[2]*w[5]*w[3] + w[4]*w[3]*w[4]*w[2];
+    if(r<(w[5]*w[2]*w[5]*w[3] + w[4]*w[3]*w[0]*w[5])) 
+      r = w[5]*w[2]*w[5]*w[3] + w[4]*w[3]*w[0]*w[5];
+    if(r<(w[5]*w[2]*w[5]*w[3] + w[4]*w[3]*w[0]*w[2])) 
+      r = w[5]*w[2]*w[5]*w[3] + w[4]*w[3]*w[0]*w[2];
+    if(r<(w[5]*w[2]*w[5]*w[3] + w[4]*w[5]*w[4]*w[5])) 
+      r = w[5]*w[2]*w[5]*w[3] + w[4]*w[5]*w[4]*w[5];
+    if(r<(w[5]*w[2]*w[5]*w[3] + w[4]*w[5]*w[4]*w[2])) 
+      r = w[5]*w[2]*w[5]*w[3] + w[4]*w[5]*w[4]*w[2];
+    if(r<(w[5]*w[2]*w[5]*w[3] + w[4]*w[5]*w[1]*w[5])) 
+      r = w[5]*w[2]*w[5]*w[3] + w[4]*w[5]*w[1]*w[5];
+    if(r<(w[5]*w[2]*w[5]*w[3] + w[4]*w[5]*w[1]*w[2])) 
+      r = w[5]*w[2]*w[5]*w[3] + w[4]*w[5]*w[1]*w[2];
+    
+    // 7
+    if(r<(w[5]*w[2]*w[0]*w[4] + w[4]*w[3]*w[4]*w[5])) 
+      r = w[5]*w[2]*w[0]*w[4] + w[4]*w[3]*w[4]*w[5];
+    if(r<(w[5]*w[2]*w[0]*w[4] + w[4]*w[3]*w[4]*w[2])) 
+      r = w[5]*w[2]*w[0]*w[4] + w[4]*w[3]*w[4]*w[2];
+    if(r<(w[5]*w[2]*w[0]*w[4] + w[4]*w[3]*w[0]*w[5])) 
+      r = w[5]*w[2]*w[0]*w[4] + w[4]*w[3]*w[0]*w[5];
+    if(r<(w[5]*w[2]*w[0]*w[4] + w[4]*w[3]*w[0]*w[2])) 
+      r = w[5]*w[2]*w[0]*w[4] + w[4]*w[3]*w[0]*w[2];
+    if(r<(w[5]*w[2]*w[0]*w[4] + w[4]*w[5]*w[4]*w[5])) 
+      r = w[5]*w[2]*w[0]*w[4] + w[4]*w[5]*w[4]*w[5];
+    if(r<(w[5]*w[2]*w[0]*w[4] + w[4]*w[5]*w[4]*w[2])) 
+      r = w[5]*w[2]*w[0]*w[4] + w[4]*w[5]*w[4]*w[2];
+    if(r<(w[5]*w[2]*w[0]*w[4] + w[4]*w[5]*w[1]*w[5])) 
+      r = w[5]*w[2]*w[0]*w[4] + w[4]*w[5]*w[1]*w[5];
+    if(r<(w[5]*w[2]*w[0]*w[4] + w[4]*w[5]*w[1]*w[2])) 
+      r = w[5]*w[2]*w[0]*w[4] + w[4]*w[5]*w[1]*w[2];
+    
+    // 8
+    if(r<(w[5]*w[2]*w[0]*w[3] + w[4]*w[3]*w[4]*w[5])) 
+      r = w[5]*w[2]*w[0]*w[3] + w[4]*w[3]*w[4]*w[5];
+    if(r<(w[5]*w[2]*w[0]*w[3] + w[4]*w[3]*w[4]*w[2])) 
+      r = w[5]*w[2]*w[0]*w[3] + w[4]*w[3]*w[4]*w[2];
+    if(r<(w[5]*w[2]*w[0]*w[3] + w[4]*w[3]*w[0]*w[5])) 
+      r = w[5]*w[2]*w[0]*w[3] + w[4]*w[3]*w[0]*w[5];
+    if(r<(w[5]*w[2]*w[0]*w[3] + w[4]*w[3]*w[0]*w[2])) 
+      r = w[5]*w[2]*w[0]*w[3] + w[4]*w[3]*w[0]*w[2];
+    if(r<(w[5]*w[2]*w[0]*w[3] + w[4]*w[5]*w[4]*w[5])) 
+      r = w[5]*w[2]*w[0]*w[3] + w[4]*w[5]*w[4]*w[5];
+    if(r<(w[5]*w[2]*w[0]*w[3] + w[4]*w[5]*w[4]*w[2])) 
+      r = w[5]*w[2]*w[0]*w[3] + w[4]*w[5]*w[4]*w[2];
+    if(r<(w[5]*w[2]*w[0]*w[3] + w[4]*w[5]*w[1]*w[5])) 
+      r = w[5]*w[2]*w[0]*w[3] + w[4]*w[5]*w[1]*w[5];
+    if(r<(w[5]*w[2]*w[0]*w[3] + w[4]*w[5]*w[1]*w[2])) 
+      r = w[5]*w[2]*w[0]*w[3] + w[4]*w[5]*w[1]*w[2];
+    
+    return r;
+}
+
+#if INHOMOGENEOUS
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+int parseclasses(FILE *data) {
+    
+    int     i, j, k, rc, cc, bad;
+    int     rows[MAXROWS], cols[MAXCOLS];
+    
+    // table: "rowclasses colclasses", the class of every row, the class
+    // of every column, then a1 a2 b1 b2 c1 c2 for each row class's
+    // column classes in turn; the file is closed however far it got
+    bad = fscanf(data,"%d %d",&rowclasses,&colclasses)!=2 ||
+          rowclasses<1 || colclasses<1 || rowclasses*colclasses>MAXCLASSES;
+    for(i=0;!bad && i<nrows;i++) {
+        bad = fscanf(data,"%d",&rows[i])!=1 || rows[i]<0 || rows[i]>=rowclasses;
+    }
+    for(j=0;!bad && j<ncols;j++) {
+        bad = fscanf(data,"%d",&cols[j])!=1 || cols[j]<0 || cols[j]>=colclasses;
+    }
+    for(rc=0;!bad && rc<rowclasses;rc++) {
+        for(cc=0;!bad && cc<colclasses;cc++) {
+            for(k=0;!bad && k<6;k++) {
+                bad = fscanf(data,"%lf",&classwts[rc*colclasses+cc][k])!=1;
+            }
+        }
+    }
+    fclose(data);
+    if(bad) return 1;
+    
+    // one byte per position keeps the lookup as cheap as wts[]
+    for(i=0;i<nrows;i++) {
+        for(j=0;j<ncols;j++) {
+            siteclass[i][j] = (unsigned char) (rows[i]*colclasses + cols[j]);
+        }
+    }
+    
+    return 0;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+double siterho(int rpos, int cpos) {
+    
+    // the new type of each flipped position is one of two, given by
+    // flipmap; bound each flip by the larger weight at every position
+    static const int newtypes[2][4][2] = {
+        { {1,5}, {2,4}, {3,4}, {0,5} },         // LOW: base, x, y, d
+        { {4,1}, {5,2}, {5,3}, {4,0} }          // HIGH: base, x, y, d
+    };
+    double  flip[2] = {0, 0}, biflip[2] = {0, 0}, w[4][6], r = 0;
+    int     type, k, cls[4];
+    
+    for(type=0;type<2;type++) {
+        if(type ? !HIGHINBOUNDS(rpos,cpos) : !LOWINBOUNDS(rpos,cpos)) continue;
+        cls[0] = siteclass[rpos][cpos];
+        cls[1] = siteclass[rpos][FLIPCOL(cpos,type)];
+        cls[2] = siteclass[FLIPROW(rpos,type)][cpos];
+        cls[3] = siteclass[FLIPROW(rpos,type)][FLIPCOL(cpos,type)];
+        for(k=0;k<4;k++) memcpy(w[k], classwts[cls[k]], sizeof(w[k]));
+        
+        flip[type] = 1;
+        for(k=0;k<4;k++) {
+            flip[type] *= w[k][newtypes[type][k][0]] > w[k][newtypes[type][k][1]] ?
+                          w[k][newtypes[type][k][0]] : w[k][newtypes[type][k][1]];
+        }
+        
+        // a biflip needs base a1, which goes to c1 (high) or c2 (low)
+        biflip[type] = w[0][type ? 4 : 5];
+        for(k=1;k<4;k++) {
+            biflip[type] *= w[k][newtypes[type][k][0]] > w[k][newtypes[type][k][1]] ?
+                            w[k][newtypes[type][k][0]] : w[k][newtypes[type][k][1]];
+        }
+    }
+    
+    if(r<flip[0]) r = flip[0];
+    if(r<flip[1]) r = flip[1];
+    if(r<biflip[0]+biflip[1]) r = biflip[0]+biflip[1];
+    return r;
+}
+#endif
+
+#if SCHEDULE
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+int parsescheduleentries(FILE *data) {
+    
+    // one entry per line, in flip order:
+    //   quench <flips> a1 a2 b1 b2 c1 c2
+    //   ramp   <from> <to> <steps> a1 a2 b1 b2 c1 c2
+    //   delta  <from> <to> <steps> <delta>
+    // ramps move linearly in the weights, delta ramps move linearly
+    // in delta = (a1a2 + b1b2 - c1c2) / 2sqrt(a1a2b1b2), keeping a
+    // and b and the ratio c1/c2
+    char    kind[16];
+    double  w[6], start[6], target[6], d0, d1, d, ab, cc;
+    long long   from, to, last = 0;
+    int     steps, k, n;
+    
+    memcpy(w, wts, sizeof(w));
+    while(fscanf(data,"%15s",kind)==1) {
+        if(strcmp(kind,"quench")==0) {
+            if(fscanf(data,"%lld %lf %lf %lf %lf %lf %lf",&from,
+                      &w[0],&w[1],&w[2],&w[3],&w[4],&w[5])!=7) return 1;
+            to = from;
+            steps = 1;
+            memcpy(start, w, sizeof(w));
+            memcpy(target, w, sizeof(w));
+        } else if(strcmp(kind,"ramp")==0) {
+            memcpy(start, w, sizeof(w));
+            if(fscanf(data,"%lld %lld %d %lf %lf %lf %lf %lf %lf",&from,&to,&steps,
+                      &target[0],&target[1],&target[2],&target[3],&target[4],&target[5])!=9) return 1;
+        } else if(strcmp(kind,"delta")==0) {
+            memcpy(start, w, sizeof(w));
+            if(fscanf(data,"%lld %lld %d %lf",&from,&to,&steps,&d1)!=4) return 1;
+        } else {
+            return 1;
+        }
+        if(from < last || to < from || steps < 1) return 1;
+        
+        ab = sqrt(start[0]*start[1]*start[2]*start[3]);
+        d0 = (start[0]*start[1] + start[2]*start[3] - start[4]*start[5]) / (2*ab);
+        
+        for(n=1;n<=steps;n++) {
+            if(schedulelength >= MAXSCHEDULE) return 1;
+            schedule[schedulelength].at = from + (to-from) * n / steps;
+            if(strcmp(kind,"delta")==0) {
+                d = d0 + (d1-d0) * n / steps;
+                cc = start[0]*start[1] + start[2]*start[3] - 2*d*ab;
+                if(cc <= 0) return 1;
+                memcpy(w, start, sizeof(w));
+                w[4] = sqrt(cc * start[4] / start[5]);
+                w[5] = sqrt(cc * start[5] / start[4]);
+            } else {
+                for(k=0;k<6;k++) w[k] = start[k] + (target[k]-start[k]) * n / steps;
+            }
+            memcpy(schedule[schedulelength].w, w, sizeof(w));
+            schedulelength++;
+        }
+        last = to;
+    }
+    return 0;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+int parseschedule(FILE *data) {
+    
+    int     bad;
+    
+    // the entries may stop at any line, the file is closed all the same
+    bad = parsescheduleentries(data);
+    fclose(data);
+    if(bad) return 1;
+    
+    schedulenextat = schedulelength ? schedule[0].at : 0x7FFFFFFFFFFFFFFFLL;
+    return 0;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void applyschedule(void) {
+    
+    struct timespec start, end;
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    
+    while(schedulestage < schedulelength && flipcompleted >= schedule[schedulestage].at) {
+        memcpy(wts, schedule[schedulestage].w, sizeof(wts));
+        schedulestage++;
+    }
+    schedulenextat = schedulestage < schedulelength ? 
+                     schedule[schedulestage].at : 0x7FFFFFFFFFFFFFFFLL;
+    
+    // getweightratio only reads wts and rho; rho is kept as a running
+    // maximum by definerho, so start it again from nothing
+    rho = 0;
+    definerho();
+    
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    
+    printf("Flips completed: %lld - schedule stage %d/%d, rebuilt in %.1lf us\n",
+           flipcompleted, schedulestage, schedulelength,
+           (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3);
+    printf("a1 = %lf, a2 = %lf, b1 = %lf, b2 = %lf, c1 = %lf, c2 = %lf\n",
+           wts[0],wts[1],wts[2],wts[3],wts[4],wts[5]);
+    print_schedule("schedule", schedulestage);
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void print_schedule(char *output, int index) {
+    
+    static FILE *data = NULL;                   // the log, opened once
+    char name[512];
+    
+    if(data == NULL) {
+        sprintf(name,"%s/matrix.schedule",outputdir);
+        if((data = sinkopen(name,"a")) == NULL) return;
+    }
+    
+    // flips, stage, weights in effect, then which output this was
+    fprintf(data, "%lld %d %lf %lf %lf %lf %lf %lf %s %d\n",flipcompleted,schedulestage,
+            wts[0],wts[1],wts[2],wts[3],wts[4],wts[5],output,index);
+}
+
+void snapshotschedule(int due) {
+    
+    // written by the parent before any child starts, since children
+    // appending lines themselves can overlap and reorder them
+    #if TEXT
+    if(due & SNAPTEXT) print_schedule("text", tprint);
+    #endif
+    #if PDF
+    if((due & SNAPPDF) && pdfactive) print_schedule("pdf", pprint);
+    #endif
+    #if CDENSITY
+    if(due & SNAPCDENSITY) {
+        print_schedule("c-density", cprint);
+        #if CDENSITYPDF
+        // print_cdensity has stepped cprint by the time the pdf is made
+        print_schedule("c-density-pdf", cprint >= 50 ? 0 : cprint + 1);
+        #endif
+    }
+    #endif
+}
+#endif
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+double definerho(void) {
+    
+    #if INHOMOGENEOUS
+    int     i, j, k;
+    
+    // worst case over every neighbourhood of classes in the matrix
+    for(i=0;i<nrows;i++) {
+        for(j=0;j<ncols;j++) {
+            if(rho<siterho(i,j)) rho = siterho(i,j);
+        }
+    }
+    
+    // a flip's four classes and new types take too many combinations
+    // to tabulate whole, so only the division by rho is done up front
+    for(i=0;i<MAXCLASSES;i++) {
+        for(k=0;k<6;k++) classbase[i][k] = classwts[i][k] / rho;
+    }
+    #else
+    if(rho<computerho(wts)) rho = computerho(wts);
+    #endif
+    
+    #if DEBUG
+        printf("rho: %lf",rho);
+    #endif
+    
+    return rho;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+unsigned long long rngnext(unsigned long long *state) {
+    
+    unsigned long long z;
+    
+    z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+double rnguniform(unsigned long long *state) {
+    // top 53 bits give every double in [0,1) the same spacing
+    return (double) (rngnext(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+int chainisflippable(unsigned char *t, int rpos, int cpos, int type) {
+    
+    int     base, dshift;
+    
+    if(type) {
+        if(!HIGHINBOUNDS(rpos,cpos)) return 0;     //check high bounds
+        #if DOMAIN
+        if(!domainplaquette(rpos,cpos,type)) return 0;
+        #endif
+        base = t[CELL(rpos,cpos)];
+        dshift = t[CELL(ROWUP(rpos),COLRIGHT(cpos))];
+        // a1 or c2 with a2 or c2 free to the upper right
+        return (base==0 || base==5) && (dshift==1 || dshift==5);
+    } else {
+        if(!LOWINBOUNDS(rpos,cpos)) return 0;      //check low bounds
+        #if DOMAIN
+        if(!domainplaquette(rpos,cpos,type)) return 0;
+        #endif
+        base = t[CELL(rpos,cpos)];
+        dshift = t[CELL(ROWDOWN(rpos),COLLEFT(cpos))];
+        // a1 or c1 with a2 or c1 free to the lower left
+        return (base==0 || base==4) && (dshift==1 || dshift==4);
+    }
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void chainupdate(unsigned char *t, int rpos, int cpos, int type) {
+    
+    int     xpos = CELL(rpos,FLIPCOL(cpos,type));
+    int     ypos = CELL(FLIPROW(rpos,type),cpos);
+    int     dpos = CELL(FLIPROW(rpos,type),FLIPCOL(cpos,type));
+    int     bpos = CELL(rpos,cpos);
+    
+    t[bpos] = flipmap[type][0][t[bpos]];
+    t[xpos] = flipmap[type][1][t[xpos]];
+    t[ypos] = flipmap[type][2][t[ypos]];
+    t[dpos] = flipmap[type][3][t[dpos]];
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+double chainflipweight(unsigned char *t, int rpos, int cpos, int type, double *w) {
+    
+    int     xpos = CELL(rpos,FLIPCOL(cpos,type));
+    int     ypos = CELL(FLIPROW(rpos,type),cpos);
+    int     dpos = CELL(FLIPROW(rpos,type),FLIPCOL(cpos,type));
+    int     bpos = CELL(rpos,cpos);
+    
+    return (w[flipmap[type][0][t[bpos]]] * w[flipmap[type][1][t[xpos]]] *
+            w[flipmap[type][2][t[ypos]]] * w[flipmap[type][3][t[dpos]]]);
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+double chainflipdelta(unsigned char *t, int rpos, int cpos, int type, double *logw) {
+    
+    int     xpos = CELL(rpos,FLIPCOL(cpos,type));
+    int     ypos = CELL(FLIPROW(rpos,type),cpos);
+    int     dpos = CELL(FLIPROW(rpos,type),FLIPCOL(cpos,type));
+    int     bpos = CELL(rpos,cpos);
+    
+    return (logw[flipmap[type][0][t[bpos]]] - logw[t[bpos]] +
+            logw[flipmap[type][1][t[xpos]]] - logw[t[xpos]] +
+            logw[flipmap[type][2][t[ypos]]] - logw[t[ypos]] +
+            logw[flipmap[type][3][t[dpos]]] - logw[t[dpos]]);
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+double chainlogweight(unsigned char *t, double *logw) {
+    
+    double  total = 0;
+    int     i;
+    
+    #if DOMAIN
+    for(i=0;i<domaincells;i++) 
+        total += logw[t[CELL(domainactive[i] >> 16, domainactive[i] & 0xFFFF)]];
+    #else
+    for(i=0;i<nrows*ncols;i++) total += logw[t[i]];
+    #endif
+    return total;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void getlogweights(double *logw) {
+    
+    int     k;
+    
+    // a zero weight becomes the log of the smallest double rather
+    // than -inf, so differences of log-weights stay finite
+    for(k=0;k<6;k++) logw[k] = wts[k] > 0 ? log(wts[k]) : -745.0;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+int chainattempt(cstruct *ch, double *w, double rhow, double *logw) {
+    
+    int     rpos, cpos;
+    
+    // get a random position
+    #if DOMAIN
+    rpos = domainactive[(int) (domaincells * rnguniform(&ch->rng))];
+    cpos = rpos & 0xFFFF;
+    rpos >>= 16;
+    #else
+    rpos = (int) (nrows * rnguniform(&ch->rng));
+    cpos = (int) (ncols * rnguniform(&ch->rng));
+    #endif
+    
+    return chaintry(ch, rpos, cpos, 1, 1, w, rhow, logw);
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+int chaintry(cstruct *ch, int rpos, int cpos, int high, int low,
+             double *w, double rhow, double *logw) {
+    
+    int     type;
+    double  flipchance, flipchance2, random;
+    
+    high = high && chainisflippable(ch->type, rpos, cpos, 1);
+    low = low && chainisflippable(ch->type, rpos, cpos, 0);
+    if(!high && !low) return 0;
+    
+    // same high, low and biflip choice as the main loop
+    flipchance = high ? chainflipweight(ch->type, rpos, cpos, 1, w) / rhow : 0;
+    flipchance2 = low ? chainflipweight(ch->type, rpos, cpos, 0, w) / rhow : 0;
+    random = rnguniform(&ch->rng);
+    
+    if(high && flipchance>=random) {
+        type = 1;
+    } else if(low && flipchance+flipchance2>=random) {
+        type = 0;
+    } else {
+        ch->flipfailed++;
+        return 0;
+    }
+    
+    if(logw) ch->logweight += chainflipdelta(ch->type, rpos, cpos, type, logw);
+    chainupdate(ch->type, rpos, cpos, type);
+    ch->flipcompleted++;
+    return 1;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+static inline int varintsize(int v) {
+    return 1 + (v > 127) + (v > 16383) + (v > 2097151) + (v > 268435455);
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+long long encodeplane(unsigned char *t, int rows, int cols, unsigned char *out, long long cap) {
+    
+    // header: "VTC1", rows, cols (little endian), then 1 if coded,
+    // 2 if sparse or 0 if the types follow raw.  Coded, each position's
+    // left and top edges come from its neighbours (or a coded boundary
+    // bit), which leaves a1/a2 nothing to code and b/c one bit: whether
+    // the path turns.  That bit is coded in the context of the case and
+    // the types up, up-right and left, so frozen regions cost almost
+    // nothing.  Sparse is used instead when it comes out smaller; its
+    // size is summed up on the way, so the plane is read only once
+    unsigned short  models[2*7*7*7], edgemodels[2][2];
+    long long   n = (long long) rows * cols, raw = 13 + n;
+    long long   sparse = 13 + (rows + cols + 7) / 8, gaps = 0, last = -1;
+    int     i, j, k, l, tp, up, upright, left, prevl = 0, prevt = 0, count = 0;
+    rstruct rc;
+    
+    memcpy(out, "VTC1", 4);
+    for(k=0;k<4;k++) {
+        out[4+k] = (unsigned char) (rows >> (8*k));
+        out[8+k] = (unsigned char) (cols >> (8*k));
+    }
+    out[12] = 1;
+    
+    for(k=0;k<2*7*7*7;k++) models[k] = 1 << (CODERBITS-1);
+    for(k=0;k<4;k++) edgemodels[k>>1][k&1] = 1 << (CODERBITS-1);
+    rc.low = 0;
+    rc.range = 0xFFFFFFFFU;
+    rc.cache = 0;
+    rc.cachesize = 1;
+    rc.buf = out;
+    rc.pos = 13;
+    rc.cap = cap < raw ? cap : raw;             // never worse than raw
+    
+    for(i=0;i<rows;i++) {
+        for(j=0;j<cols;j++) {
+            k = t[i*cols+j];
+            if(k > 5) goto writeraw;
+            
+            if(j==0) {
+                l = vertexedges[k] & 1;
+                rcencode(&rc, &edgemodels[0][prevl], l);
+                prevl = l;
+            } else {
+                l = (vertexedges[t[i*cols+j-1]] >> 2) & 1;
+            }
+            if(i==0) {
+                tp = (vertexedges[k] >> 1) & 1;
+                rcencode(&rc, &edgemodels[1][prevt], tp);
+                prevt = tp;
+            } else {
+                tp = (vertexedges[t[(i-1)*cols+j]] >> 3) & 1;
+            }
+            
+            // planes that break the ice rule are stored raw
+            if((vertexedges[k] & 3) != (l | tp << 1)) goto writeraw;
+            if(l == tp) continue;
+            
+            up = i ? t[(i-1)*cols+j] : 6;
+            upright = (i && j<cols-1) ? t[(i-1)*cols+j+1] : 6;
+            left = j ? t[i*cols+j-1] : 6;
+            rcencode(&rc, &models[((l*7 + up)*7 + upright)*7 + left], k >= 4);
+            
+            // only a c turns the path without a b, and only a c costs
+            // the sparse form anything
+            if(k >= 4) {
+                gaps += varintsize((int) ((long long) i*cols + j - last - 1));
+                last = (long long) i*cols + j;
+                count++;
+            }
+        }
+        if(rc.pos >= rc.cap) {
+            // cut short, so the sum is not complete; size sparse apart
+            sparse = encodesparse(t, rows, cols, NULL, raw);
+            goto writesparse;
+        }
+    }
+    for(k=0;k<5;k++) rcshift(&rc);
+    sparse += varintsize(count) + gaps;
+    if(rc.pos < rc.cap && rc.pos <= sparse) return rc.pos;
+    
+    writesparse:
+    if(sparse && sparse <= cap && sparse < raw) return encodesparse(t, rows, cols, out, raw);
+    
+    writeraw:
+    out[12] = 0;
+    memcpy(out+13, t, n);
+    return raw;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+int decodeplane(unsigned char *in, long long len, unsigned char *t, int rows, int cols) {
+    
+    unsigned short  models[2*7*7*7], edgemodels[2][2];
+    long long   n = (long long) rows * cols;
+    int     i, j, k, l, tp, up, upright, left, prevl = 0, prevt = 0;
+    rstruct rc;
+    
+    if(len < 13 || memcmp(in, "VTC1", 4) != 0) return 1;
+    for(k=0,i=0,j=0;k<4;k++) {
+        i |= in[4+k] << (8*k);
+        j |= in[8+k] << (8*k);
+    }
+    if(i != rows || j != cols) return 1;
+    
+    if(in[12] == 0) {
+        if(len < 13 + n) return 1;
+        memcpy(t, in+13, n);
+        return 0;
+    }
+    if(in[12] == 2) return decodesparse(in, len, t, rows, cols);
+    
+    for(k=0;k<2*7*7*7;k++) models[k] = 1 << (CODERBITS-1);
+    for(k=0;k<4;k++) edgemodels[k>>1][k&1] = 1 << (CODERBITS-1);
+    rc.range = 0xFFFFFFFFU;
+    rc.code = 0;
+    rc.buf = in;
+    rc.pos = 13;
+    rc.cap = len;
+    for(k=0;k<5;k++) rc.code = (rc.code << 8) | (rc.pos < rc.cap ? rc.buf[rc.pos++] : 0);
+    
+    for(i=0;i<rows;i++) {
+        for(j=0;j<cols;j++) {
+            if(j==0) {
+                l = rcdecode(&rc, &edgemodels[0][prevl]);
+                prevl = l;
+            } else {
+                l = (vertexedges[t[i*cols+j-1]] >> 2) & 1;
+            }
+            if(i==0) {
+                tp = rcdecode(&rc, &edgemodels[1][prevt]);
+                prevt = tp;
+            } else {
+                tp = (vertexedges[t[(i-1)*cols+j]] >> 3) & 1;
+            }
+            
+            if(l == tp) {
+                t[i*cols+j] = l ? 0 : 1;
+                continue;
+            }
+            
+            up = i ? t[(i-1)*cols+j] : 6;
+            upright = (i && j<cols-1) ? t[(i-1)*cols+j+1] : 6;
+            left = j ? t[i*cols+j-1] : 6;
+            k = rcdecode(&rc, &models[((l*7 + up)*7 + upright)*7 + left]);
+            // b2/c1 enter from the left, b1/c2 from the top
+            t[i*cols+j] = l ? (k ? 4 : 3) : (k ? 5 : 2);
+        }
+    }
+    
+    return 0;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+long long encodesparse(unsigned char *t, int rows, int cols, unsigned char *out, long long cap) {
+    
+    // after the header: the left edge of every row then the top edge of
+    // every column, a bit each; then the number of c vertices and the
+    // gap from each to the next in row order, all as 7-bit varints, so
+    // rows with none cost nothing.  Which c a position holds, the +1 or
+    // -1 of the alternating sign matrix, follows from its left and top
+    // edges, and every other type from its edges and not being a c, so
+    // nothing more is stored
+    long long   pos = 13 + (rows + cols + 7) / 8, n = (long long) rows * cols;
+    long long   i, last = -1;
+    int     k, l, tp, count = 0;
+    
+    if(out != NULL) {
+        memset(out+13, 0, pos-13);
+        out[12] = 2;
+    }
+    
+    for(i=0;i<n;i++) {
+        k = t[i];
+        if(k > 5) return 0;
+        l = i % cols ? (vertexedges[t[i-1]] >> 2) & 1 : vertexedges[k] & 1;
+        tp = i >= cols ? (vertexedges[t[i-cols]] >> 3) & 1 : (vertexedges[k] >> 1) & 1;
+        if((vertexedges[k] & 3) != (l | tp << 1)) return 0;
+        count += k >= 4;
+        
+        if(out != NULL && i % cols == 0 && l) out[13 + (i/cols >> 3)] |= 1 << (i/cols & 7);
+        if(out != NULL && i < cols && tp) out[13 + ((rows+i) >> 3)] |= 1 << ((rows+i) & 7);
+    }
+    
+    // the count, then the gaps
+    if(writevarint(out, cap, &pos, count)) return 0;
+    for(i=0;i<n;i++) {
+        if(t[i] < 4) continue;
+        if(writevarint(out, cap, &pos, (int) (i - last - 1))) return 0;
+        last = i;
+    }
+    
+    return pos;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+int decodesparse(unsigned char *in, long long len, unsigned char *t, int rows, int cols) {
+    
+    long long   pos = 13 + (rows + cols + 7) / 8, n = (long long) rows * cols;
+    long long   i, next = -1;
+    int     k, l = 0, tp, count, v;
+    
+    if(len < pos || readvarint(in, len, &pos, &count)) return 1;
+    if(count && readvarint(in, len, &pos, &v)) return 1;
+    if(count) next = v;
+    
+    for(i=0;i<n;i++) {
+        if(i % cols == 0) l = (in[13 + (i/cols >> 3)] >> (i/cols & 7)) & 1;
+        tp = i >= cols ? (vertexedges[t[i-cols]] >> 3) & 1 
+                       : (in[13 + ((rows+i) >> 3)] >> ((rows+i) & 7)) & 1;
+        if(i == next) {
+            // a c turns the path: c1 enters from the left, c2 from the top
+            if(l == tp) return 1;
+            k = l ? 4 : 5;
+            if(--count) {
+                if(readvarint(in, len, &pos, &v)) return 1;
+                next = i + 1 + v;
+            }
+        } else {
+            // anything else goes straight on
+            k = l ? (tp ? 0 : 3) : (tp ? 2 : 1);
+        }
+        t[i] = (unsigned char) k;
+        l = (vertexedges[k] >> 2) & 1;
+    }
+    
+    return count != 0;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+int readvarint(unsigned char *in, long long len, long long *pos, int *v) {
+    
+    int     shift;
+    
+    for(*v=0,shift=0;shift<=28;shift+=7) {
+        if(*pos >= len) return 1;
+        *v |= (in[*pos] & 127) << shift;
+        if(!(in[(*pos)++] & 128)) return 0;
+    }
+    return 1;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+int writevarint(unsigned char *out, long long cap, long long *pos, int v) {
+    
+    do {
+        if(*pos >= cap) return 1;
+        if(out != NULL) out[*pos] = (unsigned char) ((v & 127) | (v > 127 ? 128 : 0));
+        (*pos)++;
+        v >>= 7;
+    } while(v);
+    return 0;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+static inline void rcput(rstruct *rc, unsigned char byte) {
+    if(rc->pos < rc->cap) rc->buf[rc->pos] = byte;
+    rc->pos++;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+static inline void rcshift(rstruct *rc) {
+    
+    unsigned char   temp;
+    
+    // a byte can only go out once no carry can reach it
+    if((unsigned int) rc->low < 0xFF000000U || (rc->low >> 32) != 0) {
+        temp = rc->cache;
+        do {
+            rcput(rc, (unsigned char) (temp + (unsigned char) (rc->low >> 32)));
+            temp = 0xFF;
+        } while(--rc->cachesize != 0);
+        rc->cache = (unsigned char) (rc->low >> 24);
+    }
+    rc->cachesize++;
+    rc->low = (rc->low & 0x00FFFFFFULL) << 8;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+static inline void rcencode(rstruct *rc, unsigned short *p, int bit) {
+    
+    unsigned int    bound = (rc->range >> CODERBITS) * *p;
+    unsigned int    mask = 0U - (unsigned int) bit;
+    
+    // without branches, since in disordered regions the bit is a
+    // coin toss and a mispredict costs more than the coding
+    rc->low += bound & mask;
+    rc->range = bound ^ ((bound ^ (rc->range - bound)) & mask);
+    RCADAPT(*p, bit);
+    while(rc->range < (1U << 24)) {
+        rc->range <<= 8;
+        rcshift(rc);
+    }
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+static inline int rcdecode(rstruct *rc, unsigned short *p) {
+    
+    unsigned int    bound = (rc->range >> CODERBITS) * *p;
+    int     bit;
+    
+    if(rc->code < bound) {
+        rc->range = bound;
+        bit = 0;
+    } else {
+        rc->code -= bound;
+        rc->range -= bound;
+        bit = 1;
+    }
+    RCADAPT(*p, bit);
+    while(rc->range < (1U << 24)) {
+        rc->range <<= 8;
+        rc->code = (rc->code << 8) | (rc->pos < rc->cap ? rc->buf[rc->pos++] : 0);
+    }
+    return bit;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+int decodefile(char *inname, char *outname) {
+    
+    FILE    *data;
+    unsigned char   *in, *t;
+    long long   len;
+    int     rows = 0, cols = 0, k;
+    
+    if((data = fopen(inname,"rb"))==NULL) {
+        printf("*** error opening coded file\n");
+        return 1;
+    }
+    fseek(data, 0, SEEK_END);
+    len = ftell(data);
+    fseek(data, 0, SEEK_SET);
+    if((in = malloc(len > 13 ? len : 13)) == NULL) {
+        printf("*** no memory to read %s\n", inname);
+        fclose(data);
+        return 1;
+    }
+    if(fread(in, 1, len, data) != (size_t) len || len < 13) len = 0;
+    fclose(data);
+    
+    // the sizes come from the file, so they are held to what a run
+    // could have written before anything is allocated from them
+    for(k=0;k<4 && len;k++) {
+        rows |= in[4+k] << (8*k);
+        cols |= in[8+k] << (8*k);
+    }
+    if(rows < 1 || cols < 1 || (long long) rows * cols > (long long) MAXROWS * MAXCOLS) len = 0;
+    t = len ? malloc((size_t) rows * cols + 1) : NULL;
+    if(len && t == NULL) {
+        printf("*** no memory for a %dx%d matrix\n", rows, cols);
+        free(in);
+        return 1;
+    }
+    if(len == 0 || decodeplane(in, len, t, rows, cols)) {
+        printf("*** %s is not a coded matrix\n", inname);
+        free(in);
+        free(t);
+        return 1;
+    }
+    
+    if((data = fopen(outname,"w"))==NULL) {
+        printf("*** error opening %s\n", outname);
+        free(in);
+        free(t);
+        return 1;
+    }
+    for(k=0;k<rows*cols;k++) fputc('0' + t[k], data);
+    fclose(data);
+    
+    printf("%s: %dx%d, %lld bytes -> %d\n", inname, rows, cols, len, rows*cols);
+    free(in);
+    free(t);
+    return 0;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void writecoded(FILE *data, mstruct m[MAXROWS][MAXCOLS]) {
+    
+    long long   n = (long long) nrows * ncols, len;
+    int     i, j;
+    
+    // the work buffers are made once, by sinkstart
+    for(i=0;i<nrows;i++) 
+        for(j=0;j<ncols;j++) codedplane[i*ncols+j] = (unsigned char) m[i][j].type;
+    
+    len = encodeplane(codedplane, nrows, ncols, codedout, n + 16);
+    fwrite(codedout, 1, len, data);
+}
+
+#if PIN
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+int readtopology(void) {
+    
+    cpu_set_t   allowed;
+    FILE    *data;
+    char    name[128];
+    int     cpu, k, n = 0;
+    
+    if(sched_getaffinity(0, sizeof(allowed), &allowed)) return 1;
+    
+    for(cpu=0;cpu<MAXCPUS && cpu<CPU_SETSIZE;cpu++) {
+        if(!CPU_ISSET(cpu, &allowed)) continue;
+        topologycpu[n] = cpu;
+        
+        // without sysfs every cpu counts as a core of its own
+        topologycore[n] = cpu;
+        topologypackage[n] = 0;
+        sprintf(name,"/sys/devices/system/cpu/cpu%d/topology/core_id",cpu);
+        if((data = fopen(name,"r"))!=NULL) {
+            if(fscanf(data,"%d",&topologycore[n]) != 1) topologycore[n] = cpu;
+            fclose(data);
+        }
+        sprintf(name,"/sys/devices/system/cpu/cpu%d/topology/physical_package_id",cpu);
+        if((data = fopen(name,"r"))!=NULL) {
+            if(fscanf(data,"%d",&topologypackage[n]) != 1) topologypackage[n] = 0;
+            fclose(data);
+        }
+        
+        // SMT siblings share the core and package numbers
+        topologysmt[n] = 0;
+        for(k=0;k<n;k++) 
+            if(topologycore[k]==topologycore[n] && topologypackage[k]==topologypackage[n]) 
+                topologysmt[n]++;
+        n++;
+    }
+    
+    topologycpus = n;
+    return n == 0;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void pinplan(char *engine, int place, int workers) {
+    
+    int     order[MAXCPUS];                     // cpus in placement order
+    long long   key[MAXCPUS], kn;
+    int     i, j, k;
+    FILE    *data;
+    char    name[512];
+    
+    if(topologycpus == 0 && readtopology()) {
+        printf("*** cpu topology not readable, threads left unpinned\n");
+        return;
+    }
+    
+    // compact walks package, core, thread, so the two threads of a
+    // core come together; scatter walks thread, core, package, so
+    // every core and package has one worker before any has two
+    for(i=0;i<topologycpus;i++) {
+        if(place == COMPACT) 
+            key[i] = ((long long) topologypackage[i] << 40) | 
+                     ((long long) topologycore[i] << 16) | topologysmt[i];
+        else 
+            key[i] = ((long long) topologysmt[i] << 40) | 
+                     ((long long) topologycore[i] << 16) | topologypackage[i];
+        
+        // insertion sort; equal keys keep the cpu order
+        kn = key[i];
+        for(j=i;j>0 && key[order[j-1]]>kn;j--) order[j] = order[j-1];
+        order[j] = i;
+    }
+    
+    // more workers than cpus wrap around the order
+    for(k=0;k<workers && k<MAXCPUS;k++) pincpu[k] = order[k % topologycpus];
+    
+    printf("Placement: %s, %s over %d cpus\n", engine,
+           place == COMPACT ? "compact" : "scatter", topologycpus);
+    sprintf(name,"%s/matrix.end",outputdir);
+    data = sinkopen(name,"a");
+    if(data != NULL) fprintf(data, "\nPlacement: %s, %s over %d cpus\n", engine,
+                             place == COMPACT ? "compact" : "scatter", topologycpus);
+    for(k=0;k<workers && k<MAXCPUS;k++) {
+        i = pincpu[k];
+        printf("  worker %d -> cpu %d (package %d, core %d, thread %d)\n", k,
+               topologycpu[i], topologypackage[i], topologycore[i], topologysmt[i]);
+        if(data != NULL) 
+            fprintf(data, "  worker %d -> cpu %d (package %d, core %d, thread %d)\n", k,
+                    topologycpu[i], topologypackage[i], topologycore[i], topologysmt[i]);
+    }
+    sinkclose(data);
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void pinthread(int worker) {
+    
+    cpu_set_t   set;
+    
+    if(topologycpus == 0 || worker >= MAXCPUS) return;
+    
+    CPU_ZERO(&set);
+    CPU_SET(topologycpu[pincpu[worker]], &set);
+    if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) 
+        printf("*** could not pin worker %d\n", worker);
+}
+#endif
+
+#if PARALLEL
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void parallelstart(void) {
+    
+    pthread_t   thread;
+    int         i, tiles;
+    
+    paralleltilerows = (nrows + PARALLELTILE - 1) / PARALLELTILE;
+    paralleltilecols = (ncols + PARALLELTILE - 1) / PARALLELTILE;
+    tiles = paralleltilerows * paralleltilecols;
+    paralleltileflips = calloc(tiles, sizeof(long long));
+    paralleltilefails = calloc(tiles, sizeof(long long));
+    paralleltileload = calloc(tiles, sizeof(double));
+    
+    // equal bands of tile rows to begin with
+    for(i=0;i<=PARALLELTHREADS;i++) 
+        parallelbound[i] = (int) ((long long) tiles * i / PARALLELTHREADS);
+    
+    for(i=0;i<2;i++) {
+        parallelchain[i].type = malloc(chainsize);
+        parallelchain[i].logweight = 0;
+        parallelchain[i].rng = 0;
+        parallelchain[i].flipcompleted = 0;
+        parallelchain[i].flipfailed = 0;
+    }
+    
+    printf("Parallel sweeps: %d threads over %dx%d tiles of %dx%d\n",
+           PARALLELTHREADS, paralleltilerows, paralleltilecols, PARALLELTILE, PARALLELTILE);
+    #if PIN
+    pinplan("parallel", PARALLELPLACE, PARALLELTHREADS);
+    #endif
+    
+    // the threads live as long as the main loop does; they touch
+    // their own rows first, so those pages sit by the core that
+    // sweeps them, and the planes are loaded after
+    pthread_barrier_init(&parallelbarrier, NULL, PARALLELTHREADS + 1);
+    for(i=0;i<PARALLELTHREADS;i++) {
+        pthread_create(&thread, NULL, parallelthread, (void *) (long) i);
+        pthread_detach(thread);
+    }
+    pthread_barrier_wait(&parallelbarrier);
+    
+    loadplane(parallelchain[0].type, matrix);
+    loadplane(parallelchain[1].type, matrix2);
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void parallelsweep(void) {
+    
+    unsigned long long state;
+    int     t, tiles = paralleltilerows * paralleltilecols;
+    
+    // shift the tile grid every sweep so no plaquette stays on a
+    // tile edge; the shift comes from the seed and the sweep number
+    state = runseed ^ (unsigned long long) parallelepoch;
+    state = rngnext(&state);
+    paralleloffrow = (int) (state % PARALLELTILE) % nrows;
+    paralleloffcol = (int) ((state >> 32) % PARALLELTILE) % ncols;
+    
+    pthread_barrier_wait(&parallelbarrier);     // release the threads
+    pthread_barrier_wait(&parallelbarrier);     // wait for every tile
+    
+    // add up in tile order, never in the order threads finished
+    for(t=0;t<tiles;t++) {
+        flipcompleted += paralleltileflips[t];
+        flipfailed += paralleltilefails[t];
+    }
+    parallelepoch++;
+    
+    // the threads are parked at the barrier, so the bounds can move
+    if(PARALLELREBALANCE && parallelepoch % PARALLELREBALANCE == 0) parallelrebalance();
+    
+    storeplane(parallelchain[0].type, matrix);
+    storeplane(parallelchain[1].type, matrix2);
+    matrixvol = setheights();
+    matrixvol2 = setheights2();
+    #if DIFFERENCE
+    differencestart();
+    #endif
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void *parallelthread(void *arg) {
+    
+    int     id = (int) (long) arg;
+    int     t, tiles;
+    int     lo = parallelbound[id], hi = parallelbound[id+1];
+    
+    #if PIN
+    pinthread(id);
+    #endif
+    
+    // a thread's tiles run in row order but may start or end part way
+    // along a tile row, so it touches the share of plane rows its tiles
+    // make of the grid; the shares split the rows without overlap
+    #if !DOMAIN
+    tiles = paralleltilerows * paralleltilecols;
+    for(t=(int) ((long long) lo * nrows / tiles);t<(int) ((long long) hi * nrows / tiles);t++) {
+        memset(parallelchain[0].type + (size_t) t * ncols, 0, ncols);
+        memset(parallelchain[1].type + (size_t) t * ncols, 0, ncols);
+    }
+    #endif
+    pthread_barrier_wait(&parallelbarrier);
+    
+    while(1==1) {
+        pthread_barrier_wait(&parallelbarrier);
+        
+        // which thread sweeps a tile makes no difference to the result
+        for(t=parallelbound[id];t<parallelbound[id+1];t++) paralleltile(t);
+        
+        pthread_barrier_wait(&parallelbarrier);
+    }
+    
+    return NULL;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void paralleltile(int tile) {
+    
+    int     tr = tile / paralleltilecols, tc = tile % paralleltilecols;
+    int     h, w, i, j, k, n, rpos, cpos;
+    cstruct ch[2];                              // this tile's view of both
+    struct timespec start, end;
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    
+    // tiles are cyclic blocks of the shifted grid, the last in each
+    // direction cut short; blocks never share a position
+    h = nrows - tr*PARALLELTILE < PARALLELTILE ? nrows - tr*PARALLELTILE : PARALLELTILE;
+    w = ncols - tc*PARALLELTILE < PARALLELTILE ? ncols - tc*PARALLELTILE : PARALLELTILE;
+    
+    // the stream belongs to the tile and the sweep, not the thread
+    for(k=0;k<2;k++) {
+        ch[k] = parallelchain[k];
+        ch[k].flipcompleted = 0;
+        ch[k].flipfailed = 0;
+    }
+    ch[0].rng = runseed ^ (unsigned long long) parallelepoch;
+    ch[0].rng = rngnext(&ch[0].rng) ^ (unsigned long long) tile;
+    ch[0].rng = rngnext(&ch[0].rng);
+    
+    for(n=0;n<h*w;n++) {
+        i = (int) (h * rnguniform(&ch[0].rng));
+        j = (int) (w * rnguniform(&ch[0].rng));
+        rpos = (paralleloffrow + tr*PARALLELTILE + i) % nrows;
+        cpos = (paralleloffcol + tc*PARALLELTILE + j) % ncols;
+        
+        // a flip may only touch positions of this tile; the reverse
+        // of a flip touches the same four, so balance still holds.
+        // both matrices draw from the one stream, first then second
+        chaintry(&ch[0], rpos, cpos, i>0 && j<w-1, i<h-1 && j>0, wts, rho, NULL);
+        ch[1].rng = ch[0].rng;
+        chaintry(&ch[1], rpos, cpos, i>0 && j<w-1, i<h-1 && j>0, wts, rho, NULL);
+        ch[0].rng = ch[1].rng;
+    }
+    
+    paralleltileflips[tile] = ch[0].flipcompleted + ch[1].flipcompleted;
+    paralleltilefails[tile] = ch[0].flipfailed + ch[1].flipfailed;
+    
+    // every tile makes the same number of attempts, so what differs
+    // between them is time alone: cache misses, a busy sibling thread,
+    // the short tiles at the edges. Balancing on measured time evens
+    // out the wait at the barrier, which a count of flips cannot
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    paralleltileload[tile] += (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void parallelrebalance(void) {
+    
+    int     i, t, tiles = paralleltilerows * paralleltilecols;
+    int     bound[PARALLELTHREADS+1];
+    double  total = 0, sum = 0;
+    
+    for(t=0;t<tiles;t++) total += paralleltileload[t];
+    if(total <= 0) return;
+    
+    // threads keep contiguous bands, cut where the running load
+    // passes each equal share; only tiles at the ends of a band move.
+    // tiles never share a position, so any owner keeps the update
+    // the same and no colouring is needed
+    bound[0] = 0;
+    i = 1;
+    for(t=0;t<tiles && i<PARALLELTHREADS;t++) {
+        sum += paralleltileload[t];
+        while(i<PARALLELTHREADS && sum >= total * i / PARALLELTHREADS) bound[i++] = t + 1;
+    }
+    while(i<=PARALLELTHREADS) bound[i++] = tiles;
+    
+    for(i=1;i<PARALLELTHREADS;i++) {
+        parallelmoved += bound[i] > parallelbound[i] ? bound[i] - parallelbound[i] 
+                                                     : parallelbound[i] - bound[i];
+        parallelbound[i] = bound[i];
+    }
+    parallelrebalances++;
+    
+    // halve the history so the bands follow activity as it moves
+    for(t=0;t<tiles;t++) paralleltileload[t] /= 2;
+}
+#endif
+
+#if BATCH
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void batch(void) {
+    
+    pthread_t   threads[BATCHTHREADS];          // one thread per range
+    bstruct     jobs[BATCHTHREADS];             // their ranges and sums
+    long long   *histogram, samples = 0, flips = 0, attempts = 0;
+    long long   sumc = 0, sumc2 = 0, sumv = 0, sumv2 = 0;
+    double      meanc, meanv, weight;
+    int         i, k, ok, type, old[4], positions = nrows * ncols;
+    FILE        *data;
+    char        name[512];
+    
+    if(DOMAIN || INHOMOGENEOUS || SCHEDULE) {
+        printf("*** batched lattices need the whole matrix and fixed homogeneous weights\n");
+        return;
+    }
+    
+    // the acceptance of a flip only depends on the four old types,
+    // so it is looked up rather than worked out per attempt
+    for(type=0;type<2;type++) {
+        for(i=0;i<6*6*6*6;i++) {
+            old[0] = i / 216;
+            old[1] = i / 36 % 6;
+            old[2] = i / 6 % 6;
+            old[3] = i % 6;
+            batchchance[type][i] = 0;
+            if(type ? !((old[0]==0 || old[0]==5) && (old[3]==1 || old[3]==5))
+                    : !((old[0]==0 || old[0]==4) && (old[3]==1 || old[3]==4))) continue;
+            weight = 1;
+            for(k=0;k<4;k++) weight *= wts[flipmap[type][k][old[k]]];
+            batchchance[type][i] = weight / rho;
+        }
+    }
+    
+    // copies lie one after another in one arena, each with a stream
+    // that depends on the seed and its number only
+    batcharena = malloc((size_t) BATCHLATTICES * positions);
+    batchrng = malloc(sizeof(unsigned long long) * BATCHLATTICES);
+    histogram = calloc(positions + 1, sizeof(long long));
+    ok = batcharena != NULL && batchrng != NULL && histogram != NULL;
+    for(i=0;i<BATCHTHREADS;i++) {
+        jobs[i].histogram = calloc(positions + 1, sizeof(long long));
+        ok = ok && jobs[i].histogram != NULL;
+    }
+    if(!ok) {
+        printf("*** error allocating %d batched copies\n", BATCHLATTICES);
+        for(i=0;i<BATCHTHREADS;i++) free(jobs[i].histogram);
+        free(histogram);
+        free(batcharena);
+        free(batchrng);
+        return;
+    }
+    for(i=0;i<BATCHLATTICES;i++) {
+        loadplane(batcharena + (size_t) i * positions, matrix);
+        batchrng[i] = runseed ^ (unsigned long long) i;
+        batchrng[i] = rngnext(&batchrng[i]);
+    }
+    
+    printf("Batch: %d copies of %dx%d for %d sweeps on %d threads\n",
+           BATCHLATTICES, nrows, ncols, BATCHSWEEPS, BATCHTHREADS);
+    #if PIN
+    pinplan("batch", BATCHPLACE, BATCHTHREADS);
+    #endif
+    
+    for(i=0;i<BATCHTHREADS;i++) {
+        jobs[i].id = i;
+        jobs[i].lo = (int) ((long long) BATCHLATTICES * i / BATCHTHREADS);
+        jobs[i].hi = (int) ((long long) BATCHLATTICES * (i+1) / BATCHTHREADS);
+        pthread_create(&threads[i], NULL, batchrange, &jobs[i]);
+    }
+    
+    // integer sums, so the totals do not depend on the threads
+    for(i=0;i<BATCHTHREADS;i++) {
+        pthread_join(threads[i], NULL);
+        flips += jobs[i].flipcompleted;
+        attempts += jobs[i].attempts;
+        samples += jobs[i].samples;
+        sumc += jobs[i].sumc;
+        sumc2 += jobs[i].sumc2;
+        sumv += jobs[i].sumv;
+        sumv2 += jobs[i].sumv2;
+        for(k=0;k<=positions;k++) histogram[k] += jobs[i].histogram[k];
+        free(jobs[i].histogram);
+    }
+    
+    meanc = samples ? (double) sumc / samples : 0;
+    meanv = samples ? (double) sumv / samples : 0;
+    
+    printf("Samples: %lld\n", samples);
+    printf("Flips completed: %lld of %lld attempts\n", flips, attempts);
+    printf("c-density: %lf\n", meanc / positions);
+    printf("Volume: %lf\n", meanv);
+    
+    // moments and the c-vertex histogram; errors are left to the
+    // reader, since successive measurements of a copy are correlated
+    sprintf(name,"%s/%s/summary",outputdir,PRINT_BATCH);
+    if((data = sinkopen(name,"w"))!=NULL) {
+        fprintf(data, "copies %d\nsize %dx%d\n", BATCHLATTICES, nrows, ncols);
+        fprintf(data, "sweeps %d\nthermalisation %d\nmeasure every %d\n",
+                BATCHSWEEPS, BATCHTHERMAL, BATCHMEASURE);
+        fprintf(data, "seed %llu\nsamples %lld\n", runseed, samples);
+        fprintf(data, "flips %lld\nattempts %lld\n", flips, attempts);
+        fprintf(data, "c-count %lf %lf\n", meanc,
+                samples ? (double) sumc2 / samples - meanc * meanc : 0);
+        fprintf(data, "volume %lf %lf\n", meanv,
+                samples ? (double) sumv2 / samples - meanv * meanv : 0);
+        sinkclose(data);
+    }
+    
+    sprintf(name,"%s/%s/c-count.histogram",outputdir,PRINT_BATCH);
+    if((data = sinkopen(name,"w"))!=NULL) {
+        for(k=0;k<=positions;k++) 
+            if(histogram[k]) fprintf(data, "%d %lld\n", k, histogram[k]);
+        sinkclose(data);
+    }
+    
+    free(histogram);
+    free(batcharena);
+    free(batchrng);
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void *batchrange(void *arg) {
+    
+    bstruct *job = (bstruct *) arg;
+    unsigned char *t;
+    unsigned long long z;
+    long long   positions = (long long) nrows * ncols;
+    double  u, ph, pl;
+    int     block, end, b, n, s, r, c, rh, ch, rl, cl, high, low, type;
+    
+    #if PIN
+    pinthread(job->id);
     #endif
     
-    if(*type) {
-        // base: If vertex was a1, it will be c1; if it was c2, it will be a2
-        #if DEBUG
-            printf("base position is %d\n",matrix[*rpos][*cpos].type);
-        #endif
-        
-        if(matrix[*rpos][*cpos].type == 0) {
-            #if DEBUG
-                printf("Updating base position on up flip1\n");
-            #endif
-            
-            matrix[*rpos][*cpos].type = 4;
-        }
-        if(matrix[*rpos][*cpos].type == 5) {
-            #if DEBUG
-                printf("Updating base position on up flip1\n");
-            #endif
-            
-            matrix[*rpos][*cpos].type = 1;
-        }
-        
-        //up right: If vertex was a2, it will be c1; if it was c2, it will be a1
-        if(matrix[*rpos-1][*cpos+1].type == 1) {
-            #if DEBUG
-                printf("Updating up right position on up flip2\n");
-            #endif
-            
-            matrix[*rpos-1][*cpos+1].type =  4;
-        }
-        if(matrix[*rpos-1][*cpos+1].type == 5) {
-            #if DEBUG
-                printf("Updating up right position on up flip2\n");
-            #endif
-            
-            matrix[*rpos-1][*cpos+1].type =  0;
-        }
-        
-        // right: If vertex was b2, it will be c2; if it was c1, it will be b1 
-        if(matrix[*rpos][*cpos+1].type == 3) {
-            #if DEBUG
-                printf("Updating right position on up flip3\n");
-            #endif
-            
-            matrix[*rpos][*cpos+1].type =  5;
-        }
-        if(matrix[*rpos][*cpos+1].type == 4) {
-            #if DEBUG
-                printf("Updating right position on up flip3\n");
-            #endif
-            
-            matrix[*rpos][*cpos+1].type =  2;
-        }
+    job->flipcompleted = 0;
+    job->attempts = 0;
+    job->samples = 0;
+    job->sumc = job->sumc2 = job->sumv = job->sumv2 = 0;
+    
+    // a block of copies is stepped side by side: the attempts are
+    // independent, so they overlap in the pipeline, and the block's
+    // planes stay in cache for the whole sweep
+    for(block=job->lo;block<job->hi;block+=BATCHBLOCK) {
+        end = block + BATCHBLOCK < job->hi ? block + BATCHBLOCK : job->hi;
         
-        // up: If vertex was b1, it will be c2; if it was c1, it will be b2
-        if(matrix[*rpos-1][*cpos].type == 2){
-            #if DEBUG
-                printf("Updating up position on up flip4\n");
-            #endif
+        for(s=0;s<BATCHSWEEPS;s++) {
+            for(n=0;n<positions;n++) {
+                for(b=block;b<end;b++) {
+                    t = batcharena + (size_t) b * positions;
+                    
+                    // one draw for the position, one for the choice
+                    z = rngnext(&batchrng[b]);
+                    r = (int) (((z >> 32) * nrows) >> 32);
+                    c = (int) (((z & 0xFFFFFFFFULL) * ncols) >> 32);
+                    u = rnguniform(&batchrng[b]);
+                    
+                    // same high, low and biflip choice as the main
+                    // loop, with out of bounds flips given no chance
+                    high = HIGHINBOUNDS(r,c);
+                    rh = high ? ROWUP(r) : r;
+                    ch = high ? COLRIGHT(c) : c;
+                    ph = batchchance[1][((t[r*ncols+c]*6 + t[r*ncols+ch])*6 + t[rh*ncols+c])*6 + t[rh*ncols+ch]];
+                    ph = high ? ph : 0;
+                    
+                    low = LOWINBOUNDS(r,c);
+                    rl = low ? ROWDOWN(r) : r;
+                    cl = low ? COLLEFT(c) : c;
+                    pl = batchchance[0][((t[r*ncols+c]*6 + t[r*ncols+cl])*6 + t[rl*ncols+c])*6 + t[rl*ncols+cl]];
+                    pl = low ? pl : 0;
+                    
+                    if(u < ph + pl) {
+                        type = u < ph;
+                        rh = type ? rh : rl;
+                        ch = type ? ch : cl;
+                        t[r*ncols+c] = flipmap[type][0][t[r*ncols+c]];
+                        t[r*ncols+ch] = flipmap[type][1][t[r*ncols+ch]];
+                        t[rh*ncols+c] = flipmap[type][2][t[rh*ncols+c]];
+                        t[rh*ncols+ch] = flipmap[type][3][t[rh*ncols+ch]];
+                        job->flipcompleted++;
+                    }
+                }
+            }
+            job->attempts += positions * (end - block);
             
-            matrix[*rpos-1][*cpos].type =  5;
+            if(s >= BATCHTHERMAL && (s - BATCHTHERMAL) % BATCHMEASURE == 0) {
+                for(b=block;b<end;b++) batchmeasure(job, batcharena + (size_t) b * positions);
+            }
         }
-        if(matrix[*rpos-1][*cpos].type == 4){
-            #if DEBUG
-                printf("Updating up position on up flip4\n");
-            #endif
-            
-            matrix[*rpos-1][*cpos].type =  3;
+    }
+    
+    return NULL;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void batchmeasure(bstruct *job, unsigned char *t) {
+    
+    long long   count = 0, volume = 0;
+    int     i, j, current;
+    
+    // the volume as setheights works it out
+    for(i=0;i<nrows;i++) {
+        current = 0;
+        for(j=0;j<ncols;j++) {
+            count += t[i*ncols+j] >= 4;
+            current += t[i*ncols+j] == 0 || t[i*ncols+j] == 2 || t[i*ncols+j] == 5;
+            volume += current;
         }
+    }
+    
+    job->samples++;
+    job->sumc += count;
+    job->sumc2 += count * count;
+    job->sumv += volume;
+    job->sumv2 += volume * volume;
+    job->histogram[count]++;
+}
+#endif
+
+#if POOL
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+int parsepool(FILE *data) {
+    
+    pstruct *job;
+    FILE    *plane;
+    char    name[256];
+    int     i, k;
+    
+    // each line: matrix file, rows, cols, six weights, flips to do and
+    // flips between snapshots (0 for none)
+    pooljobs = calloc(MAXPOOLJOBS, sizeof(pstruct));
+    for(k=0;k<MAXPOOLJOBS;k++) {
+        job = &pooljobs[k];
+        if(fscanf(data, "%255s %d %d %lf %lf %lf %lf %lf %lf %lld %lld", name,
+                  &job->rows, &job->cols, &job->w[0], &job->w[1], &job->w[2],
+                  &job->w[3], &job->w[4], &job->w[5], &job->flipstodo,
+                  &job->interval) != 11) break;
         
-    } else {
-        
-        // base: If vertex was c1, it will be a2; if it was a1, it will be c2
-        #if DEBUG
-            printf("base position is %d\n",matrix[*rpos][*cpos].type);
-        #endif
-        
-        if(matrix[*rpos][*cpos].type == 4){
-            #if DEBUG
-                printf("Updating base position on down flip1\n");
-            #endif
-            
-            matrix[*rpos][*cpos].type = 1;
+        // snapshots are built in the sink buffer, sized for the first
+        // matrix, so no chain may be larger
+        if(job->rows < 2 || job->cols < 2 || job->rows * job->cols > nrows * ncols) {
+            printf("*** chain %d is %dx%d, larger than the first matrix\n",
+                   k, job->rows, job->cols);
+            fclose(data);
+            return 1;
         }
-        if(matrix[*rpos][*cpos].type == 0) {
-            #if DEBUG
-                printf("Updating base position on down flip1\n");
-            #endif
-            
-            matrix[*rpos][*cpos].type = 5;
+        if((plane = fopen(name,"r"))==NULL) {
+            printf("*** error opening %s\n", name);
+            fclose(data);
+            return 1;
         }
+        job->chain.type = malloc((size_t) job->rows * job->cols);
+        for(i=0;i<job->rows*job->cols;i++) 
+            job->chain.type[i] = (unsigned char) (fgetc(plane) - '0');
+        fclose(plane);
         
-        // down left: If vertex was c1, it will be a1; if it was a2, it will be c2
-        if(matrix[*rpos+1][*cpos-1].type == 4) {
-            #if DEBUG
-                printf("Updating down left position on down flip2\n");
-            #endif
-            
-            matrix[*rpos+1][*cpos-1].type =  0;}
+        job->rho = computerho(job->w);
+        job->chain.rng = runseed ^ ((unsigned long long) k << 32);
+        job->chain.rng = rngnext(&job->chain.rng);
+        job->nextat = job->interval > 0 ? job->interval : 0x7FFFFFFFFFFFFFFFLL;
+    }
+    fclose(data);
+    
+    pooljobcount = k;
+    return pooljobcount == 0;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void pool(void) {
+    
+    pthread_t   threads[POOLTHREADS];           // the shared threads
+    pstruct     *job;
+    FILE        *data;
+    char        name[512];
+    long long   flips = 0;
+    int         i, k, count;
+    
+    printf("Pool: %d chains on %d threads, %d us slices\n",
+           pooljobcount, POOLTHREADS, POOLSLICE);
+    
+    // every chain starts queued in file order
+    for(k=0;k<pooljobcount;k++) poolqueue[k] = k;
+    poolhead = 0;
+    poolwaiting = pooljobcount;
+    poolactive = pooljobcount;
+    
+    #if PIN
+    pinplan("pool", POOLPLACE, POOLTHREADS);
+    #endif
+    for(i=0;i<POOLTHREADS;i++) pthread_create(&threads[i], NULL, poolthread, (void *) (long) i);
+    for(i=0;i<POOLTHREADS;i++) pthread_join(threads[i], NULL);
+    
+    sprintf(name,"%s/%s/summary",outputdir,PRINT_POOL);
+    data = sinkopen(name,"w");
+    for(k=0;k<pooljobcount;k++) {
+        job = &pooljobs[k];
+        count = 0;
+        for(i=0;i<job->rows*job->cols;i++) count += job->chain.type[i] >= 4;
+        flips += job->chain.flipcompleted;
+        if(data != NULL) 
+            fprintf(data, "%d %dx%d flips %lld failed %lld c-density %lf slices %d time %.0lf us\n",
+                    k, job->rows, job->cols, job->chain.flipcompleted, job->chain.flipfailed,
+                    (double) count / (job->rows * job->cols), job->slices, job->used);
+        free(job->chain.type);
+    }
+    sinkclose(data);
+    sinkflush();
+    free(pooljobs);
+    
+    printf("Flips completed: %lld over %d chains\n", flips, pooljobcount);
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void *poolthread(void *arg) {
+    
+    struct timespec start, now;
+    pstruct *job;
+    double  elapsed;
+    int     k;
+    
+    #if PIN
+    pinthread((int) (long) arg);
+    #endif
+    
+    pthread_mutex_lock(&poollock);
+    while(1==1) {
+        // wait for a chain, or for the last one to stop
+        while(poolwaiting == 0 && poolactive > 0) pthread_cond_wait(&poolwake, &poollock);
+        if(poolactive == 0) break;
+        k = poolqueue[poolhead];
+        poolhead = (poolhead + 1) % MAXPOOLJOBS;
+        poolwaiting--;
+        pthread_mutex_unlock(&poollock);
         
-        if(matrix[*rpos+1][*cpos-1].type == 1) {
-            #if DEBUG
-                printf("Updating down left position on down flip2\n");
-            #endif
-            
-            matrix[*rpos+1][*cpos-1].type =  5;
-        }
+        // the chain keeps the thread for one slice; every chain gets
+        // the same slice in turn, so each gets its share of the time
+        // whatever its size
+        job = &pooljobs[k];
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        do {
+            poolchunk(job, POOLCHUNK);
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            elapsed = (now.tv_sec - start.tv_sec) * 1e6 + (now.tv_nsec - start.tv_nsec) / 1e3;
+        } while(elapsed < POOLSLICE && job->chain.flipcompleted < job->flipstodo);
+        job->used += elapsed;
+        job->slices++;
         
-        // left: If vertex was c2, it will be b1; if it was b2, it will be c1 
-        if(matrix[*rpos][*cpos-1].type == 5) {
-            #if DEBUG
-                printf("Updating left position on down flip3\n");
-            #endif
-            
-            matrix[*rpos][*cpos-1].type =  2;
-        }
-        if(matrix[*rpos][*cpos-1].type == 3) {
-            #if DEBUG
-                printf("Updating left position on down flip3\n");
-            #endif
-            
-            matrix[*rpos][*cpos-1].type =  4;
-        }
+        poolyield(job, k);
         
-        // down: If vertex was c2, it will be b2; if it was b1, it will be c1 
-        if(matrix[*rpos+1][*cpos].type == 5) {
-            #if DEBUG
-                printf("Updating down position on down flip4\n");
-            #endif
-            
-            matrix[*rpos+1][*cpos].type =  3;
-        }
-        if(matrix[*rpos+1][*cpos].type == 2) {
-            #if DEBUG
-                printf("Updating down position on down flip4\n");
-            #endif
-            
-            matrix[*rpos+1][*cpos].type =  4;
+        // back to the end of the queue unless it has stopped
+        pthread_mutex_lock(&poollock);
+        if(job->done) {
+            if(--poolactive == 0) pthread_cond_broadcast(&poolwake);
+        } else {
+            poolqueue[(poolhead + poolwaiting) % MAXPOOLJOBS] = k;
+            poolwaiting++;
+            pthread_cond_signal(&poolwake);
         }
     }
+    pthread_mutex_unlock(&poollock);
+    
+    return NULL;
 }
 
+#endif
+
+#if POOL || DISTRIBUTE
 //==============================================================================
 ////////////////////////////////////********////////////////////////////////////
 //==============================================================================
 
-void updatepositions2(int *rpos, int *cpos, int *type) {
+void poolchunk(pstruct *job, int attempts) {
     
-	#if DEBUG
-        printf("updatepositions2 called - row: %d col: %d type: %d\n",*rpos,*cpos,*type);
-    #endif
+    int     nrows = job->rows, ncols = job->cols;   // the boundary macros
+                                                    //   read these rather
+                                                    //   than the globals
+    cstruct *ch = &job->chain;
+    unsigned char *t = ch->type;
+    double  flipchance[2], random;
+    int     n, rpos, cpos, type, high, low;
     
-    if(*type) {
-        // base: If vertex was a1, it will be c1; if it was c2, it will be a2
-        #if DEBUG
-            printf("base position is %d\n",matrix2[*rpos][*cpos].type);
-        #endif
+    for(n=0;n<attempts && ch->flipcompleted<job->flipstodo;n++) {
+        rpos = (int) (nrows * rnguniform(&ch->rng));
+        cpos = (int) (ncols * rnguniform(&ch->rng));
         
-        if(matrix2[*rpos][*cpos].type == 0) {
-            #if DEBUG
-                printf("Updating base position on up flip1\n");
-            #endif
-            
-            matrix2[*rpos][*cpos].type = 4;
-        }
-        if(matrix2[*rpos][*cpos].type == 5) {
-            #if DEBUG
-                printf("Updating base position on up flip1\n");
-            #endif
-            
-            matrix2[*rpos][*cpos].type = 1;
-        }
+        // as chainisflippable, for this chain's size
+        high = HIGHINBOUNDS(rpos,cpos) &&
+               (t[CELL(rpos,cpos)]==0 || t[CELL(rpos,cpos)]==5) &&
+               (t[CELL(ROWUP(rpos),COLRIGHT(cpos))]==1 || t[CELL(ROWUP(rpos),COLRIGHT(cpos))]==5);
+        low = LOWINBOUNDS(rpos,cpos) &&
+              (t[CELL(rpos,cpos)]==0 || t[CELL(rpos,cpos)]==4) &&
+              (t[CELL(ROWDOWN(rpos),COLLEFT(cpos))]==1 || t[CELL(ROWDOWN(rpos),COLLEFT(cpos))]==4);
+        if(!high && !low) continue;
         
-        //up right: If vertex was a2, it will be c1; if it was c2, it will be a1
-        if(matrix2[*rpos-1][*cpos+1].type == 1) {
-            #if DEBUG
-                printf("Updating up right position on up flip2\n");
-            #endif
-            
-            matrix2[*rpos-1][*cpos+1].type =  4;
-        }
-        if(matrix2[*rpos-1][*cpos+1].type == 5) {
-            #if DEBUG
-                printf("Updating up right position on up flip2\n");
-            #endif
-            
-            matrix2[*rpos-1][*cpos+1].type =  0;
+        // same high, low and biflip choice as chaintry
+        for(type=0;type<2;type++) {
+            flipchance[type] = (type ? high : low) ? 
+                job->w[flipmap[type][0][t[CELL(rpos,cpos)]]] *
+                job->w[flipmap[type][1][t[CELL(rpos,FLIPCOL(cpos,type))]]] *
+                job->w[flipmap[type][2][t[CELL(FLIPROW(rpos,type),cpos)]]] *
+                job->w[flipmap[type][3][t[CELL(FLIPROW(rpos,type),FLIPCOL(cpos,type))]]] / job->rho : 0;
         }
+        random = rnguniform(&ch->rng);
         
-        // right: If vertex was b2, it will be c2; if it was c1, it will be b1 
-        if(matrix2[*rpos][*cpos+1].type == 3) {
-            #if DEBUG
-                printf("Updating right position on up flip3\n");
-            #endif
-            
-            matrix2[*rpos][*cpos+1].type =  5;
-        }
-        if(matrix2[*rpos][*cpos+1].type == 4) {
-            #if DEBUG
-                printf("Updating right position on up flip3\n");
-            #endif
-            
-            matrix2[*rpos][*cpos+1].type =  2;
+        if(high && flipchance[1]>=random) {
+            type = 1;
+        } else if(low && flipchance[1]+flipchance[0]>=random) {
+            type = 0;
+        } else {
+            ch->flipfailed++;
+            continue;
         }
         
-        // up: If vertex was b1, it will be c2; if it was c1, it will be b2
-        if(matrix2[*rpos-1][*cpos].type == 2){
-            #if DEBUG
-                printf("Updating up position on up flip4\n");
-            #endif
-            
-            matrix2[*rpos-1][*cpos].type =  5;
+        t[CELL(rpos,cpos)] = flipmap[type][0][t[CELL(rpos,cpos)]];
+        t[CELL(rpos,FLIPCOL(cpos,type))] = flipmap[type][1][t[CELL(rpos,FLIPCOL(cpos,type))]];
+        t[CELL(FLIPROW(rpos,type),cpos)] = flipmap[type][2][t[CELL(FLIPROW(rpos,type),cpos)]];
+        t[CELL(FLIPROW(rpos,type),FLIPCOL(cpos,type))] = 
+            flipmap[type][3][t[CELL(FLIPROW(rpos,type),FLIPCOL(cpos,type))]];
+        ch->flipcompleted++;
+    }
+}
+#endif
+
+#if POOL
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void poolyield(pstruct *job, int k) {
+    
+    FILE    *data;
+    char    name[512];
+    int     i, count;
+    
+    // the stop hook: a chain stops once it has done its flips
+    if(job->chain.flipcompleted >= job->flipstodo) job->done = 1;
+    if(job->chain.flipcompleted < job->nextat && !job->done) return;
+    
+    // the output hook: a snapshot of the plane and a line in the log
+    // for every interval passed; the sink is not thread safe, so one
+    // chain writes at a time
+    pthread_mutex_lock(&poolsink);
+    
+    count = 0;
+    for(i=0;i<job->rows*job->cols;i++) count += job->chain.type[i] >= 4;
+    
+    sprintf(name,"%s/%s/chain%d-%d.matrix",outputdir,PRINT_POOL,k,job->outputs++);
+    if((data = sinkopen(name,"w"))!=NULL) {
+        for(i=0;i<job->rows*job->cols;i++) fputc('0' + job->chain.type[i], data);
+        sinkclose(data);
+    }
+    
+    sprintf(name,"%s/%s/chains.log",outputdir,PRINT_POOL);
+    if((data = sinkopen(name,"a"))!=NULL) {
+        fprintf(data, "%d %lld %lf %.0lf\n", k, job->chain.flipcompleted,
+                (double) count / (job->rows * job->cols), job->used);
+        sinkclose(data);
+    }
+    
+    pthread_mutex_unlock(&poolsink);
+    
+    while(job->nextat <= job->chain.flipcompleted) job->nextat += job->interval;
+}
+#endif
+
+#if DISTRIBUTE
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+int distcoordinator(int port, char *sweepname) {
+    
+    jstruct *jobs;                              // every run of the sweep
+    struct pollfd   fds[MAXDISTWORKERS+1];      // listener, then workers
+    int     running[MAXDISTWORKERS];            // run of each worker, or -1
+    struct sockaddr_in  address;
+    struct timeval  timeout = { DISTTIMEOUT, 0 };
+    FILE    *data, *plane;
+    char    name[256];
+    int     listener, fd, count, finished = 0, workers = 0;
+    int     i, k, n, one = 1;
+    int     keepidle = DISTKEEPIDLE, keepintvl = DISTKEEPINTVL, keepcnt = DISTKEEPCNT;
+    
+    //------------------------------------------------------------------//
+    //  Sweep setup                                                     //
+    //------------------------------------------------------------------//
+    
+    // each line: matrix file, rows, cols, six weights, seed, flips to
+    // do and a time limit in seconds (0 for none)
+    if((data = fopen(sweepname,"r"))==NULL) {
+        printf("*** error opening sweep file\n");
+        return 0;
+    }
+    jobs = calloc(MAXDISTJOBS, sizeof(jstruct));
+    for(count=0;count<MAXDISTJOBS;count++) {
+        if(fscanf(data, "%255s %d %d %lf %lf %lf %lf %lf %lf %llu %lld %d", name,
+                  &jobs[count].rows, &jobs[count].cols, &jobs[count].w[0], &jobs[count].w[1],
+                  &jobs[count].w[2], &jobs[count].w[3], &jobs[count].w[4], &jobs[count].w[5],
+                  &jobs[count].seed, &jobs[count].flipstodo, &jobs[count].seconds) != 12) break;
+        n = jobs[count].rows * jobs[count].cols;
+        jobs[count].plane = malloc(n);
+        if((plane = fopen(name,"r"))==NULL || (int) fread(jobs[count].plane, 1, n, plane) != n) {
+            printf("*** error reading %s\n", name);
+            return 0;
         }
-        if(matrix2[*rpos-1][*cpos].type == 4){
-            #if DEBUG
-                printf("Updating up position on up flip4\n");
-            #endif
-            
-            matrix2[*rpos-1][*cpos].type =  3;
+        fclose(plane);
+        jobs[count].worker = -1;
+    }
+    fclose(data);
+    
+    if((listener = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        printf("*** error opening socket\n");
+        return 0;
+    }
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+    if(bind(listener, (struct sockaddr *) &address, sizeof(address)) || listen(listener, 16)) {
+        printf("*** error listening on port %d\n", port);
+        return 0;
+    }
+    
+    printf("Coordinating %d runs on port %d\n", count, port);
+    
+    //------------------------------------------------------------------//
+    //  Coordination Loop                                               //
+    //------------------------------------------------------------------//
+    
+    fds[0].fd = listener;
+    fds[0].events = POLLIN;
+    while(finished < count) {
+        // a free worker gets the first run still waiting
+        for(i=0;i<workers;i++) {
+            if(running[i] >= 0) continue;
+            for(k=0;k<count && jobs[k].state != DISTWAITING;k++);
+            if(k == count) break;
+            if(disthandout(fds[i+1].fd, &jobs[k], k)) {
+                fds[i+1].events = 0;            // dropped below
+                continue;
+            }
+            jobs[k].state = DISTRUNNING;
+            jobs[k].worker = i;
+            jobs[k].handouts++;
+            jobs[k].started = time(NULL);
+            running[i] = k;
         }
         
-    } else {
+        poll(fds, workers + 1, 1000);
         
-        // base: If vertex was c1, it will be a2; if it was a1, it will be c2
-        #if DEBUG
-            printf("base position is %d\n",matrix2[*rpos][*cpos].type);
-        #endif
+        if(fds[0].revents & POLLIN) {
+            fd = accept(listener, NULL, NULL);
+            if(fd >= 0 && workers < MAXDISTWORKERS) {
+                // a worker that stalls mid-message times out and is lost
+                setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+                setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+                
+                // a worker sends nothing while it runs, so a host that
+                // dies without closing would hold a run with no time
+                // limit forever; keepalive probes turn its silence into
+                // an error the poll below sees
+                setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+                #ifdef TCP_KEEPIDLE
+                setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &keepidle, sizeof(keepidle));
+                setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &keepintvl, sizeof(keepintvl));
+                setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &keepcnt, sizeof(keepcnt));
+                #endif
+                fds[workers+1].fd = fd;
+                fds[workers+1].events = POLLIN;
+                fds[workers+1].revents = 0;
+                running[workers++] = -1;
+                printf("Worker %d connected\n", workers - 1);
+            } else if(fd >= 0) {
+                close(fd);
+            }
+        }
         
-        if(matrix2[*rpos][*cpos].type == 4){
-            #if DEBUG
-                printf("Updating base position on down flip1\n");
-            #endif
+        for(i=0;i<workers;i++) {
+            k = running[i];
             
-            matrix2[*rpos][*cpos].type = 1;
-        }
-        if(matrix2[*rpos][*cpos].type == 0) {
-            #if DEBUG
-                printf("Updating base position on down flip1\n");
-            #endif
+            if(fds[i+1].events && (fds[i+1].revents & (POLLIN | POLLHUP | POLLERR))) {
+                if(k >= 0 && distcollect(fds[i+1].fd, &jobs[k], k) == 0) {
+                    jobs[k].state = DISTDONE;
+                    running[i] = -1;
+                    finished++;
+                    distwrite(&jobs[k], k);
+                    printf("Run %d done by worker %d (%d/%d): c-density %lf\n",
+                           k, i, finished, count, jobs[k].cdensity);
+                    continue;
+                }
+                fds[i+1].events = 0;
+            }
             
-            matrix2[*rpos][*cpos].type = 5;
+            // a run well past its time limit has lost its worker
+            if(fds[i+1].events && k >= 0 && jobs[k].seconds > 0 && 
+               time(NULL) - jobs[k].started > jobs[k].seconds + DISTGRACE) fds[i+1].events = 0;
+            
+            // lost workers hand their run back to the queue
+            if(fds[i+1].events == 0) {
+                printf("*** worker %d lost%s\n", i, k >= 0 ? ", its run queued again" : "");
+                if(k >= 0) {
+                    jobs[k].state = DISTWAITING;
+                    jobs[k].worker = -1;
+                }
+                close(fds[i+1].fd);
+                fds[i+1] = fds[workers];
+                running[i] = running[workers-1];
+                if(running[i] >= 0) jobs[running[i]].worker = i;
+                workers--;
+                i--;
+            }
         }
+    }
+    
+    for(i=0;i<workers;i++) {
+        netwrite(fds[i+1].fd, "QUIT\n", 5);
+        close(fds[i+1].fd);
+    }
+    close(listener);
+    
+    for(k=0;k<count;k++) free(jobs[k].plane);
+    free(jobs);
+    printf("Sweep finished: %d runs\n", count);
+    return 0;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+int disthandout(int fd, jstruct *job, int k) {
+    
+    char    line[512];
+    int     len;
+    
+    // one header line, then the types as the .matrix text
+    len = sprintf(line, "JOB %d %d %d %.17g %.17g %.17g %.17g %.17g %.17g %llu %lld %d\n",
+                  k, job->rows, job->cols, job->w[0], job->w[1], job->w[2], job->w[3],
+                  job->w[4], job->w[5], job->seed, job->flipstodo, job->seconds);
+    if(netwrite(fd, line, len)) return 1;
+    return netwrite(fd, job->plane, (long long) job->rows * job->cols);
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+int distcollect(int fd, jstruct *job, int k) {
+    
+    char    line[512], *plane;
+    int     id;
+    long long   n = (long long) job->rows * job->cols;
+    
+    // a header line with the counters and observables, then the types
+    if(netline(fd, line, sizeof(line))) return 1;
+    if(sscanf(line, "DONE %d %lld %lld %lf %lf %lf %lf", &id, &job->flipcompleted,
+              &job->flipfailed, &job->elapsed, &job->cdensity, &job->volume,
+              &job->logweight) != 7 || id != k) return 1;
+    
+    // the plane still holds the start state, which a run handed out
+    // again needs whole; it is replaced only once every type arrived
+    if((plane = malloc(n)) == NULL) return 1;
+    if(netread(fd, plane, n)) {
+        free(plane);
+        return 1;
+    }
+    memcpy(job->plane, plane, n);
+    free(plane);
+    return 0;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void distwrite(jstruct *job, int k) {
+    
+    FILE    *data;
+    char    name[512];
+    
+    // the directory a run with these weights would use, so sweeps and
+    // single runs land side by side
+    sprintf(outputdir,"./output/a1=%lf, a2=%lf, b1=%lf, b2=%lf, c1=%lf, c2=%lf, %dx%d",
+            job->w[0],job->w[1],job->w[2],job->w[3],job->w[4],job->w[5],job->cols,job->rows);
+    mkdir("./output", 0777);
+    mkdir(outputdir, 0777);
+    
+    // plain files whatever the sink, so make the directory here;
+    // sinkmkdir leaves it to archives and pipes
+    sprintf(name,"%s/%s",outputdir,PRINT_TEXT);
+    mkdir(name, 0777);
+    
+    // final state named after the seed, since a sweep may repeat weights
+    sprintf(name,"%s/%s/seed%llu.matrix",outputdir,PRINT_TEXT,job->seed);
+    if((data = fopen(name,"w"))==NULL) {
+        printf("*** error writing %s\n", name);
+    } else {
+        fwrite(job->plane, 1, (size_t) job->rows * job->cols, data);
+        fclose(data);
+    }
+    
+    sprintf(name,"%s/matrix.end",outputdir);
+    if((data = fopen(name,"a"))==NULL) {
+        printf("*** error writing %s\n", name);
+        return;
+    }
+    fprintf(data, "\n\nEnd statistics:\n\n");
+    fprintf(data, "Weights:\n");
+    fprintf(data, "a1 = %lf, a2 = %lf\nb1 = %lf, b2 = %lf\nc1 = %lf, c2 = %lf",
+            job->w[0],job->w[1],job->w[2],job->w[3],job->w[4],job->w[5]);
+    fprintf(data, "\n\nSize: %dx%d",job->rows,job->cols);
+    fprintf(data, "\n\nSeed: %llu",job->seed);
+    fprintf(data, "\nSweep run: %d, handed out %d times",k,job->handouts);
+    fprintf(data, "\n\nObservables:\n");
+    fprintf(data, "C-density: %lf\nVolume: %lf\nLog-weight: %lf",
+            job->cdensity,job->volume,job->logweight);
+    fprintf(data, "\n\nAlgorithmic Efficiency:\n");
+    fprintf(data, "Total flips completed: %lld\n",job->flipcompleted);
+    fprintf(data, "Total flips failed:    %lld\n",job->flipfailed);
+    fprintf(data, "\n\nTimers:\n");
+    fprintf(data, "Total time spent in computation (non-cpu): %lf seconds\n\n",job->elapsed);
+    fclose(data);
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+int distworker(char *host, int port) {
+    
+    struct addrinfo hints, *found;
+    struct timespec start, now;
+    pstruct job;
+    char    line[512], service[16];
+    double  elapsed, logw[6];
+    long long   n, count, volume;
+    int     fd, k, i, j, current, seconds;
+    
+    if(DOMAIN || INHOMOGENEOUS) {
+        printf("*** workers need the whole matrix and homogeneous weights\n");
+        return 0;
+    }
+    
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    sprintf(service, "%d", port);
+    if(getaddrinfo(host, service, &hints, &found)) {
+        printf("*** error looking up %s\n", host);
+        return 0;
+    }
+    fd = socket(found->ai_family, found->ai_socktype, found->ai_protocol);
+    if(fd < 0 || connect(fd, found->ai_addr, found->ai_addrlen)) {
+        printf("*** error connecting to %s:%d\n", host, port);
+        freeaddrinfo(found);
+        return 0;
+    }
+    freeaddrinfo(found);
+    
+    while(netline(fd, line, sizeof(line)) == 0 && strncmp(line, "JOB ", 4) == 0) {
+        memset(&job, 0, sizeof(job));
+        if(sscanf(line, "JOB %d %d %d %lf %lf %lf %lf %lf %lf %llu %lld %d", &k,
+                  &job.rows, &job.cols, &job.w[0], &job.w[1], &job.w[2], &job.w[3],
+                  &job.w[4], &job.w[5], &job.chain.rng, &job.flipstodo, &seconds) != 12) break;
+        n = (long long) job.rows * job.cols;
+        job.chain.type = malloc(n);
+        if(netread(fd, (char *) job.chain.type, n)) break;
+        for(i=0;i<n;i++) job.chain.type[i] -= '0';
         
-        // down left: If vertex was c1, it will be a1; if it was a2, it will be c2
-        if(matrix2[*rpos+1][*cpos-1].type == 4) {
-            #if DEBUG
-                printf("Updating down left position on down flip2\n");
-            #endif
-            
-            matrix2[*rpos+1][*cpos-1].type =  0;}
+        // the seed is hashed, as every other stream is
+        job.chain.rng = rngnext(&job.chain.rng);
+        job.rho = computerho(job.w);
         
-        if(matrix2[*rpos+1][*cpos-1].type == 1) {
-            #if DEBUG
-                printf("Updating down left position on down flip2\n");
-            #endif
-            
-            matrix2[*rpos+1][*cpos-1].type =  5;
-        }
+        printf("Run %d: %dx%d for %lld flips\n", k, job.rows, job.cols, job.flipstodo);
         
-        // left: If vertex was c2, it will be b1; if it was b2, it will be c1 
-        if(matrix2[*rpos][*cpos-1].type == 5) {
-            #if DEBUG
-                printf("Updating left position on down flip3\n");
-            #endif
-            
-            matrix2[*rpos][*cpos-1].type =  2;
-        }
-        if(matrix2[*rpos][*cpos-1].type == 3) {
-            #if DEBUG
-                printf("Updating left position on down flip3\n");
-            #endif
-            
-            matrix2[*rpos][*cpos-1].type =  4;
+        // the stop policy: the flips, or the time limit if sooner
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        do {
+            poolchunk(&job, POOLCHUNK);
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+        } while(job.chain.flipcompleted < job.flipstodo && (seconds == 0 || elapsed < seconds));
+        
+        // observables as print_cdensity, setheights and chainlogweight
+        // work them out
+        for(k=0;k<6;k++) logw[k] = job.w[k] > 0 ? log(job.w[k]) : -745.0;
+        count = volume = 0;
+        job.chain.logweight = 0;
+        for(i=0;i<job.rows;i++) {
+            current = 0;
+            for(j=0;j<job.cols;j++) {
+                count += job.chain.type[i*job.cols+j] >= 4;
+                current += job.chain.type[i*job.cols+j] == 0 || job.chain.type[i*job.cols+j] == 2 ||
+                           job.chain.type[i*job.cols+j] == 5;
+                volume += current;
+                job.chain.logweight += logw[job.chain.type[i*job.cols+j]];
+            }
         }
+        for(i=0;i<n;i++) job.chain.type[i] += '0';
         
-        // down: If vertex was c2, it will be b2; if it was b1, it will be c1 
-        if(matrix2[*rpos+1][*cpos].type == 5) {
-            #if DEBUG
-                printf("Updating down position on down flip4\n");
-            #endif
-            
-            matrix2[*rpos+1][*cpos].type =  3;
+        sscanf(line, "JOB %d", &k);
+        j = sprintf(line, "DONE %d %lld %lld %.6lf %.17g %lld %.17g\n", k,
+                    job.chain.flipcompleted, job.chain.flipfailed, elapsed,
+                    (double) count / n, volume, job.chain.logweight);
+        if(netwrite(fd, line, j) || netwrite(fd, (char *) job.chain.type, n)) break;
+        free(job.chain.type);
+        job.chain.type = NULL;
+    }
+    
+    free(job.chain.type);
+    close(fd);
+    return 0;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+int netread(int fd, char *buf, long long len) {
+    
+    long long   got;
+    
+    while(len > 0) {
+        if((got = recv(fd, buf, len, 0)) <= 0) return 1;
+        buf += got;
+        len -= got;
+    }
+    return 0;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+int netwrite(int fd, char *buf, long long len) {
+    
+    long long   put;
+    
+    // a worker gone away is an error, not a SIGPIPE
+    while(len > 0) {
+        if((put = send(fd, buf, len, MSG_NOSIGNAL)) <= 0) return 1;
+        buf += put;
+        len -= put;
+    }
+    return 0;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+int netline(int fd, char *buf, int cap) {
+    
+    int     n = 0;
+    
+    // byte at a time, so nothing past the line is taken off the socket
+    while(n < cap-1) {
+        if(recv(fd, buf + n, 1, 0) != 1) return 1;
+        if(buf[n] == '\n') break;
+        n++;
+    }
+    buf[n] = '\0';
+    return 0;
+}
+#endif
+
+#if ANNEAL
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void anneal(void) {
+    
+    pthread_t   threads[ANNEALCHAINS];          // one thread per restart
+    astruct     *jobs;                          // the restarts
+    double      wmax = 0, beta, logw[6];
+    int         i, k, s, best = 0;
+    unsigned long long seed;
+    long long   flips = 0, fails = 0;
+    FILE        *data;
+    char        name[512];
+    
+    // effective weights (w/wmax)^beta from beta=1 to ANNEALBETA, on a
+    // geometric schedule; stop early if rho underflows
+    for(k=0;k<6;k++) if(wts[k]>wmax) wmax = wts[k];
+    for(s=0;s<ANNEALSWEEPS;s++) {
+        beta = exp(log(ANNEALBETA) * s / (ANNEALSWEEPS>1 ? ANNEALSWEEPS-1 : 1));
+        for(k=0;k<6;k++) annealwts[s][k] = pow(wts[k]/wmax, beta);
+        annealrho[s] = computerho(annealwts[s]);
+        if(!(annealrho[s] > 0) || !isfinite(annealrho[s])) break;
+        annealstages++;
+    }
+    getlogweights(logw);
+    
+    printf("Annealing %d restarts over %d sweeps (beta 1 to %lf)\n",
+           ANNEALCHAINS, annealstages, ANNEALBETA);
+    
+    // every plane is in hand before any restart starts
+    if((jobs = calloc(ANNEALCHAINS, sizeof(astruct))) == NULL) {
+        printf("*** error allocating annealing restarts\n");
+        return;
+    }
+    for(i=0;i<ANNEALCHAINS;i++) {
+        jobs[i].chain.type = malloc(chainsize);
+        jobs[i].best = malloc(chainsize);
+        if(jobs[i].chain.type == NULL || jobs[i].best == NULL) {
+            printf("*** error allocating annealing restarts\n");
+            for(k=0;k<=i;k++) {
+                free(jobs[k].chain.type);
+                free(jobs[k].best);
+            }
+            free(jobs);
+            return;
         }
-        if(matrix2[*rpos+1][*cpos].type == 2) {
-            #if DEBUG
-                printf("Updating down position on down flip4\n");
-            #endif
-            
-            matrix2[*rpos+1][*cpos].type =  4;
+    }
+    seed = runseed;
+    
+    #if PIN
+    pinplan("anneal", ANNEALPLACE, ANNEALCHAINS);
+    #endif
+    
+    // every restart starts from the parsed first matrix
+    for(i=0;i<ANNEALCHAINS;i++) {
+        jobs[i].id = i;
+        loadplane(jobs[i].chain.type, matrix);
+        jobs[i].chain.logweight = chainlogweight(jobs[i].chain.type, logw);
+        jobs[i].chain.rng = rngnext(&seed);     // hashed, so streams don't overlap
+        jobs[i].chain.flipcompleted = 0;
+        jobs[i].chain.flipfailed = 0;
+        memcpy(jobs[i].best, jobs[i].chain.type, chainsize);
+        jobs[i].bestlogweight = jobs[i].chain.logweight;
+        pthread_create(&threads[i], NULL, annealchain, &jobs[i]);
+    }
+    
+    for(i=0;i<ANNEALCHAINS;i++) {
+        pthread_join(threads[i], NULL);
+        printf("Restart %d: best log-weight %lf\n", i, jobs[i].bestlogweight);
+        if(jobs[i].bestlogweight > jobs[best].bestlogweight) best = i;
+        flips += jobs[i].chain.flipcompleted;
+        fails += jobs[i].chain.flipfailed;
+    }
+    
+    printf("\nMost probable state found by restart %d\n", best);
+    printf("Log-weight: %lf\n", jobs[best].bestlogweight);
+    printf("Total flips completed: %lld\n", flips);
+    printf("Total flips failed:    %lld\n", fails);
+    
+    // write the best state in the same format as print_text
+    sprintf(name,"%s/%s/best.matrix",outputdir,PRINT_ANNEAL);
+    if((data = sinkopen(name,"w"))!=NULL) {
+        writeplane(data, jobs[best].best);
+        sinkclose(data);
+    }
+    
+    sprintf(name,"%s/%s/best.weight",outputdir,PRINT_ANNEAL);
+    if((data = sinkopen(name,"a"))!=NULL) {
+        fprintf(data, "%lf\n", jobs[best].bestlogweight);
+        sinkclose(data);
+    }
+    
+    for(i=0;i<ANNEALCHAINS;i++) {
+        free(jobs[i].chain.type);
+        free(jobs[i].best);
+    }
+    free(jobs);
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void *annealchain(void *arg) {
+    
+    astruct *job = (astruct *) arg;
+    double  logw[6];
+    long long   n, attempts = (long long) chainsites;
+    int     s;
+    
+    #if PIN
+    pinthread(job->id);
+    #endif
+    
+    getlogweights(logw);
+    
+    for(s=0;s<annealstages;s++) {
+        for(n=0;n<attempts;n++) {
+            // the log-weight is kept up to date by every flip, so the
+            // running maximum costs a compare per flip; the plane is
+            // copied only when a new maximum is reached
+            if(chainattempt(&job->chain, annealwts[s], annealrho[s], logw) &&
+               job->chain.logweight > job->bestlogweight) {
+                job->bestlogweight = job->chain.logweight;
+                memcpy(job->best, job->chain.type, chainsize);
+            }
         }
     }
+    
+    // finish at zero temperature
+    annealdescent(&job->chain, logw);
+    if(job->chain.logweight > job->bestlogweight) {
+        job->bestlogweight = job->chain.logweight;
+        memcpy(job->best, job->chain.type, chainsize);
+    }
+    
+    return NULL;
 }
 
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+int annealdescent(cstruct *ch, double *logw) {
+    
+    int     i, j, type, changed = 1, total = 0;
+    double  delta;
+    
+    // sweep every plaquette move until none raises the weight
+    while(changed) {
+        changed = 0;
+        for(i=0;i<nrows;i++) {
+            for(j=0;j<ncols;j++) {
+                for(type=0;type<2;type++) {
+                    if(!chainisflippable(ch->type, i, j, type)) continue;
+                    delta = chainflipdelta(ch->type, i, j, type, logw);
+                    if(delta > 1e-12) {
+                        ch->logweight += delta;
+                        chainupdate(ch->type, i, j, type);
+                        ch->flipcompleted++;
+                        changed = 1;
+                        total++;
+                    }
+                }
+            }
+        }
+    }
+    
+    return total;
+}
+#endif
 
+#if VITERBI
 //==============================================================================
 ////////////////////////////////////********////////////////////////////////////
 //==============================================================================
 
-double definerho(void) {
+void viterbi(void) {
     
-    // down normal flip possibilities 
-    if(rho<(wts[1]*wts[4]*wts[5]*wts[4])) rho = wts[1]*wts[4]*wts[5]*wts[4];
-    if(rho<(wts[1]*wts[4]*wts[5]*wts[3])) rho = wts[1]*wts[4]*wts[5]*wts[3];
-    if(rho<(wts[1]*wts[4]*wts[0]*wts[4])) rho = wts[1]*wts[4]*wts[0]*wts[4];
-    if(rho<(wts[1]*wts[4]*wts[0]*wts[3])) rho = wts[1]*wts[4]*wts[0]*wts[3];
-    if(rho<(wts[1]*wts[2]*wts[5]*wts[4])) rho = wts[1]*wts[2]*wts[5]*wts[4];
-    if(rho<(wts[1]*wts[2]*wts[5]*wts[3])) rho = wts[1]*wts[2]*wts[5]*wts[3];
-    if(rho<(wts[1]*wts[2]*wts[0]*wts[4])) rho = wts[1]*wts[2]*wts[0]*wts[4];
-    if(rho<(wts[1]*wts[2]*wts[0]*wts[3])) rho = wts[1]*wts[2]*wts[0]*wts[3];
+    pthread_t   threads[VITERBITHREADS];        // state expansion threads
+    vstruct     jobs[VITERBITHREADS];           // their ranges
+    int         nstates, steps, i, j, step, r, c, idx, v, edges;
+    double      best;
+    unsigned char *result;
+    FILE        *data;
+    char        name[512];
     
-    // up normal flip possibilities
-    if(rho<(wts[1]*wts[3]*wts[4]*wts[5])) rho = wts[1]*wts[3]*wts[4]*wts[5];
-    if(rho<(wts[1]*wts[3]*wts[4]*wts[2])) rho = wts[1]*wts[3]*wts[4]*wts[2];
-    if(rho<(wts[1]*wts[3]*wts[0]*wts[5])) rho = wts[1]*wts[3]*wts[0]*wts[5];
-    if(rho<(wts[1]*wts[3]*wts[0]*wts[2])) rho = wts[1]*wts[3]*wts[0]*wts[2];
-    if(rho<(wts[1]*wts[5]*wts[4]*wts[5])) rho = wts[1]*wts[5]*wts[4]*wts[5];
-    if(rho<(wts[1]*wts[5]*wts[4]*wts[2])) rho = wts[1]*wts[5]*wts[4]*wts[2];
-    if(rho<(wts[1]*wts[5]*wts[0]*wts[5])) rho = wts[1]*wts[5]*wts[0]*wts[5];
-    if(rho<(wts[1]*wts[5]*wts[0]*wts[2])) rho = wts[1]*wts[5]*wts[0]*wts[2];
+    if(BOUNDARY != FIXED || DOMAIN || INHOMOGENEOUS || SCHEDULE) {
+        printf("*** transfer matrix solver needs a FIXED boundary, no DOMAIN\n");
+        printf("    and fixed homogeneous weights\n");
+        return;
+    }
+    if(ncols > VITERBIMAXCOLS) {
+        printf("*** transfer matrix solver takes at most %d columns\n",VITERBIMAXCOLS);
+        return;
+    }
     
-    // biflip possibilities 
-    if(rho<(wts[5]*wts[4]*wts[5]*wts[4] + wts[4]*wts[3]*wts[4]*wts[5])) 
-      rho = wts[5]*wts[4]*wts[5]*wts[4] + wts[4]*wts[3]*wts[4]*wts[5];
-    if(rho<(wts[5]*wts[4]*wts[5]*wts[4] + wts[4]*wts[3]*wts[4]*wts[2])) 
-      rho = wts[5]*wts[4]*wts[5]*wts[4] + wts[4]*wts[3]*wts[4]*wts[2];
-    if(rho<(wts[5]*wts[4]*wts[5]*wts[4] + wts[4]*wts[3]*wts[0]*wts[5])) 
-      rho = wts[5]*wts[4]*wts[5]*wts[4] + wts[4]*wts[3]*wts[0]*wts[5];
-    if(rho<(wts[5]*wts[4]*wts[5]*wts[4] + wts[4]*wts[3]*wts[0]*wts[2])) 
-      rho = wts[5]*wts[4]*wts[5]*wts[4] + wts[4]*wts[3]*wts[0]*wts[2];
-    if(rho<(wts[5]*wts[4]*wts[5]*wts[4] + wts[4]*wts[5]*wts[4]*wts[5]))
-      rho = wts[5]*wts[4]*wts[5]*wts[4] + wts[4]*wts[5]*wts[4]*wts[5];
-    if(rho<(wts[5]*wts[4]*wts[5]*wts[4] + wts[4]*wts[5]*wts[4]*wts[2])) 
-      rho = wts[5]*wts[4]*wts[5]*wts[4] + wts[4]*wts[5]*wts[4]*wts[2];
-    if(rho<(wts[5]*wts[4]*wts[5]*wts[4] + wts[4]*wts[5]*wts[1]*wts[5])) 
-      rho = wts[5]*wts[4]*wts[5]*wts[4] + wts[4]*wts[5]*wts[1]*wts[5];
-    if(rho<(wts[5]*wts[4]*wts[5]*wts[4] + wts[4]*wts[5]*wts[1]*wts[2])) 
-      rho = wts[5]*wts[4]*wts[5]*wts[4] + wts[4]*wts[5]*wts[1]*wts[2];
+    nstates = 1 << (ncols+1);
+    steps = nrows * ncols;
     
-    // 2
-    if(rho<(wts[5]*wts[4]*wts[5]*wts[3] + wts[4]*wts[3]*wts[4]*wts[5])) 
-      rho = wts[5]*wts[4]*wts[5]*wts[3] + wts[4]*wts[3]*wts[4]*wts[5];
-    if(rho<(wts[5]*wts[4]*wts[5]*wts[3] + wts[4]*wts[3]*wts[4]*wts[2]))
-      rho = wts[5]*wts[4]*wts[5]*wts[3] + wts[4]*wts[3]*wts[4]*wts[2];
-    if(rho<(wts[5]*wts[4]*wts[5]*wts[3] + wts[4]*wts[3]*wts[0]*wts[5])) 
-      rho = wts[5]*wts[4]*wts[5]*wts[3] + wts[4]*wts[3]*wts[0]*wts[5];
-    if(rho<(wts[5]*wts[4]*wts[5]*wts[3] + wts[4]*wts[3]*wts[0]*wts[2])) 
-      rho = wts[5]*wts[4]*wts[5]*wts[3] + wts[4]*wts[3]*wts[0]*wts[2];
-    if(rho<(wts[5]*wts[4]*wts[5]*wts[3] + wts[4]*wts[5]*wts[4]*wts[5])) 
-      rho = wts[5]*wts[4]*wts[5]*wts[3] + wts[4]*wts[5]*wts[4]*wts[5];
-    if(rho<(wts[5]*wts[4]*wts[5]*wts[3] + wts[4]*wts[5]*wts[4]*wts[2])) 
-      rho = wts[5]*wts[4]*wts[5]*wts[3] + wts[4]*wts[5]*wts[4]*wts[2];
-    if(rho<(wts[5]*wts[4]*wts[5]*wts[3] + wts[4]*wts[5]*wts[1]*wts[5])) 
-      rho = wts[5]*wts[4]*wts[5]*wts[3] + wts[4]*wts[5]*wts[1]*wts[5];
-    if(rho<(wts[5]*wts[4]*wts[5]*wts[3] + wts[4]*wts[5]*wts[1]*wts[2])) 
-      rho = wts[5]*wts[4]*wts[5]*wts[3] + wts[4]*wts[5]*wts[1]*wts[2];
+    // the boundary is whatever the first matrix was loaded with
+    viterbitop = 0;
+    viterbibottom = 0;
+    for(j=0;j<ncols;j++) {
+        if(vertexedges[matrix[0][j].type] & 2) viterbitop |= 1 << j;
+        if(vertexedges[matrix[nrows-1][j].type] & 8) viterbibottom |= 1 << j;
+    }
+    for(i=0;i<nrows;i++) {
+        viterbileft[i] = vertexedges[matrix[i][0].type] & 1;
+        viterbiright[i] = (vertexedges[matrix[i][ncols-1].type] >> 2) & 1;
+    }
+    getlogweights(viterbilogw);
+    
+    viterbiscore[0] = malloc(sizeof(double) * nstates);
+    viterbiscore[1] = malloc(sizeof(double) * nstates);
+    viterbichoice = malloc((size_t) steps * nstates);
+    if(viterbiscore[0]==NULL || viterbiscore[1]==NULL || viterbichoice==NULL) {
+        printf("*** error allocating transfer matrix tables\n");
+        viterbifree();
+        return;
+    }
     
-    // 3
-    if(rho<(wts[5]*wts[4]*wts[0]*wts[4] + wts[4]*wts[3]*wts[4]*wts[5])) 
-      rho = wts[5]*wts[4]*wts[0]*wts[4] + wts[4]*wts[3]*wts[4]*wts[5];
-    if(rho<(wts[5]*wts[4]*wts[0]*wts[4] + wts[4]*wts[3]*wts[4]*wts[2])) 
-      rho = wts[5]*wts[4]*wts[0]*wts[4] + wts[4]*wts[3]*wts[4]*wts[2];
-    if(rho<(wts[5]*wts[4]*wts[0]*wts[4] + wts[4]*wts[3]*wts[0]*wts[5])) 
-      rho = wts[5]*wts[4]*wts[0]*wts[4] + wts[4]*wts[3]*wts[0]*wts[5];
-    if(rho<(wts[5]*wts[4]*wts[0]*wts[4] + wts[4]*wts[3]*wts[0]*wts[2])) 
-      rho = wts[5]*wts[4]*wts[0]*wts[4] + wts[4]*wts[3]*wts[0]*wts[2];
-    if(rho<(wts[5]*wts[4]*wts[0]*wts[4] + wts[4]*wts[5]*wts[4]*wts[5])) 
-      rho = wts[5]*wts[4]*wts[0]*wts[4] + wts[4]*wts[5]*wts[4]*wts[5];
-    if(rho<(wts[5]*wts[4]*wts[0]*wts[4] + wts[4]*wts[5]*wts[4]*wts[2])) 
-      rho = wts[5]*wts[4]*wts[0]*wts[4] + wts[4]*wts[5]*wts[4]*wts[2];
-    if(rho<(wts[5]*wts[4]*wts[0]*wts[4] + wts[4]*wts[5]*wts[1]*wts[5])) 
-      rho = wts[5]*wts[4]*wts[0]*wts[4] + wts[4]*wts[5]*wts[1]*wts[5];
-    if(rho<(wts[5]*wts[4]*wts[0]*wts[4] + wts[4]*wts[5]*wts[1]*wts[2])) 
-      rho = wts[5]*wts[4]*wts[0]*wts[4] + wts[4]*wts[5]*wts[1]*wts[2];
+    printf("Solving %dx%d exactly over %d profile states on %d threads\n",
+           nrows, ncols, nstates, VITERBITHREADS);
     
-    // 4
-    if(rho<(wts[5]*wts[4]*wts[0]*wts[3] + wts[4]*wts[3]*wts[4]*wts[5])) 
-      rho = wts[5]*wts[4]*wts[0]*wts[3] + wts[4]*wts[3]*wts[4]*wts[5];
-    if(rho<(wts[5]*wts[4]*wts[0]*wts[3] + wts[4]*wts[3]*wts[4]*wts[2])) 
-      rho = wts[5]*wts[4]*wts[0]*wts[3] + wts[4]*wts[3]*wts[4]*wts[2];
-    if(rho<(wts[5]*wts[4]*wts[0]*wts[3] + wts[4]*wts[3]*wts[0]*wts[5])) 
-      rho = wts[5]*wts[4]*wts[0]*wts[3] + wts[4]*wts[3]*wts[0]*wts[5];
-    if(rho<(wts[5]*wts[4]*wts[0]*wts[3] + wts[4]*wts[3]*wts[0]*wts[2])) 
-      rho = wts[5]*wts[4]*wts[0]*wts[3] + wts[4]*wts[3]*wts[0]*wts[2];
-    if(rho<(wts[5]*wts[4]*wts[0]*wts[3] + wts[4]*wts[5]*wts[4]*wts[5])) 
-      rho = wts[5]*wts[4]*wts[0]*wts[3] + wts[4]*wts[5]*wts[4]*wts[5];
-    if(rho<(wts[5]*wts[4]*wts[0]*wts[3] + wts[4]*wts[5]*wts[4]*wts[2])) 
-      rho = wts[5]*wts[4]*wts[0]*wts[3] + wts[4]*wts[5]*wts[4]*wts[2];
-    if(rho<(wts[5]*wts[4]*wts[0]*wts[3] + wts[4]*wts[5]*wts[1]*wts[5])) 
-      rho = wts[5]*wts[4]*wts[0]*wts[3] + wts[4]*wts[5]*wts[1]*wts[5];
-    if(rho<(wts[5]*wts[4]*wts[0]*wts[3] + wts[4]*wts[5]*wts[1]*wts[2])) 
-      rho = wts[5]*wts[4]*wts[0]*wts[3] + wts[4]*wts[5]*wts[1]*wts[2];
+    // each thread pulls into its own range of target states, so the
+    // expansion needs no locks, only a barrier between cells
+    #if PIN
+    pinplan("viterbi", VITERBIPLACE, VITERBITHREADS);
+    #endif
+    pthread_barrier_init(&viterbibarrier, NULL, VITERBITHREADS);
+    for(i=0;i<VITERBITHREADS;i++) {
+        jobs[i].id = i;
+        jobs[i].lo = (int) ((long long) nstates * i / VITERBITHREADS);
+        jobs[i].hi = (int) ((long long) nstates * (i+1) / VITERBITHREADS);
+        pthread_create(&threads[i], NULL, viterbirange, &jobs[i]);
+    }
+    for(i=0;i<VITERBITHREADS;i++) pthread_join(threads[i], NULL);
+    pthread_barrier_destroy(&viterbibarrier);
+    
+    idx = (viterbibottom << 1) | viterbiright[nrows-1];
+    best = viterbiscore[steps & 1][idx];
+    if(best == -HUGE_VAL) {
+        printf("*** no configuration fits the boundary\n");
+        viterbifree();
+        return;
+    }
     
-    // 5
-    if(rho<(wts[5]*wts[2]*wts[5]*wts[4] + wts[4]*wts[3]*wts[4]*wts[5])) 
-      rho = wts[5]*wts[2]*wts[5]*wts[4] + wts[4]*wts[3]*wts[4]*wts[5];
-    if(rho<(wts[5]*wts[2]*wts[5]*wts[4] + wts[4]*wts[3]*wts[4]*wts[2])) 
-      rho = wts[5]*wts[2]*wts[5]*wts[4] + wts[4]*wts[3]*wts[4]*wts[2];
-    if(rho<(wts[5]*wts[2]*wts[5]*wts[4] + wts[4]*wts[3]*wts[0]*wts[5])) 
-      rho = wts[5]*wts[2]*wts[5]*wts[4] + wts[4]*wts[3]*wts[0]*wts[5];
-    if(rho<(wts[5]*wts[2]*wts[5]*wts[4] + wts[4]*wts[3]*wts[0]*wts[2])) 
-      rho = wts[5]*wts[2]*wts[5]*wts[4] + wts[4]*wts[3]*wts[0]*wts[2];
-    if(rho<(wts[5]*wts[2]*wts[5]*wts[4] + wts[4]*wts[5]*wts[4]*wts[5])) 
-      rho = wts[5]*wts[2]*wts[5]*wts[4] + wts[4]*wts[5]*wts[4]*wts[5];
-    if(rho<(wts[5]*wts[2]*wts[5]*wts[4] + wts[4]*wts[5]*wts[4]*wts[2])) 
-      rho = wts[5]*wts[2]*wts[5]*wts[4] + wts[4]*wts[5]*wts[4]*wts[2];
-    if(rho<(wts[5]*wts[2]*wts[5]*wts[4] + wts[4]*wts[5]*wts[1]*wts[5])) 
-      rho = wts[5]*wts[2]*wts[5]*wts[4] + wts[4]*wts[5]*wts[1]*wts[5];
-    if(rho<(wts[5]*wts[2]*wts[5]*wts[4] + wts[4]*wts[5]*wts[1]*wts[2])) 
-      rho = wts[5]*wts[2]*wts[5]*wts[4] + wts[4]*wts[5]*wts[1]*wts[2];
+    // walk the stored choices back from the bottom boundary
+    if((result = malloc(steps)) == NULL) {
+        printf("*** error allocating the optimal state\n");
+        viterbifree();
+        return;
+    }
+    for(step=steps-1;step>=0;step--) {
+        r = step / ncols;
+        c = step % ncols;
+        v = viterbichoice[(size_t) step * nstates + idx];
+        result[step] = (unsigned char) v;
+        edges = vertexedges[v];
+        idx >>= 1;
+        idx = (idx & ~(1 << c)) | (((edges >> 1) & 1) << c);
+        if(c==0) idx = (idx << 1) | (r>0 ? viterbiright[r-1] : 0);
+        else idx = (idx << 1) | (edges & 1);
+    }
     
-    // 6
-    if(rho<(wts[5]*wts[2]*wts[5]*wts[3] + wts[4]*wts[3]*wts[4]*wts[5])) 
-      rho = wts[5]*wts[2]*wts[5]*wts[3] + wts[4]*wts[3]*wts[4]*wts[5];
-    if(rho<(wts[5]*wts[2]*wts[5]*wts[3] + wts[4]*wts[3]*wts[4]*wts[2])) 
-      rho = wts[5]*wts[2]*wts[5]*wts[3] + wts[4]*wts[3]*wts[4]*wts[2];
-    if(rho<(wts[5]*wts[2]*wts[5]*wts[3] + wts[4]*wts[3]*wts[0]*wts[5])) 
-      rho = wts[5]*wts[2]*wts[5]*wts[3] + wts[4]*wts[3]*wts[0]*wts[5];
-    if(rho<(wts[5]*wts[2]*wts[5]*wts[3] + wts[4]*wts[3]*wts[0]*wts[2])) 
-      rho = wts[5]*wts[2]*wts[5]*wts[3] + wts[4]*wts[3]*wts[0]*wts[2];
-    if(rho<(wts[5]*wts[2]*wts[5]*wts[3] + wts[4]*wts[5]*wts[4]*wts[5])) 
-      rho = wts[5]*wts[2]*wts[5]*wts[3] + wts[4]*wts[5]*wts[4]*wts[5];
-    if(rho<(wts[5]*wts[2]*wts[5]*wts[3] + wts[4]*wts[5]*wts[4]*wts[2])) 
-      rho = wts[5]*wts[2]*wts[5]*wts[3] + wts[4]*wts[5]*wts[4]*wts[2];
-    if(rho<(wts[5]*wts[2]*wts[5]*wts[3] + wts[4]*wts[5]*wts[1]*wts[5])) 
-      rho = wts[5]*wts[2]*wts[5]*wts[3] + wts[4]*wts[5]*wts[1]*wts[5];
-    if(rho<(wts[5]*wts[2]*wts[5]*wts[3] + wts[4]*wts[5]*wts[1]*wts[2])) 
-      rho = wts[5]*wts[2]*wts[5]*wts[3] + wts[4]*wts[5]*wts[1]*wts[2];
+    printf("\nMost probable state log-weight: %lf\n", best);
     
-    // 7
-    if(rho<(wts[5]*wts[2]*wts[0]*wts[4] + wts[4]*wts[3]*wts[4]*wts[5])) 
-      rho = wts[5]*wts[2]*wts[0]*wts[4] + wts[4]*wts[3]*wts[4]*wts[5];
-    if(rho<(wts[5]*wts[2]*wts[0]*wts[4] + wts[4]*wts[3]*wts[4]*wts[2])) 
-      rho = wts[5]*wts[2]*wts[0]*wts[4] + wts[4]*wts[3]*wts[4]*wts[2];
-    if(rho<(wts[5]*wts[2]*wts[0]*wts[4] + wts[4]*wts[3]*wts[0]*wts[5])) 
-      rho = wts[5]*wts[2]*wts[0]*wts[4] + wts[4]*wts[3]*wts[0]*wts[5];
-    if(rho<(wts[5]*wts[2]*wts[0]*wts[4] + wts[4]*wts[3]*wts[0]*wts[2])) 
-      rho = wts[5]*wts[2]*wts[0]*wts[4] + wts[4]*wts[3]*wts[0]*wts[2];
-    if(rho<(wts[5]*wts[2]*wts[0]*wts[4] + wts[4]*wts[5]*wts[4]*wts[5])) 
-      rho = wts[5]*wts[2]*wts[0]*wts[4] + wts[4]*wts[5]*wts[4]*wts[5];
-    if(rho<(wts[5]*wts[2]*wts[0]*wts[4] + wts[4]*wts[5]*wts[4]*wts[2])) 
-      rho = wts[5]*wts[2]*wts[0]*wts[4] + wts[4]*wts[5]*wts[4]*wts[2];
-    if(rho<(wts[5]*wts[2]*wts[0]*wts[4] + wts[4]*wts[5]*wts[1]*wts[5])) 
-      rho = wts[5]*wts[2]*wts[0]*wts[4] + wts[4]*wts[5]*wts[1]*wts[5];
-    if(rho<(wts[5]*wts[2]*wts[0]*wts[4] + wts[4]*wts[5]*wts[1]*wts[2])) 
-      rho = wts[5]*wts[2]*wts[0]*wts[4] + wts[4]*wts[5]*wts[1]*wts[2];
+    // write it in the same format as print_text
+    sprintf(name,"%s/%s/optimal.matrix",outputdir,PRINT_VITERBI);
+    if((data = sinkopen(name,"w"))!=NULL) {
+        for(step=0;step<steps;step++) fputc('0' + result[step], data);
+        sinkclose(data);
+    }
     
-    // 8
-    if(rho<(wts[5]*wts[2]*wts[0]*wts[3] + wts[4]*wts[3]*wts[4]*wts[5])) 
-      rho = wts[5]*wts[2]*wts[0]*wts[3] + wts[4]*wts[3]*wts[4]*wts[5];
-    if(rho<(wts[5]*wts[2]*wts[0]*wts[3] + wts[4]*wts[3]*wts[4]*wts[2])) 
-      rho = wts[5]*wts[2]*wts[0]*wts[3] + wts[4]*wts[3]*wts[4]*wts[2];
-    if(rho<(wts[5]*wts[2]*wts[0]*wts[3] + wts[4]*wts[3]*wts[0]*wts[5])) 
-      rho = wts[5]*wts[2]*wts[0]*wts[3] + wts[4]*wts[3]*wts[0]*wts[5];
-    if(rho<(wts[5]*wts[2]*wts[0]*wts[3] + wts[4]*wts[3]*wts[0]*wts[2])) 
-      rho = wts[5]*wts[2]*wts[0]*wts[3] + wts[4]*wts[3]*wts[0]*wts[2];
-    if(rho<(wts[5]*wts[2]*wts[0]*wts[3] + wts[4]*wts[5]*wts[4]*wts[5])) 
-      rho = wts[5]*wts[2]*wts[0]*wts[3] + wts[4]*wts[5]*wts[4]*wts[5];
-    if(rho<(wts[5]*wts[2]*wts[0]*wts[3] + wts[4]*wts[5]*wts[4]*wts[2])) 
-      rho = wts[5]*wts[2]*wts[0]*wts[3] + wts[4]*wts[5]*wts[4]*wts[2];
-    if(rho<(wts[5]*wts[2]*wts[0]*wts[3] + wts[4]*wts[5]*wts[1]*wts[5])) 
-      rho = wts[5]*wts[2]*wts[0]*wts[3] + wts[4]*wts[5]*wts[1]*wts[5];
-    if(rho<(wts[5]*wts[2]*wts[0]*wts[3] + wts[4]*wts[5]*wts[1]*wts[2])) 
-      rho = wts[5]*wts[2]*wts[0]*wts[3] + wts[4]*wts[5]*wts[1]*wts[2];
+    sprintf(name,"%s/%s/optimal.weight",outputdir,PRINT_VITERBI);
+    if((data = sinkopen(name,"a"))!=NULL) {
+        fprintf(data, "%lf\n", best);
+        sinkclose(data);
+    }
     
-    #if DEBUG
-        printf("rho: %lf",rho);
+    free(result);
+    viterbifree();
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void viterbifree(void) {
+    
+    // free(NULL) is harmless, so any exit may call this
+    free(viterbichoice);
+    free(viterbiscore[0]);
+    free(viterbiscore[1]);
+    viterbichoice = NULL;
+    viterbiscore[0] = NULL;
+    viterbiscore[1] = NULL;
+}
+
+//==============================================================================
+////////////////////////////////////********////////////////////////////////////
+//==============================================================================
+
+void *viterbirange(void *arg) {
+    
+    vstruct *job = (vstruct *) arg;
+    int     nstates = 1 << (ncols+1);
+    int     step, r, c, idx, prof, carry, bottom, v, edges, prev;
+    double  *src, *dst, value, best;
+    unsigned char *choice, bv;
+    
+    #if PIN
+    pinthread(job->id);
     #endif
     
-    return rho;
+    for(step=0;step<nrows*ncols;step++) {
+        r = step / ncols;
+        c = step % ncols;
+        src = viterbiscore[step & 1];
+        dst = viterbiscore[(step+1) & 1];
+        choice = viterbichoice + (size_t) step * nstates;
+        
+        for(idx=job->lo;idx<job->hi;idx++) {
+            prof = idx >> 1;
+            carry = idx & 1;
+            bottom = (prof >> c) & 1;
+            best = -HUGE_VAL;
+            bv = 0xFF;
+            
+            // any type whose right and bottom edges give this state
+            for(v=0;v<6;v++) {
+                edges = vertexedges[v];
+                if(((edges >> 2) & 1) != carry || ((edges >> 3) & 1) != bottom) continue;
+                prev = (prof & ~(1 << c)) | (((edges >> 1) & 1) << c);
+                
+                if(c==0) {
+                    // a row starts from the left boundary, and the
+                    // row before it must have met the right boundary
+                    if((edges & 1) != viterbileft[r]) continue;
+                    if(r==0) value = (prev == viterbitop) ? 0 : -HUGE_VAL;
+                    else value = src[(prev << 1) | viterbiright[r-1]];
+                } else {
+                    value = src[(prev << 1) | (edges & 1)];
+                }
+                
+                if(value + viterbilogw[v] > best) {
+                    best = value + viterbilogw[v];
+                    bv = (unsigned char) v;
+                }
+            }
+            dst[idx] = best;
+            choice[idx] = bv;
+        }
+        
+        pthread_barrier_wait(&viterbibarrier);
+    }
+    
+    return NULL;
 }
+#endif
 